@@ -60,7 +60,20 @@
 #define USE_SPI2                0
 #define USE_SPI3                0
 
-#define DEFAULT_USART_BAUD      9600
+#define DEFAULT_USART_BAUD      921600
+// Flow control on the USART2 and USART3 data links: 0 for none or
+// 1 (SERIAL_FLOW_RTSCTS) for hardware RTS/CTS
+#define DATA_USART_FLOW         0
+// Receive into a circular DMA buffer on ports that have an RX DMA channel
+#define USE_SERIAL_RX_DMA       1
+
+// Format printf() output with the allocation-free engine in misc/fmt.c
+// instead of newlib's vfprintf()
+#define USE_FMT_PRINTF          1
+
+// Size of the RAM-backed posixio "mem" device, which lives in external
+// SRAM; 0 for none
+#define MEMFS_SIZE              (512 * 1024)
 
 /* Highest priority (highest number) */
 #define THREAD_PRIO_MAIN        3
@@ -74,6 +87,16 @@
 #define IRQ_PRIO_USART          12
 /* Lowest priority (highest number) */
 
+/* DMA channel priorities, from DMA_PRIO_LOW (0) to DMA_PRIO_VERY_HIGH (3).
+ * Receivers overrun if kept waiting, so USARTs go first. */
+#define DMA_PRIO_USART          3
+#define DMA_PRIO_SPI            2
+#define DMA_PRIO_LCD            1
+#define DMA_PRIO_MEM            0
+
+/* Copies and fills shorter than this are quicker done by the CPU. */
+#define DMA_MEM_MIN_SIZE        128
+
 #define STACK_SIZE_MAIN         2048
 #define STACK_SIZE_CLI          2048
 
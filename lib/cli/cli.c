@@ -15,9 +15,12 @@
 #include <task.h>
 #include <semphr.h>
 #include <posixio/posixio.h>
+#include <stm32/serial.h>
+#include <stm32/dma.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "cli.h"
@@ -57,6 +60,9 @@ static int cmd_tasks(struct cli *cli, int argc, const char *const *argv);
 static int cmd_history(struct cli *cli, int argc, const char *const *argv);
 #endif
 static int cmd_reset(struct cli *cli, int argc, const char *const *argv);
+static int cmd_iostat(struct cli *cli, int argc, const char *const *argv);
+static int cmd_stty(struct cli *cli, int argc, const char *const *argv);
+static int cmd_dma(struct cli *cli, int argc, const char *const *argv);
 
 
 /**
@@ -109,6 +115,42 @@ void cli_init(void)
         .fn     = cmd_reset,
     };
     cli_addcmd(&reset);
+
+    struct cli_command iostat = {
+        .cmd    = "iostat",
+        .brief  = "Prints I/O statistics for devices and open files",
+        .help   = "Outputs the call, byte and error counts, time spent " \
+                  "and latency histogram of each device and each open " \
+                  "file, as found in /sys/io.",
+        .fn     = cmd_iostat,
+    };
+    cli_addcmd(&iostat);
+
+    struct cli_command stty = {
+        .cmd    = "stty",
+        .brief  = "Shows or sets the baud rate of a serial port",
+        .help   = "Prints the baud rate a serial port really runs at, " \
+                  "optionally setting it first, and its receive error " \
+                  "counts. A rate the port cannot reach closely enough " \
+                  "is refused." EOL EOL \
+                  "Usage: stty <port> [speed]" EOL \
+                  "  e.g. stty 1 921600",
+        .fn     = cmd_stty,
+    };
+    cli_addcmd(&stty);
+
+    struct cli_command dma = {
+        .cmd    = "dma",
+        .brief  = "Prints DMA channel activity and errors",
+        .help   = "Outputs, for each DMA channel in use, who has it, the " \
+                  "transfers and items it has moved, how much of the time " \
+                  "it was busy, its interrupts and transfer errors, and " \
+                  "the longest its interrupt handler has run. With -c the " \
+                  "counts are then cleared." EOL EOL \
+                  "Usage: dma [-c]",
+        .fn     = cmd_dma,
+    };
+    cli_addcmd(&dma);
 }
 
 
@@ -533,4 +575,136 @@ static int cmd_reset(struct cli *cli, int argc, const char *const *argv)
     NVIC_SystemReset();
 }
 
+
+/**
+ * Command that prints the I/O statistics kept by posixio.
+ */
+static int cmd_iostat(struct cli *cli, int argc, const char *const *argv)
+{
+    char buf[64];
+    ssize_t len;
+    int fd;
+
+    fd = open("/sys/io", O_RDONLY);
+    if (fd == -1) {
+        fprintf(cli->out, "Unable to open /sys/io." EOL);
+        return 1;
+    }
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+        fwrite(buf, 1, len, cli->out);
+
+    close(fd);
+    return 0;
+}
+
+
+/**
+ * Command that shows, and optionally sets, the baud rate of a serial
+ * port, and shows its receive error counts. When setting, the error
+ * between the rate asked for and the one the port achieved is shown too.
+ */
+static int cmd_stty(struct cli *cli, int argc, const char *const *argv)
+{
+    char path[32];
+    unsigned int speed = 0, baud;
+    struct serial_errors errs;
+    int fd;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(cli->out, "Usage: stty <port> [speed]" EOL);
+        return 1;
+    }
+
+    snprintf(path, sizeof(path), "/serial/%s", argv[1]);
+    fd = open(path, O_RDWR);
+    if (fd == -1) {
+        fprintf(cli->out, "Unable to open %s." EOL, path);
+        return 1;
+    }
+
+    if (argc == 3) {
+        speed = strtoul(argv[2], NULL, 10);
+        if (ioctl(fd, IOCTL_SETBAUD, speed) == -1) {
+            fprintf(cli->out, "%s cannot run at %u baud." EOL, path, speed);
+            close(fd);
+            return 1;
+        }
+    }
+
+    if (ioctl(fd, IOCTL_GETBAUD, &baud) == -1
+            || ioctl(fd, IOCTL_GETERRORS, &errs) == -1) {
+        fprintf(cli->out, "Unable to get the settings of %s." EOL, path);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    fprintf(cli->out, "%s: %u baud", path, baud);
+    if (speed) {
+        int err = (int)(((int64_t)baud - speed) * 10000 / speed);
+
+        fprintf(cli->out, " (asked for %u, error %c%d.%02d%%)",
+                speed, err < 0 ? '-' : '+', abs(err) / 100, abs(err) % 100);
+    }
+    fprintf(cli->out, EOL);
+    fprintf(cli->out, "overrun %lu noise %lu framing %lu parity %lu dropped %lu" EOL,
+            (unsigned long)errs.overrun, (unsigned long)errs.noise,
+            (unsigned long)errs.framing, (unsigned long)errs.parity,
+            (unsigned long)errs.dropped);
+
+    return 0;
+}
+
+
+/**
+ * Command that prints the per-channel DMA counts, and optionally clears
+ * them. Busy time is shown as a share of the time since they were last
+ * cleared, or since startup.
+ */
+static int cmd_dma(struct cli *cli, int argc, const char *const *argv)
+{
+    static TickType_t cleared;
+    TickType_t now = xTaskGetTickCount();
+    uint64_t elapsed = (uint64_t)(now - cleared)
+                       * (SystemCoreClock / configTICK_RATE_HZ);
+    int clear = argc > 1 && !strcmp(argv[1], "-c");
+
+    if (argc > 2 || (argc > 1 && !clear)) {
+        fprintf(cli->out, "Usage: dma [-c]" EOL);
+        return 1;
+    }
+
+#if !DMA_STATS
+    fprintf(cli->out, "DMA statistics are not being kept." EOL);
+#endif
+    fprintf(cli->out, "%-4s %-8s %10s %10s %5s %10s %7s %8s" EOL,
+            "Ch", "Owner", "Transfers", "Items", "Busy", "IRQs",
+            "Errors", "ISR cyc");
+
+    for (int i = 0; i < DMA_STREAMS; i++) {
+        const char *owner = dma_channel_owner(i);
+        struct dma_stats st;
+
+        dma_get_stats(i, &st);
+        if (owner == NULL && !st.irqs)
+            continue;
+
+        fprintf(cli->out, "%d:%-2d %-8s %10lu %10lu %4u%% %10lu %7lu %8lu" EOL,
+                i < 7 ? 1 : 2, i < 7 ? i + 1 : i - 6,
+                owner != NULL ? owner : "-",
+                (unsigned long)st.transfers, (unsigned long)st.items,
+                elapsed ? (unsigned int)(st.busy * 100 / elapsed) : 0,
+                (unsigned long)st.irqs, (unsigned long)st.errors,
+                (unsigned long)st.isr_max);
+    }
+
+    if (clear) {
+        dma_clear_stats();
+        cleared = now;
+    }
+
+    return 0;
+}
+
 // vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
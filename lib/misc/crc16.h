@@ -0,0 +1,53 @@
+/** CRC-16 checks
+ * \file lib/misc/crc16.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef __CRC16_H__
+#define __CRC16_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * CRC-16/CCITT-FALSE: poly 0x1021, init 0xffff, not reflected, no final XOR.
+ */
+
+/** The type of the CRC values. */
+typedef uint16_t crc16_t;
+
+
+/**
+ * Calculate the initial crc value.
+ *
+ * \return     The initial crc value.
+ */
+static inline crc16_t crc16_init(void)
+{
+    return 0xffff;
+}
+
+
+crc16_t crc16_update(crc16_t crc, const void *data, size_t data_len);
+
+
+/**
+ * Calculate the final crc value.
+ *
+ * \param crc  The current crc value.
+ * \return     The final crc value.
+ */
+static inline crc16_t crc16_finalize(crc16_t crc)
+{
+    return crc;
+}
+
+#endif      /* __CRC16_H__ */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -0,0 +1,54 @@
+/** CRC-32 checks
+ * \file lib/misc/crc32.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef __CRC32_H__
+#define __CRC32_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * CRC-32 as used by Ethernet and zlib: poly 0x04c11db7 reflected, init and
+ * final XOR 0xffffffff.
+ */
+
+/** The type of the CRC values. */
+typedef uint32_t crc32_t;
+
+
+/**
+ * Calculate the initial crc value.
+ *
+ * \return     The initial crc value.
+ */
+static inline crc32_t crc32_init(void)
+{
+    return 0xffffffff;
+}
+
+
+crc32_t crc32_update(crc32_t crc, const void *data, size_t data_len);
+
+
+/**
+ * Calculate the final crc value.
+ *
+ * \param crc  The current crc value.
+ * \return     The final crc value.
+ */
+static inline crc32_t crc32_finalize(crc32_t crc)
+{
+    return crc ^ 0xffffffff;
+}
+
+#endif      /* __CRC32_H__ */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
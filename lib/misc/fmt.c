@@ -0,0 +1,480 @@
+/** Compact formatted output
+ *
+ * A small printf engine that hands its output to a callback as it goes,
+ * rather than building it in a buffer. It keeps no state outside the call
+ * and never allocates, so it is safe from any task and from fault
+ * handlers, and its stack use is a few dozen bytes plus the callback's.
+ *
+ * It understands the flags \c - \c + space \c # \c 0, field width and
+ * precision (including \c *), the length modifiers \c hh \c h \c l \c ll
+ * \c j \c z \c t, and the conversions \c d \c i \c u \c o \c x \c X \c c
+ * \c s \c p \c f \c F and \c %. Other conversions are copied through as
+ * they are. \c %f takes at most nine decimal places, rounds halves away
+ * from zero and prints magnitudes of 2^64 or more as \c "ovf".
+ *
+ * \file lib/misc/fmt.c
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#include <config.h>
+#include <misc/fmt.h>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#define FL_LEFT     0x01    ///< \c - Left justify.
+#define FL_PLUS     0x02    ///< \c + Always give a sign.
+#define FL_SPACE    0x04    ///< space: Space in place of a \c + sign.
+#define FL_ALT      0x08    ///< \c # Alternate form.
+#define FL_ZERO     0x10    ///< \c 0 Pad with zeros.
+#define FL_UPPER    0x20    ///< Upper case hex digits.
+
+/** State of one formatting call. */
+struct fmt_state {
+    fmt_out_t   out;    ///< Where the output goes.
+    void        *ctx;   ///< Passed to \c out.
+    int         count;  ///< Characters produced so far.
+};
+
+/** Pass some output to the callback. */
+static void fmt_emit(struct fmt_state *st, const char *s, size_t len)
+{
+    if (len) {
+        st->out(st->ctx, s, len);
+        st->count += len;
+    }
+}
+
+/** Emit \c n copies of a padding character, which must be ' ' or '0'. */
+static void fmt_pad(struct fmt_state *st, char c, int n)
+{
+    static const char spaces[] = "                ";
+    static const char zeros[]  = "0000000000000000";
+    const char *src = c == '0' ? zeros : spaces;
+
+    while (n > 0) {
+        int chunk = n < 16 ? n : 16;
+
+        fmt_emit(st, src, chunk);
+        n -= chunk;
+    }
+}
+
+/**
+ * Emit a field made of a prefix (sign or \c 0x), leading zeros and a body,
+ * padded out to \c width.
+ */
+static void fmt_field(struct fmt_state *st, int flags, int width,
+                      const char *prefix, int plen, int zeros,
+                      const char *body, int blen)
+{
+    int len = plen + zeros + blen;
+
+    if ((flags & (FL_ZERO | FL_LEFT)) == FL_ZERO && width > len) {
+        zeros += width - len;
+        len = width;
+    }
+
+    if (!(flags & FL_LEFT))
+        fmt_pad(st, ' ', width - len);
+    fmt_emit(st, prefix, plen);
+    fmt_pad(st, '0', zeros);
+    fmt_emit(st, body, blen);
+    if (flags & FL_LEFT)
+        fmt_pad(st, ' ', width - len);
+}
+
+/**
+ * Write the digits of \c v in \c base backwards, ending just before
+ * \c end. Values that fit 32 bits avoid the slow 64-bit division.
+ *
+ * @returns A pointer to the first digit.
+ */
+static char *fmt_digits(char *end, uint64_t v, unsigned base, int upper)
+{
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char *p = end;
+
+    while (v >> 32) {
+        *--p = digits[v % base];
+        v /= base;
+    }
+    for (uint32_t w = (uint32_t)v; w; w /= base)
+        *--p = digits[w % base];
+
+    return p;
+}
+
+/** Format an integer conversion. */
+static void fmt_int(struct fmt_state *st, uint64_t v, int neg, unsigned base,
+                    int flags, int width, int prec)
+{
+    char buf[24];
+    char prefix[2];
+    int plen = 0;
+    char *end = buf + sizeof(buf);
+    char *p = fmt_digits(end, v, base, flags & FL_UPPER);
+
+    // the digit for zero is only left out when the precision is zero
+    if (!v && prec != 0)
+        *--p = '0';
+
+    int blen = end - p;
+    int zeros = prec > blen ? prec - blen : 0;
+
+    if (base == 10) {
+        if (neg)
+            prefix[plen++] = '-';
+        else if (flags & FL_PLUS)
+            prefix[plen++] = '+';
+        else if (flags & FL_SPACE)
+            prefix[plen++] = ' ';
+    } else if (flags & FL_ALT) {
+        if (base == 16 && v) {
+            prefix[plen++] = '0';
+            prefix[plen++] = (flags & FL_UPPER) ? 'X' : 'x';
+        } else if (base == 8 && !zeros && (!blen || *p != '0')) {
+            zeros = 1;
+        }
+    }
+
+    // a precision turns off zero padding
+    if (prec >= 0)
+        flags &= ~FL_ZERO;
+
+    fmt_field(st, flags, width, prefix, plen, zeros, p, blen);
+}
+
+/** Format a \c %f conversion. */
+static void fmt_float(struct fmt_state *st, double v, int flags, int width,
+                      int prec)
+{
+    static const uint32_t scale[] = {
+        1, 10, 100, 1000, 10000, 100000,
+        1000000, 10000000, 100000000, 1000000000,
+    };
+    char buf[32];
+    char prefix[1];
+    int plen = 0;
+    char *end = buf + sizeof(buf);
+    char *p = end;
+
+    if (signbit(v)) {
+        prefix[plen++] = '-';
+        v = -v;
+    } else if (flags & FL_PLUS) {
+        prefix[plen++] = '+';
+    } else if (flags & FL_SPACE) {
+        prefix[plen++] = ' ';
+    }
+
+    if (isnan(v) || v >= 18446744073709551616.0) {
+        const char *s = isnan(v) ? "nan" : (isinf(v) ? "inf" : "ovf");
+
+        fmt_field(st, flags & ~FL_ZERO, width, prefix, plen, 0, s, 3);
+        return;
+    }
+
+    if (prec < 0)
+        prec = 6;
+    else if (prec > 9)
+        prec = 9;
+
+    uint64_t ipart = (uint64_t)v;
+    uint32_t frac = (uint32_t)((v - ipart) * scale[prec] + 0.5);
+
+    if (frac >= scale[prec]) {
+        frac -= scale[prec];
+        ipart++;
+    }
+
+    if (prec || (flags & FL_ALT)) {
+        for (int i = 0; i < prec; i++, frac /= 10)
+            *--p = '0' + frac % 10;
+        *--p = '.';
+    }
+    p = fmt_digits(p, ipart, 10, 0);
+    if (!ipart)
+        *--p = '0';
+
+    fmt_field(st, flags, width, prefix, plen, 0, p, end - p);
+}
+
+/**
+ * Format a string as \c vprintf() would, passing the result to a
+ * callback piece by piece.
+ *
+ * @param out Called with each piece of output, in order.
+ * @param ctx Passed to \c out.
+ * @param fmt The format string.
+ * @param ap The values to format.
+ * @returns The number of characters produced.
+ */
+int fmt_vformat(fmt_out_t out, void *ctx, const char *fmt, va_list ap)
+{
+    struct fmt_state st = { out, ctx, 0 };
+
+    while (*fmt) {
+        // literal text goes out straight from the format string
+        const char *lit = fmt;
+
+        while (*fmt && *fmt != '%')
+            fmt++;
+        fmt_emit(&st, lit, fmt - lit);
+        if (!*fmt)
+            break;
+
+        const char *spec = fmt++;
+        int flags = 0, width = 0, prec = -1, lng = 0;
+
+        for (;; fmt++) {
+            if (*fmt == '-') flags |= FL_LEFT;
+            else if (*fmt == '+') flags |= FL_PLUS;
+            else if (*fmt == ' ') flags |= FL_SPACE;
+            else if (*fmt == '#') flags |= FL_ALT;
+            else if (*fmt == '0') flags |= FL_ZERO;
+            else break;
+        }
+
+        if (*fmt == '*') {
+            width = va_arg(ap, int);
+            if (width < 0) {
+                flags |= FL_LEFT;
+                width = -width;
+            }
+            fmt++;
+        } else {
+            while (*fmt >= '0' && *fmt <= '9')
+                width = width * 10 + *fmt++ - '0';
+        }
+
+        if (*fmt == '.') {
+            fmt++;
+            prec = 0;
+            if (*fmt == '*') {
+                prec = va_arg(ap, int);
+                fmt++;
+            } else {
+                while (*fmt >= '0' && *fmt <= '9')
+                    prec = prec * 10 + *fmt++ - '0';
+            }
+        }
+
+        // lng: -2 char, -1 short, 0 int, 1 long, 2 long long
+        for (;; fmt++) {
+            if (*fmt == 'h') lng--;
+            else if (*fmt == 'l') lng++;
+            else if (*fmt == 'j') lng = 2;
+            else if (*fmt == 'z' || *fmt == 't') lng = sizeof(size_t) > sizeof(int) ? 1 : 0;
+            else if (*fmt == 'L') continue;
+            else break;
+        }
+
+        uint64_t v;
+        int64_t sv;
+        unsigned base = 10;
+
+        switch (*fmt) {
+        case 'd':
+        case 'i':
+            if (lng >= 2) sv = va_arg(ap, long long);
+            else if (lng == 1) sv = va_arg(ap, long);
+            else sv = va_arg(ap, int);
+            if (lng == -1) sv = (short)sv;
+            else if (lng <= -2) sv = (signed char)sv;
+
+            v = sv < 0 ? -(uint64_t)sv : (uint64_t)sv;
+            fmt_int(&st, v, sv < 0, 10, flags, width, prec);
+            break;
+
+        case 'X':
+            flags |= FL_UPPER;
+            // fall through
+        case 'x':
+            base = 16;
+            goto unsigned_conv;
+        case 'o':
+            base = 8;
+            // fall through
+        case 'u':
+unsigned_conv:
+            if (lng >= 2) v = va_arg(ap, unsigned long long);
+            else if (lng == 1) v = va_arg(ap, unsigned long);
+            else v = va_arg(ap, unsigned int);
+            if (lng == -1) v = (unsigned short)v;
+            else if (lng <= -2) v = (unsigned char)v;
+
+            fmt_int(&st, v, 0, base, flags, width, prec);
+            break;
+
+        case 'p':
+            v = (uintptr_t)va_arg(ap, void *);
+            fmt_int(&st, v, 0, 16, flags | FL_ALT, width, prec);
+            break;
+
+        case 'c': {
+            char c = (char)va_arg(ap, int);
+
+            fmt_field(&st, flags & ~FL_ZERO, width, NULL, 0, 0, &c, 1);
+            break;
+        }
+
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            int len = 0;
+
+            if (s == NULL)
+                s = "(null)";
+            while (s[len] && (prec < 0 || len < prec))
+                len++;
+            fmt_field(&st, flags & ~FL_ZERO, width, NULL, 0, 0, s, len);
+            break;
+        }
+
+        case 'f':
+        case 'F':
+            fmt_float(&st, va_arg(ap, double), flags, width, prec);
+            break;
+
+        case '%':
+            fmt_emit(&st, "%", 1);
+            break;
+
+        default:
+            // not something we know; show it as it was
+            if (*fmt)
+                fmt++;
+            fmt_emit(&st, spec, fmt - spec);
+            continue;
+        }
+        fmt++;
+    }
+
+    return st.count;
+}
+
+/**
+ * Format a string as \c printf() would, passing the result to a callback
+ * piece by piece.
+ *
+ * @param out Called with each piece of output, in order.
+ * @param ctx Passed to \c out.
+ * @param fmt The format string.
+ * @param ... The values to format.
+ * @returns The number of characters produced.
+ */
+int fmt_format(fmt_out_t out, void *ctx, const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+
+    va_start(ap, fmt);
+    ret = fmt_vformat(out, ctx, fmt, ap);
+    va_end(ap);
+
+    return ret;
+}
+
+/** Where fmt_vsnprintf() is up to. */
+struct fmt_buf {
+    char    *p;     ///< Next character goes here.
+    size_t  left;   ///< Room left, not counting the NUL.
+};
+
+/** Output callback for fmt_vsnprintf(). */
+static void fmt_buf_out(void *ctx, const char *s, size_t len)
+{
+    struct fmt_buf *b = (struct fmt_buf *)ctx;
+
+    if (len > b->left)
+        len = b->left;
+    memcpy(b->p, s, len);
+    b->p += len;
+    b->left -= len;
+}
+
+/**
+ * Format into a buffer, as \c vsnprintf().
+ *
+ * @param buf The buffer.
+ * @param size The size of the buffer; the output is truncated to fit,
+ *      including its NUL.
+ * @param fmt The format string.
+ * @param ap The values to format.
+ * @returns The length the whole output would have had.
+ */
+int fmt_vsnprintf(char *buf, size_t size, const char *fmt, va_list ap)
+{
+    struct fmt_buf b = { buf, size ? size - 1 : 0 };
+    int ret = fmt_vformat(fmt_buf_out, &b, fmt, ap);
+
+    if (size)
+        *b.p = '\0';
+
+    return ret;
+}
+
+/**
+ * Format into a buffer, as \c snprintf().
+ *
+ * @param buf The buffer.
+ * @param size The size of the buffer; the output is truncated to fit,
+ *      including its NUL.
+ * @param fmt The format string.
+ * @param ... The values to format.
+ * @returns The length the whole output would have had.
+ */
+int fmt_snprintf(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+
+    va_start(ap, fmt);
+    ret = fmt_vsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+
+    return ret;
+}
+
+
+#if USE_FMT_PRINTF
+/** Output callback that writes to a stdio stream. */
+static void fmt_file_out(void *ctx, const char *s, size_t len)
+{
+    fwrite(s, 1, len, (FILE *)ctx);
+}
+
+/**
+ * Replaces the C library's \c vprintf() so that output to \c stdout is
+ * formatted by fmt_vformat() instead of newlib's \c vfprintf(), which
+ * needs far more stack and may allocate.
+ */
+int vprintf(const char *fmt, va_list ap)
+{
+    return fmt_vformat(fmt_file_out, stdout, fmt, ap);
+}
+
+/** Replaces the C library's \c printf(); see vprintf(). */
+int printf(const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+
+    va_start(ap, fmt);
+    ret = fmt_vformat(fmt_file_out, stdout, fmt, ap);
+    va_end(ap);
+
+    return ret;
+}
+#endif
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -0,0 +1,34 @@
+/** Compact formatted output
+ * \file lib/misc/fmt.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef _MISC_FMT_H
+#define _MISC_FMT_H
+
+#include <stddef.h>
+#include <stdarg.h>
+
+/**
+ * Receives formatted output. Called with each run of literal text straight
+ * from the format string and each converted field, in order; \c s is not
+ * NUL terminated.
+ */
+typedef void (*fmt_out_t)(void *ctx, const char *s, size_t len);
+
+int fmt_vformat(fmt_out_t out, void *ctx, const char *fmt, va_list ap);
+int fmt_format(fmt_out_t out, void *ctx, const char *fmt, ...)
+    __attribute__ ((format(printf, 3, 4)));
+int fmt_vsnprintf(char *buf, size_t size, const char *fmt, va_list ap);
+int fmt_snprintf(char *buf, size_t size, const char *fmt, ...)
+    __attribute__ ((format(printf, 3, 4)));
+
+#endif /* _MISC_FMT_H */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -0,0 +1,472 @@
+/** Packet framing
+ *
+ * Turns a byte stream into discrete frames, each optionally carrying a
+ * CRC trailer. Two codecs are offered:
+ *
+ * - COBS, which rewrites the frame so it contains no \c 0x00 bytes and
+ *   then uses \c 0x00 as the delimiter. It costs at most one byte in 254.
+ * - SLIP, which escapes \c 0xc0 and \c 0xdb in place and uses \c 0xc0 as
+ *   the delimiter. It is cheaper to eyeball, but can double the length.
+ *
+ * Both put a delimiter before and after each frame so a receiver that
+ * starts in the middle of one resynchronizes on the next.
+ *
+ * The encoder never builds the frame in a buffer of its own; it hands the
+ * caller runs of the source data, interleaved with the few bytes the codec
+ * adds, so that they can be copied straight into wherever they are going,
+ * such as a serial transmit ring. The decoder likewise takes whatever
+ * chunk of received data the caller has and copies runs of it at a time.
+ *
+ * \file lib/misc/frame.c
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#include <misc/frame.h>
+#include <misc/crc16.h>
+#include <misc/crc32.h>
+
+#include <string.h>
+
+#define COBS_DELIM      0x00    ///< COBS frame delimiter.
+#define COBS_MAX_RUN    254     ///< Most data bytes in one COBS block.
+
+#define SLIP_END        0xc0    ///< SLIP frame delimiter.
+#define SLIP_ESC        0xdb    ///< SLIP escape.
+#define SLIP_ESC_END    0xdc    ///< SLIP escaped \c SLIP_END.
+#define SLIP_ESC_ESC    0xdd    ///< SLIP escaped \c SLIP_ESC.
+
+/** Payload and trailer, which are encoded as though they were contiguous. */
+struct frame_src {
+    const uint8_t   *p[2];  ///< Start of each part.
+    size_t          n[2];   ///< Length of each part.
+    int             part;   ///< Part being read.
+    size_t          off;    ///< Offset into that part.
+};
+
+/** Compute the trailer for a frame; returns its length. */
+static size_t frame_trailer(enum frame_check check, const void *data,
+                            size_t len, uint8_t *trailer)
+{
+    uint32_t crc;
+
+    switch (check) {
+    case FRAME_CRC16:
+        crc = crc16_finalize(crc16_update(crc16_init(), data, len));
+        break;
+
+    case FRAME_CRC32:
+        crc = crc32_finalize(crc32_update(crc32_init(), data, len));
+        break;
+
+    default:
+        return 0;
+    }
+
+    for (int i = 0; i < FRAME_CHECK_LEN(check); i++, crc >>= 8)
+        trailer[i] = crc & 0xff;
+
+    return FRAME_CHECK_LEN(check);
+}
+
+/** Step over parts that are used up; returns nonzero if all are. */
+static int frame_src_end(struct frame_src *src)
+{
+    while (src->part < 2 && src->off == src->n[src->part]) {
+        src->part++;
+        src->off = 0;
+    }
+    return src->part == 2;
+}
+
+/**
+ * Pass \c len bytes from the source to \c out, moving it along.
+ * The caller knows there are that many.
+ */
+static void frame_src_out(struct frame_src *src, size_t len,
+                          frame_out_t out, void *ctx)
+{
+    while (len) {
+        frame_src_end(src);
+
+        size_t n = src->n[src->part] - src->off;
+        if (n > len)
+            n = len;
+
+        out(ctx, src->p[src->part] + src->off, n);
+        src->off += n;
+        len -= n;
+    }
+}
+
+/** COBS: emit the source as blocks of up to 254 non-zero bytes. */
+static size_t frame_cobs_encode(struct frame_src *src, frame_out_t out,
+                                void *ctx)
+{
+    static const uint8_t delim = COBS_DELIM;
+    size_t total = 2;
+
+    out(ctx, &delim, 1);
+
+    for (;;) {
+        // measure the run of non-zero bytes, which may span both parts
+        struct frame_src scan = *src;
+        size_t run = 0;
+
+        while (run < COBS_MAX_RUN && !frame_src_end(&scan)) {
+            const uint8_t *p = scan.p[scan.part] + scan.off;
+            size_t n = scan.n[scan.part] - scan.off;
+
+            if (n > COBS_MAX_RUN - run)
+                n = COBS_MAX_RUN - run;
+
+            const uint8_t *z = memchr(p, 0, n);
+            if (z != NULL)
+                n = z - p;
+
+            run += n;
+            scan.off += n;
+            if (z != NULL)
+                break;
+        }
+
+        uint8_t code = run + 1;
+        out(ctx, &code, 1);
+        frame_src_out(src, run, out, ctx);
+        total += run + 1;
+
+        // A full block implies no zero; anything shorter ends at one,
+        // or at the end of the frame.
+        if (frame_src_end(src))
+            break;
+        if (run < COBS_MAX_RUN)
+            src->off++;     // the zero the block stands for
+    }
+
+    out(ctx, &delim, 1);
+    return total;
+}
+
+/** SLIP: emit the source with the two special bytes escaped. */
+static size_t frame_slip_encode(struct frame_src *src, frame_out_t out,
+                                void *ctx)
+{
+    static const uint8_t end = SLIP_END;
+    static const uint8_t esc_end[2] = { SLIP_ESC, SLIP_ESC_END };
+    static const uint8_t esc_esc[2] = { SLIP_ESC, SLIP_ESC_ESC };
+    size_t total = 2;
+
+    out(ctx, &end, 1);
+
+    for (int part = 0; part < 2; part++) {
+        const uint8_t *p = src->p[part];
+        const uint8_t *e = p + src->n[part];
+
+        while (p < e) {
+            const uint8_t *q = p;
+
+            while (q < e && *q != SLIP_END && *q != SLIP_ESC)
+                q++;
+
+            if (q > p) {
+                out(ctx, p, q - p);
+                total += q - p;
+            }
+            if (q < e) {
+                out(ctx, *q == SLIP_END ? esc_end : esc_esc, 2);
+                total += 2;
+                q++;
+            }
+            p = q;
+        }
+    }
+
+    out(ctx, &end, 1);
+    return total;
+}
+
+/**
+ * Encode a frame. The encoded frame is passed to \c out in pieces, in
+ * order, without being assembled anywhere first.
+ *
+ * @param codec How to delimit the frame.
+ * @param check What check to append to it.
+ * @param data The payload.
+ * @param len The length of the payload.
+ * @param out Called with each piece of the encoded frame.
+ * @param ctx Passed to \c out.
+ * @returns the encoded length, which is at most
+ *      \c FRAME_ENCODED_MAX(codec, check, len).
+ */
+size_t frame_encode(enum frame_codec codec, enum frame_check check,
+                    const void *data, size_t len, frame_out_t out, void *ctx)
+{
+    uint8_t trailer[4];
+    struct frame_src src = {
+        .p = { data, trailer },
+        .n = { len, frame_trailer(check, data, len, trailer) },
+    };
+
+    if (codec == FRAME_SLIP)
+        return frame_slip_encode(&src, out, ctx);
+    return frame_cobs_encode(&src, out, ctx);
+}
+
+/** Output state for frame_encode_buf(). */
+struct frame_buf {
+    uint8_t *p;     ///< Where the next byte goes.
+    size_t  left;   ///< Space left.
+    int     over;   ///< It did not fit.
+};
+
+static void frame_buf_out(void *ctx, const void *data, size_t len)
+{
+    struct frame_buf *fb = (struct frame_buf *)ctx;
+
+    if (len > fb->left) {
+        fb->over = 1;
+        len = fb->left;
+    }
+    memcpy(fb->p, data, len);
+    fb->p += len;
+    fb->left -= len;
+}
+
+/**
+ * Encode a frame into a buffer.
+ *
+ * @param codec How to delimit the frame.
+ * @param check What check to append to it.
+ * @param data The payload.
+ * @param len The length of the payload.
+ * @param buf Where to put the encoded frame.
+ * @param size The size of \c buf.
+ * @returns the encoded length, or \c 0 if it did not fit.
+ */
+size_t frame_encode_buf(enum frame_codec codec, enum frame_check check,
+                        const void *data, size_t len, void *buf, size_t size)
+{
+    struct frame_buf fb = { buf, size, 0 };
+    size_t total = frame_encode(codec, check, data, len, frame_buf_out, &fb);
+
+    return fb.over ? 0 : total;
+}
+
+/**
+ * Prepare a decoder.
+ *
+ * @param dec The decoder.
+ * @param codec How frames are delimited.
+ * @param check What check frames carry.
+ * @param buf Where frames are assembled; it must hold the largest
+ *      expected payload plus its check.
+ * @param size The size of \c buf.
+ */
+void frame_dec_init(struct frame_dec *dec, enum frame_codec codec,
+                    enum frame_check check, void *buf, size_t size)
+{
+    memset(dec, '\0', sizeof(*dec));
+    dec->buf = buf;
+    dec->size = size;
+    dec->codec = codec;
+    dec->check = check;
+}
+
+/**
+ * Forget any partly assembled frame, such as after changing the codec.
+ * The counters are kept.
+ *
+ * @param dec The decoder.
+ */
+void frame_dec_reset(struct frame_dec *dec)
+{
+    dec->len = 0;
+    dec->code = 0;
+    dec->zero = 0;
+    dec->esc = 0;
+    dec->bad = 0;
+}
+
+/** Append to the frame, or mark it bad if it would overflow. */
+static void frame_dec_put(struct frame_dec *dec, const uint8_t *p, size_t len)
+{
+    if (dec->bad)
+        return;
+
+    if (len > dec->size - dec->len) {
+        dec->bad = 1;
+        return;
+    }
+
+    memcpy(dec->buf + dec->len, p, len);
+    dec->len += len;
+}
+
+/**
+ * A delimiter arrived; check what came before it.
+ * @returns the payload length if it is a good frame, otherwise \c -1.
+ */
+static ssize_t frame_dec_end(struct frame_dec *dec)
+{
+    size_t len = dec->len;
+    int bad = dec->bad || dec->esc || dec->code;
+    size_t clen = FRAME_CHECK_LEN(dec->check);
+
+    frame_dec_reset(dec);
+
+    // back to back delimiters, as between frames, are not a frame
+    if (!len && !bad)
+        return -1;
+
+    if (bad || len < clen) {
+        dec->stats.errors++;
+        return -1;
+    }
+
+    if (clen) {
+        uint8_t trailer[4];
+
+        len -= clen;
+        frame_trailer(dec->check, dec->buf, len, trailer);
+        if (memcmp(trailer, dec->buf + len, clen)) {
+            dec->stats.crc_errors++;
+            return -1;
+        }
+    }
+
+    dec->stats.frames++;
+    return len;
+}
+
+static ssize_t frame_cobs_decode(struct frame_dec *dec, const uint8_t *p,
+                                 size_t len, size_t *used)
+{
+    static const uint8_t zero = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        if (!dec->code) {
+            uint8_t c = p[i++];
+
+            if (c == COBS_DELIM) {
+                // a trailing owed zero is the end of the frame, not data
+                dec->zero = 0;
+                ssize_t ret = frame_dec_end(dec);
+                if (ret >= 0) {
+                    *used = i;
+                    return ret;
+                }
+                continue;
+            }
+
+            if (dec->zero)
+                frame_dec_put(dec, &zero, 1);
+            dec->code = c - 1;
+            dec->zero = c != COBS_MAX_RUN + 1;
+            continue;
+        }
+
+        size_t n = len - i;
+        if (n > dec->code)
+            n = dec->code;
+
+        // a delimiter inside a block means the frame was cut short
+        const uint8_t *z = memchr(p + i, COBS_DELIM, n);
+        if (z != NULL) {
+            n = z - (p + i);
+            dec->bad = 1;
+        }
+
+        frame_dec_put(dec, p + i, n);
+        i += n;
+        dec->code = z != NULL ? 0 : dec->code - n;
+    }
+
+    *used = i;
+    return -1;
+}
+
+static ssize_t frame_slip_decode(struct frame_dec *dec, const uint8_t *p,
+                                 size_t len, size_t *used)
+{
+    static const uint8_t end = SLIP_END;
+    static const uint8_t esc = SLIP_ESC;
+    size_t i = 0;
+
+    while (i < len) {
+        uint8_t c = p[i];
+
+        if (dec->esc) {
+            if (c == SLIP_END) {
+                // leave it to be seen as the delimiter
+                dec->bad = 1;
+                dec->esc = 0;
+                continue;
+            }
+            i++;
+            dec->esc = 0;
+            if (c == SLIP_ESC_END)
+                frame_dec_put(dec, &end, 1);
+            else if (c == SLIP_ESC_ESC)
+                frame_dec_put(dec, &esc, 1);
+            else
+                dec->bad = 1;
+            continue;
+        }
+
+        if (c == SLIP_END) {
+            i++;
+            ssize_t ret = frame_dec_end(dec);
+            if (ret >= 0) {
+                *used = i;
+                return ret;
+            }
+            continue;
+        }
+
+        if (c == SLIP_ESC) {
+            i++;
+            dec->esc = 1;
+            continue;
+        }
+
+        size_t j = i + 1;
+        while (j < len && p[j] != SLIP_END && p[j] != SLIP_ESC)
+            j++;
+
+        frame_dec_put(dec, p + i, j - i);
+        i = j;
+    }
+
+    *used = i;
+    return -1;
+}
+
+/**
+ * Feed received data to a decoder. It stops at the end of the first good
+ * frame, which is left at the start of the decoder buffer; anything after
+ * it is not consumed, so should be passed in again. Bad frames are
+ * dropped, and counted, without stopping.
+ *
+ * @param dec The decoder.
+ * @param data The received data.
+ * @param len The length of \c data.
+ * @param used Set to the number of bytes of \c data consumed.
+ * @returns the payload length of a complete frame, or \c -1 if all of
+ *      \c data was consumed without finishing one. The payload is valid
+ *      until the next call.
+ */
+ssize_t frame_decode(struct frame_dec *dec, const void *data, size_t len,
+                     size_t *used)
+{
+    if (dec->codec == FRAME_SLIP)
+        return frame_slip_decode(dec, data, len, used);
+    return frame_cobs_decode(dec, data, len, used);
+}
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -0,0 +1,85 @@
+/** Packet framing
+ * \file lib/misc/frame.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef _MISC_FRAME_H
+#define _MISC_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/** How frames are delimited on the wire. */
+enum frame_codec {
+    FRAME_COBS = 0,     ///< Consistent Overhead Byte Stuffing, delimited by \c 0x00.
+    FRAME_SLIP,         ///< RFC 1055 SLIP, delimited by \c 0xc0.
+};
+
+/** The check appended to each frame, least significant byte first. */
+enum frame_check {
+    FRAME_CRC_NONE = 0, ///< No check.
+    FRAME_CRC16,        ///< CRC-16/CCITT-FALSE, see \c misc/crc16.h.
+    FRAME_CRC32,        ///< CRC-32 (IEEE 802.3), see \c misc/crc32.h.
+};
+
+/** Bytes of trailer a check adds to each frame. */
+#define FRAME_CHECK_LEN(check) \
+    ((check) == FRAME_CRC32 ? 4 : (check) == FRAME_CRC16 ? 2 : 0)
+
+/**
+ * The most bytes a frame of \c len bytes of payload can take on the wire,
+ * delimiters included.
+ */
+#define FRAME_ENCODED_MAX(codec, check, len) \
+    ((codec) == FRAME_SLIP ? \
+        2 * ((len) + FRAME_CHECK_LEN(check)) + 2 : \
+        (len) + FRAME_CHECK_LEN(check) + ((len) + FRAME_CHECK_LEN(check)) / 254 + 3)
+
+/** Receives encoded output, in order; called once per run of bytes. */
+typedef void (*frame_out_t)(void *ctx, const void *data, size_t len);
+
+/** Decoder counters. */
+struct frame_stats {
+    uint32_t    frames;     ///< Good frames delivered.
+    uint32_t    crc_errors; ///< Frames dropped for a bad check.
+    uint32_t    errors;     ///< Frames dropped as malformed or too long.
+};
+
+/**
+ * Streaming frame decoder state. Fed whatever the line delivers, it
+ * assembles one frame at a time into a buffer the caller provides.
+ */
+struct frame_dec {
+    uint8_t     *buf;       ///< Where the frame is assembled.
+    size_t      size;       ///< Size of \c buf.
+    size_t      len;        ///< Bytes assembled so far.
+    uint8_t     codec;      ///< One of \ref frame_codec.
+    uint8_t     check;      ///< One of \ref frame_check.
+    uint8_t     code;       ///< COBS: bytes left in the current block.
+    uint8_t     zero;       ///< COBS: a zero is owed before the next block.
+    uint8_t     esc;        ///< SLIP: the last byte was an escape.
+    uint8_t     bad;        ///< The frame is being discarded up to its delimiter.
+    struct frame_stats stats;   ///< What has been seen.
+};
+
+size_t frame_encode(enum frame_codec codec, enum frame_check check,
+                    const void *data, size_t len, frame_out_t out, void *ctx);
+size_t frame_encode_buf(enum frame_codec codec, enum frame_check check,
+                        const void *data, size_t len, void *buf, size_t size);
+
+void frame_dec_init(struct frame_dec *dec, enum frame_codec codec,
+                    enum frame_check check, void *buf, size_t size);
+void frame_dec_reset(struct frame_dec *dec);
+ssize_t frame_decode(struct frame_dec *dec, const void *data, size_t len,
+                     size_t *used);
+
+#endif /* _MISC_FRAME_H */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -0,0 +1,251 @@
+/** POSIX-like asynchronous I/O
+ * \file lib/posixio/aio.c
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+/// Request private declarations from posixio.h
+#define POSIXIO_PRIVATE
+
+#include <config.h>
+#include <posixio/posixio.h>
+
+#include <time.h>
+#include <real_errno.h>
+#include <FreeRTOS.h>
+#include <task.h>
+#include <event_groups.h>
+
+/* Requests are started by the device's aio_read or aio_write handler,
+ * which typically programs a DMA channel and returns at once. The device
+ * then calls posixio_aio_complete(), usually from its DMA interrupt.
+ * Devices without those handlers have the request carried out by their
+ * plain read or write handler before aio_read() or aio_write() returns,
+ * so callers need not care which kind they have.
+ *
+ * The request holds a reference on the open file until aio_return(), so
+ * closing the descriptor while a transfer is in flight is safe.
+ */
+
+/**
+ * Start a read or write request.
+ *
+ * @param cb The request.
+ * @param write Non-zero for a write, zero for a read.
+ * @returns \c 0 if the request was accepted or \c -1 on error with
+ *      \c errno set to an error value.
+ */
+static int _aio_submit(struct aiocb *cb, int write)
+{
+    if (cb == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct iofile *file = posixio_file_acquire(cb->aio_fildes);
+
+    if (file == NULL)
+        return -1;
+
+    cb->__file = file;
+    cb->__return = -1;
+    cb->__error = EINPROGRESS;
+
+    int (*start)(void *fh, struct aiocb *cb) =
+        write ? file->dev->aio_write : file->dev->aio_read;
+
+    if (cb->aio_nbytes && start != NULL) {
+        if (start(file->fh, cb) == 0)
+            return 0;
+
+        if (errno != ENOTSUP) {
+            cb->__file = NULL;
+            cb->__error = errno;
+            posixio_file_release(file);
+            return -1;
+        }
+    }
+
+    // no asynchronous support; do it now
+    ssize_t ret = -1;
+
+    errno = EINVAL;
+    if (write && file->dev->write != NULL)
+        ret = file->dev->write(file->fh, (const void *)cb->aio_buf, cb->aio_nbytes);
+    else if (!write && file->dev->read != NULL)
+        ret = file->dev->read(file->fh, (void *)cb->aio_buf, cb->aio_nbytes);
+
+    posixio_aio_complete(cb, ret, ret == -1 ? errno : 0, NULL);
+    return 0;
+}
+
+
+/**
+ * Starts an asynchronous read of \c aio_nbytes from \c aio_fildes into
+ * \c aio_buf.
+ *
+ * @param cb The request, which must stay valid until \c aio_return().
+ * @returns \c 0 if the request was accepted or \c -1 on error with
+ *      \c errno set to an error value.
+ */
+int aio_read(struct aiocb *cb)
+{
+    return _aio_submit(cb, 0);
+}
+
+
+/**
+ * Starts an asynchronous write of \c aio_nbytes from \c aio_buf to
+ * \c aio_fildes. The buffer must not be changed until the request
+ * completes.
+ *
+ * @param cb The request, which must stay valid until \c aio_return().
+ * @returns \c 0 if the request was accepted or \c -1 on error with
+ *      \c errno set to an error value.
+ */
+int aio_write(struct aiocb *cb)
+{
+    return _aio_submit(cb, 1);
+}
+
+
+/**
+ * Gets the state of a request.
+ *
+ * @param cb The request.
+ * @returns \c EINPROGRESS while the transfer is running, \c 0 once it
+ *      has completed successfully or the error value it failed with.
+ */
+int aio_error(const struct aiocb *cb)
+{
+    return cb->__error;
+}
+
+
+/**
+ * Collects the result of a completed request and drops its reference on
+ * the file. This must be called exactly once for each accepted request.
+ *
+ * @param cb The request.
+ * @returns What \c read() or \c write() would have returned, or \c -1
+ *      with \c errno set to \c EINVAL if the request is still running.
+ */
+ssize_t aio_return(struct aiocb *cb)
+{
+    if (cb->__error == EINPROGRESS || cb->__file == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ssize_t ret = cb->__return;
+
+    if (cb->__error)
+        errno = cb->__error;
+
+    posixio_file_release(cb->__file);
+    cb->__file = NULL;
+
+    return ret;
+}
+
+
+/**
+ * Waits for at least one of a list of requests to complete.
+ *
+ * @param list The requests to wait for; \c NULL entries are ignored.
+ * @param nent The number of entries in \c list.
+ * @param timeout The longest time to wait or \c NULL to wait
+ *      indefinitely.
+ * @returns \c 0 when one of the requests has completed or \c -1 with
+ *      \c errno set to \c EAGAIN if the timeout expired first.
+ */
+int aio_suspend(const struct aiocb *const list[], int nent,
+                const struct timespec *timeout)
+{
+    TickType_t start = xTaskGetTickCount();
+    TickType_t wait = portMAX_DELAY;
+
+    if (timeout != NULL) {
+        uint32_t ms = timeout->tv_sec * 1000 + timeout->tv_nsec / 1000000;
+        wait = ms ? MAX(MS2ST(ms), 1) : 0;
+    }
+
+    int slot = posixio_poll_claim();
+    if (slot == -1)
+        return -1;
+
+    int ret = -1;
+
+    for (;; ) {
+        posixio_poll_arm(slot);
+
+        for (int i = 0; i < nent; i++) {
+            if (list[i] != NULL && list[i]->__error != EINPROGRESS) {
+                ret = 0;
+                break;
+            }
+        }
+        if (ret == 0 || !wait)
+            break;
+
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (wait != portMAX_DELAY && elapsed >= wait)
+            break;
+
+        if (!posixio_poll_wait(slot,
+                               wait == portMAX_DELAY ? portMAX_DELAY : wait - elapsed))
+            break;
+    }
+
+    posixio_poll_release(slot);
+
+    if (ret == -1)
+        errno = EAGAIN;
+
+    return ret;
+}
+
+
+/**
+ * Called by a device when a request it started has finished. This may be
+ * called from an interrupt handler. It records the result, runs the
+ * request's notifications and wakes any task in \c aio_suspend().
+ * This is an internal function.
+ *
+ * @param cb The request.
+ * @param ret The number of bytes transferred, or \c -1 on failure.
+ * @param err \c 0 on success or the error value on failure.
+ * @param wakeup As for the FreeRTOS \c FromISR calls when called from an
+ *      interrupt handler; \c NULL when called from a task.
+ */
+void posixio_aio_complete(struct aiocb *cb, ssize_t ret, int err, BaseType_t *wakeup)
+{
+    // the request belongs to its owner again once __error is set
+    void (*notify)(struct aiocb *cb, BaseType_t *wakeup) = cb->aio_notify;
+    EventGroupHandle_t event = cb->aio_event;
+    EventBits_t bits = cb->aio_bits;
+
+    cb->__return = ret;
+    __DMB();
+    cb->__error = err;
+
+    if (notify != NULL)
+        notify(cb, wakeup);
+
+    if (wakeup != NULL) {
+        if (event != NULL)
+            xEventGroupSetBitsFromISR(event, bits, wakeup);
+        posixio_poll_wake_from_isr(wakeup);
+    } else {
+        if (event != NULL)
+            xEventGroupSetBits(event, bits);
+        posixio_poll_wake();
+    }
+}
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -0,0 +1,355 @@
+/** IO Platform driver for framed serial ports.
+ *
+ * Carries whole frames over the serial ports, using the codecs in
+ * \c misc/frame.h. Each write() sends one frame and each read() returns
+ * one, much like a datagram socket: a frame longer than the read buffer
+ * has its tail discarded. \c "/frame/1" uses USART1, and so on; frames
+ * are COBS encoded with a CRC-16 trailer until changed with
+ * \c IOCTL_SETCODEC and \c IOCTL_SETCHECK.
+ *
+ * Frames are encoded straight into the serial transmit ring and decoded
+ * from the receive ring in place. A port should have one reader at a
+ * time, whether through here or \c "/serial", since they share the ring.
+ *
+ * \file lib/posixio/dev/frame.c
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#define POSIXIO_PRIVATE
+
+#include <config.h>
+#include <posixio/posixio.h>
+#include <posixio/dev/frame.h>
+#include <stm32/serial.h>
+#include <misc/frame.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <real_errno.h>
+
+/** The posixio state of a framed serial port, shared by every open of it. */
+struct frm_port {
+    const char  *name;      ///< File name of the port on this device.
+    serial_t    *serial;    ///< The serial port driver instance.
+    int         dev;        ///< Device number, from \ref POSIXIO_DEVICES.
+    uint8_t     codec;      ///< How frames are delimited, one of \ref frame_codec.
+    uint8_t     check;      ///< The check frames carry, one of \ref frame_check.
+    struct frame_dec dec;   ///< Receive decoder state.
+    uint8_t     buf[FRAME_MTU + 4]; ///< Where received frames are assembled.
+};
+
+/** The serial ports we know about. */
+static struct frm_port frm_ports[] = {
+#if USE_SERIAL_USART1
+    { .name = "1", .serial = &Serial1, .dev = DEV_USART1, .codec = FRAME_COBS, .check = FRAME_CRC16 },
+#endif
+#if USE_SERIAL_USART2
+    { .name = "2", .serial = &Serial2, .dev = DEV_USART2, .codec = FRAME_COBS, .check = FRAME_CRC16 },
+#endif
+#if USE_SERIAL_USART3
+    { .name = "3", .serial = &Serial3, .dev = DEV_USART3, .codec = FRAME_COBS, .check = FRAME_CRC16 },
+#endif
+#if USE_SERIAL_UART4
+    { .name = "4", .serial = &Serial4, .dev = DEV_UART4, .codec = FRAME_COBS, .check = FRAME_CRC16 },
+#endif
+#if USE_SERIAL_UART5
+    { .name = "5", .serial = &Serial5, .dev = DEV_UART5, .codec = FRAME_COBS, .check = FRAME_CRC16 },
+#endif
+    { .name = NULL }
+};
+
+/** An open file on the device. This is the handle we give out. */
+struct frm_file {
+    struct frm_port *port;  ///< The port, or \c NULL if this handle is free.
+    int         flags;      ///< File status flags, such as \c O_NONBLOCK.
+};
+
+/** There can be no more open files than posixio has file structures. */
+static struct frm_file frm_files[POSIXIO_MAX_OPEN_FILES];
+
+/** Find a port by file name. */
+static struct frm_port *frm_find(const char *name)
+{
+    for (struct frm_port *port = frm_ports; port->name != NULL; port++)
+        if (!strcmp(name, port->name))
+            return port;
+    return NULL;
+}
+
+/** Called by the serial driver, from its ISRs, when there is news. */
+static void frm_notify(BaseType_t *wakeup)
+{
+    posixio_poll_wake_from_isr(wakeup);
+}
+
+/** Start the decoder afresh with the port's current settings. */
+static void frm_dec_init(struct frm_port *port)
+{
+    struct frame_stats stats = port->dec.stats;
+
+    frame_dec_init(&port->dec, port->codec, port->check,
+                   port->buf, sizeof(port->buf));
+    port->dec.stats = stats;
+}
+
+static int frm_close(void *fh)
+{
+    struct frm_file *file = (struct frm_file *)fh;
+
+    if (file == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    file->port = NULL;
+    return 0;
+}
+
+static void *frm_open(const char *name, int flags, ...)
+{
+    struct frm_port *port = frm_find(name);
+    struct frm_file *file = NULL;
+
+    if (port == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    taskENTER_CRITICAL();
+    for (int i = 0; i < POSIXIO_MAX_OPEN_FILES; i++) {
+        if (frm_files[i].port == NULL) {
+            file = &frm_files[i];
+            file->port = port;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    if (file == NULL) {
+        errno = ENFILE;
+        return NULL;
+    }
+
+    file->flags = flags & O_NONBLOCK;
+    port->serial->rx_notify = frm_notify;
+    port->serial->tx_notify = frm_notify;
+
+    if (port->dec.buf == NULL)
+        frm_dec_init(port);
+
+    return file;
+}
+
+/**
+ * Decode from the receive ring, in place, until a good frame turns up.
+ * Anything after it stays in the ring for next time.
+ */
+static ssize_t frm_read(void *fh, void *ptr, size_t len)
+{
+    struct frm_file *file = (struct frm_file *)fh;
+    struct frm_port *port = file->port;
+    const uint8_t *p;
+    uint16_t avail;
+    size_t used;
+    ssize_t got;
+
+    do {
+        avail = serial_rx_borrow(port->serial, &p,
+                                 (file->flags & O_NONBLOCK) ? 0 : portMAX_DELAY);
+        if (!avail) {
+            if (file->flags & O_NONBLOCK) {
+                errno = EAGAIN;
+                return -1;
+            }
+            continue;
+        }
+
+        got = frame_decode(&port->dec, p, avail, &used);
+        serial_rx_release(port->serial, used);
+    } while (!avail || got < 0);
+
+    if ((size_t)got > len)
+        got = len;
+    memcpy(ptr, port->buf, got);
+
+    return got;
+}
+
+static void frm_out(void *ctx, const void *data, size_t len)
+{
+    serial_tx_put((serial_t *)ctx, data, len);
+}
+
+/** Encode a frame straight into the transmit ring. */
+static ssize_t frm_write(void *fh, const void *ptr, size_t len)
+{
+    struct frm_port *port = ((struct frm_file *)fh)->port;
+
+    if (len > FRAME_MTU) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    serial_tx_lock(port->serial);
+    frame_encode(port->codec, port->check, ptr, len, frm_out, port->serial);
+    serial_tx_unlock(port->serial);
+
+    return len;
+}
+
+static int frm_fstat(void *fh, struct stat *st)
+{
+    if (st == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (fh == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    memset(st, '\0', sizeof(*st));
+    st->st_dev = ((struct frm_file *)fh)->port->dev;
+    st->st_mode = S_IFCHR;
+
+    return 0;
+}
+
+static int frm_fcntl(void *fh, int cmd, int arg)
+{
+    struct frm_file *file = (struct frm_file *)fh;
+
+    switch (cmd) {
+    case F_SETFL:
+        file->flags = arg & O_NONBLOCK;
+        return 0;
+
+    default:
+        break;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+static int frm_ioctl(void *fh, unsigned long request, va_list ap)
+{
+    struct frm_port *port = ((struct frm_file *)fh)->port;
+    int ret = 0;
+
+    switch (request) {
+    case IOCTL_SETCODEC: {
+        unsigned int codec = va_arg(ap, unsigned int);
+
+        if (codec > FRAME_SLIP) {
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+        port->codec = codec;
+        frm_dec_init(port);
+        break;
+    }
+
+    case IOCTL_SETCHECK: {
+        unsigned int check = va_arg(ap, unsigned int);
+
+        if (check > FRAME_CRC32) {
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+        port->check = check;
+        frm_dec_init(port);
+        break;
+    }
+
+    case IOCTL_GETFRAMESTATS:
+        *va_arg(ap, struct frame_stats *) = port->dec.stats;
+        break;
+
+    default:
+        errno = ENOENT;
+        ret = -1;
+        break;
+    }
+
+    return ret;
+}
+
+static short frm_poll(void *fh, short events)
+{
+    struct frm_port *port = ((struct frm_file *)fh)->port;
+    short revents = 0;
+
+    // Bytes are not yet a frame, so a non-blocking read may still
+    // find nothing; it will have made progress, though.
+    if ((events & POLLIN) && serial_available(port->serial))
+        revents |= POLLIN;
+
+    if ((events & POLLOUT) && serial_tx_space(port->serial))
+        revents |= POLLOUT;
+
+    return revents;
+}
+
+static int frm_stat(const char *file, struct stat *st)
+{
+    if (file == NULL || st == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct frm_port *port = frm_find(file);
+
+    if (port == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    memset(st, '\0', sizeof(*st));
+    st->st_dev = port->dev;
+    st->st_mode = S_IFCHR;
+
+    return 0;
+}
+
+
+/// Framed serial port device structure
+static struct iodev iodev_frame = {
+    .name   = "frame",
+
+    .close  = frm_close,
+    .open   = frm_open,
+    .read   = frm_read,
+    .write  = frm_write,
+    .fstat  = frm_fstat,
+    .fcntl  = frm_fcntl,
+    .ioctl  = frm_ioctl,
+    .poll   = frm_poll,
+    .stat   = frm_stat,
+
+    .flags  = POSIXDEV_CHARACTER_STREAM
+};
+
+
+/**
+ * Register the framed serial port device handler. It offers the same
+ * ports as the serial device, as \c "/frame/1" and so on.
+ *
+ * @returns \c 0 on success, \c -1 otherwise with an error value in \c errno.
+ */
+int posixio_register_frame(void)
+{
+    return posixio_register_dev(&iodev_frame);
+}
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
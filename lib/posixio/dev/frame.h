@@ -0,0 +1,24 @@
+/** IO Platform driver for framed serial ports
+ * \file lib/posixio/dev/frame.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef _POSIXIO_DEV_FRAME
+#define _POSIXIO_DEV_FRAME
+
+/** Largest frame payload the frame device carries. */
+#ifndef FRAME_MTU
+#define FRAME_MTU 256
+#endif
+
+int posixio_register_frame(void);
+
+#endif /* _POSIXIO_DEV_FRAME */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
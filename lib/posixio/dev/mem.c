@@ -0,0 +1,497 @@
+/** IO Platform driver for RAM-backed files.
+ *
+ * A small flat filesystem held in external SRAM, for staging captures and
+ * scratch data at memory speed through the usual file calls. Files are
+ * named \c "/mem/NAME" and are created by \c open() with \c O_CREAT.
+ *
+ * Each file is kept in one contiguous extent of a fixed arena of
+ * \ref MEMFS_SIZE bytes, so posixio_mmap() can hand out a pointer to it.
+ * A file that outgrows its extent is grown in place if the space after it
+ * is free and otherwise moved, which invalidates any pointer to it. Extents
+ * are sized in powers of two to keep moves rare; a writer that knows how
+ * big a file will be can map its full length up front to fix it in place.
+ *
+ * \file lib/posixio/dev/mem.c
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#define POSIXIO_PRIVATE
+
+#include <config.h>
+#include <posixio/posixio.h>
+#include <posixio/dev/mem.h>
+
+#include <FreeRTOS.h>
+#include <semphr.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <real_errno.h>
+
+#if MEMFS_SIZE
+
+#ifndef MEMFS_MAX_FILES
+/// Most files the device can hold.
+#define MEMFS_MAX_FILES 16
+#endif
+#ifndef MEMFS_MAX_OPEN
+/// Most files that may be open on the device at once.
+#define MEMFS_MAX_OPEN 8
+#endif
+/// Smallest extent given to a file that has any data.
+#define MEMFS_MIN_EXTENT 64
+
+/** A file on the device. */
+struct mem_node {
+    char    name[POSIXIO_MAX_FILENAME]; ///< File name; empty if unused.
+    uint8_t *data;      ///< Start of the extent, or \c NULL if none.
+    size_t  cap;        ///< Size of the extent.
+    size_t  size;       ///< Size of the file.
+    int     opens;      ///< Number of open handles.
+    int     unlinked;   ///< Removed, but still open.
+};
+
+/** An open file on the device. This is the handle we give out. */
+struct mem_file {
+    struct mem_node *node;  ///< The file, or \c NULL if this handle is free.
+    off_t           pos;    ///< Current read/write position.
+    int             flags;  ///< Flags given to \c open().
+};
+
+/** The arena files are stored in. */
+static uint8_t mem_arena[MEMFS_SIZE] SECTION_FSMC_BANK1_3("memfs") ALIGN(4);
+
+static struct mem_node mem_nodes[MEMFS_MAX_FILES];
+static struct mem_file mem_files[MEMFS_MAX_OPEN];
+
+/** Serializes every operation on the device. */
+static SemaphoreHandle_t mem_sem;
+
+
+/** Find a file by name. Call with \ref mem_sem held. */
+static struct mem_node *mem_find(const char *name)
+{
+    for (int i = 0; i < MEMFS_MAX_FILES; i++)
+        if (!mem_nodes[i].unlinked && !strcmp(name, mem_nodes[i].name))
+            return &mem_nodes[i];
+    return NULL;
+}
+
+/**
+ * See whether \c len bytes at \c start are free in the arena, other than
+ * for the extent of \c self.
+ */
+static int mem_range_free(const uint8_t *start, size_t len, const struct mem_node *self)
+{
+    if (start + len > mem_arena + MEMFS_SIZE)
+        return 0;
+
+    for (int i = 0; i < MEMFS_MAX_FILES; i++) {
+        const struct mem_node *n = &mem_nodes[i];
+        if (n == self || n->data == NULL)
+            continue;
+        if (start < n->data + n->cap && n->data < start + len)
+            return 0;
+    }
+    return 1;
+}
+
+/** First-fit search for \c len free bytes. Returns \c NULL if there are none. */
+static uint8_t *mem_extent_find(size_t len, const struct mem_node *self)
+{
+    if (mem_range_free(mem_arena, len, self))
+        return mem_arena;
+
+    // a gap can only start where another extent ends
+    for (int i = 0; i < MEMFS_MAX_FILES; i++) {
+        const struct mem_node *n = &mem_nodes[i];
+        if (n == self || n->data == NULL)
+            continue;
+        if (mem_range_free(n->data + n->cap, len, self))
+            return n->data + n->cap;
+    }
+    return NULL;
+}
+
+/**
+ * Make sure a file's extent holds at least \c size bytes, growing it in
+ * place or moving it if needed. Call with \ref mem_sem held.
+ *
+ * @returns \c 0 on success or \c -1 with \c errno set to \c ENOSPC.
+ */
+static int mem_reserve(struct mem_node *node, size_t size)
+{
+    if (size <= node->cap)
+        return 0;
+
+    size_t cap = MEMFS_MIN_EXTENT;
+    while (cap < size && cap < MEMFS_SIZE)
+        cap <<= 1;
+    if (cap < size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    // try the rounded size, then just what is needed
+    for (;; cap = (size + 3) & ~3) {
+        if (node->data != NULL && mem_range_free(node->data, cap, node)) {
+            node->cap = cap;
+            return 0;
+        }
+
+        uint8_t *data = mem_extent_find(cap, node);
+        if (data != NULL) {
+            if (node->size)
+                memmove(data, node->data, node->size);
+            node->data = data;
+            node->cap = cap;
+            return 0;
+        }
+
+        if (cap == ((size + 3) & ~3))
+            break;
+    }
+
+    errno = ENOSPC;
+    return -1;
+}
+
+/** Forget a file and give back its space. Call with \ref mem_sem held. */
+static void mem_node_free(struct mem_node *node)
+{
+    memset(node, '\0', sizeof(*node));
+}
+
+
+static void *mem_open(const char *name, int flags, ...)
+{
+    struct mem_node *node;
+    struct mem_file *file = NULL;
+
+    if (!*name || strchr(name, '/') != NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    xSemaphoreTake(mem_sem, portMAX_DELAY);
+
+    for (int i = 0; i < MEMFS_MAX_OPEN; i++) {
+        if (mem_files[i].node == NULL) {
+            file = &mem_files[i];
+            break;
+        }
+    }
+    if (file == NULL) {
+        errno = ENFILE;
+        goto fail;
+    }
+
+    node = mem_find(name);
+    if (node != NULL && (flags & O_CREAT) && (flags & O_EXCL)) {
+        errno = EEXIST;
+        goto fail;
+    }
+
+    if (node == NULL) {
+        if (!(flags & O_CREAT)) {
+            errno = ENOENT;
+            goto fail;
+        }
+
+        for (int i = 0; i < MEMFS_MAX_FILES; i++) {
+            if (!mem_nodes[i].name[0]) {
+                node = &mem_nodes[i];
+                break;
+            }
+        }
+        if (node == NULL) {
+            errno = ENOSPC;
+            goto fail;
+        }
+
+        // posixio has already checked that the name fits
+        strcpy(node->name, name);
+    }
+
+    if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY)
+        node->size = 0;
+
+    node->opens++;
+    file->node = node;
+    file->pos = 0;
+    file->flags = flags;
+
+    xSemaphoreGive(mem_sem);
+    return file;
+
+fail:
+    xSemaphoreGive(mem_sem);
+    return NULL;
+}
+
+static int mem_close(void *fh)
+{
+    struct mem_file *file = (struct mem_file *)fh;
+
+    xSemaphoreTake(mem_sem, portMAX_DELAY);
+    if (!--file->node->opens && file->node->unlinked)
+        mem_node_free(file->node);
+    file->node = NULL;
+    xSemaphoreGive(mem_sem);
+
+    return 0;
+}
+
+static ssize_t mem_read(void *fh, void *ptr, size_t len)
+{
+    struct mem_file *file = (struct mem_file *)fh;
+
+    if ((file->flags & O_ACCMODE) == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    xSemaphoreTake(mem_sem, portMAX_DELAY);
+
+    struct mem_node *node = file->node;
+
+    if ((size_t)file->pos >= node->size)
+        len = 0;
+    else
+        len = MIN(len, node->size - file->pos);
+
+    if (len) {
+        memcpy(ptr, node->data + file->pos, len);
+        file->pos += len;
+    }
+
+    xSemaphoreGive(mem_sem);
+
+    return len;
+}
+
+static ssize_t mem_write(void *fh, const void *ptr, size_t len)
+{
+    struct mem_file *file = (struct mem_file *)fh;
+
+    if ((file->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    xSemaphoreTake(mem_sem, portMAX_DELAY);
+
+    struct mem_node *node = file->node;
+
+    if (file->flags & O_APPEND)
+        file->pos = node->size;
+
+    if (mem_reserve(node, file->pos + len)) {
+        xSemaphoreGive(mem_sem);
+        return -1;
+    }
+
+    // writing past the end leaves a hole of zeros
+    if ((size_t)file->pos > node->size)
+        memset(node->data + node->size, '\0', file->pos - node->size);
+
+    memcpy(node->data + file->pos, ptr, len);
+    file->pos += len;
+    if ((size_t)file->pos > node->size)
+        node->size = file->pos;
+
+    xSemaphoreGive(mem_sem);
+
+    return len;
+}
+
+static off_t mem_lseek(void *fh, off_t ptr, int dir)
+{
+    struct mem_file *file = (struct mem_file *)fh;
+    off_t pos;
+
+    xSemaphoreTake(mem_sem, portMAX_DELAY);
+
+    switch (dir) {
+    case SEEK_SET: pos = ptr; break;
+    case SEEK_CUR: pos = file->pos + ptr; break;
+    case SEEK_END: pos = file->node->size + ptr; break;
+    default: pos = -1; break;
+    }
+
+    if (pos >= 0)
+        file->pos = pos;
+
+    xSemaphoreGive(mem_sem);
+
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return pos;
+}
+
+/** Fill in \c st for a file. */
+static void mem_fill_stat(const struct mem_node *node, struct stat *st)
+{
+    memset(st, '\0', sizeof(*st));
+    st->st_dev = DEV_MEM;
+    st->st_ino = node - mem_nodes + 1;
+    st->st_mode = S_IFREG | S_IRUSR | S_IWUSR;
+    st->st_nlink = node->unlinked ? 0 : 1;
+    st->st_size = node->size;
+}
+
+static int mem_fstat(void *fh, struct stat *st)
+{
+    if (st == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    xSemaphoreTake(mem_sem, portMAX_DELAY);
+    mem_fill_stat(((struct mem_file *)fh)->node, st);
+    xSemaphoreGive(mem_sem);
+
+    return 0;
+}
+
+static int mem_stat(const char *name, struct stat *st)
+{
+    if (name == NULL || st == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    xSemaphoreTake(mem_sem, portMAX_DELAY);
+
+    struct mem_node *node = mem_find(name);
+
+    if (node != NULL)
+        mem_fill_stat(node, st);
+
+    xSemaphoreGive(mem_sem);
+
+    if (node == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int mem_unlink(const char *name)
+{
+    xSemaphoreTake(mem_sem, portMAX_DELAY);
+
+    struct mem_node *node = mem_find(name);
+
+    if (node != NULL) {
+        // open files keep their data until they are closed
+        if (node->opens)
+            node->unlinked = 1;
+        else
+            mem_node_free(node);
+    }
+
+    xSemaphoreGive(mem_sem);
+
+    if (node == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Map part of a file. The range must lie within the file unless the file
+ * was opened for writing, in which case the file is extended to cover it.
+ * The pointer stays valid until the file is truncated or grown past its
+ * extent, or until it has been removed and closed.
+ */
+static void *mem_mmap(void *fh, off_t offset, size_t len)
+{
+    struct mem_file *file = (struct mem_file *)fh;
+    void *ret = NULL;
+
+    // the end of the mapping has to be representable
+    if (offset < 0 || len > SIZE_MAX - (size_t)offset) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    xSemaphoreTake(mem_sem, portMAX_DELAY);
+
+    struct mem_node *node = file->node;
+    size_t end = offset + len;
+
+    if (end > node->size) {
+        if ((file->flags & O_ACCMODE) == O_RDONLY) {
+            errno = EINVAL;
+            goto out;
+        }
+        if (mem_reserve(node, end))
+            goto out;
+        memset(node->data + node->size, '\0', end - node->size);
+        node->size = end;
+    }
+
+    if (node->data == NULL) {
+        // nothing to map in an empty file
+        errno = EINVAL;
+        goto out;
+    }
+
+    ret = node->data + offset;
+
+out:
+    xSemaphoreGive(mem_sem);
+    return ret;
+}
+
+
+/// RAM-backed file device structure
+static struct iodev iodev_mem = {
+    .name   = "mem",
+
+    .close  = mem_close,
+    .lseek  = mem_lseek,
+    .read   = mem_read,
+    .write  = mem_write,
+    .fstat  = mem_fstat,
+    .mmap   = mem_mmap,
+
+    .open   = mem_open,
+    .stat   = mem_stat,
+    .unlink = mem_unlink,
+
+    .flags  = POSIXDEV_BLOCK_FILE
+};
+
+
+/**
+ * Register the RAM-backed file device. Files on it are held in external
+ * SRAM and are lost at reset.
+ *
+ * @returns \c 0 on success, \c -1 otherwise with an error value in \c errno.
+ */
+int posixio_register_mem(void)
+{
+    ASSERT((mem_sem = xSemaphoreCreateMutex()));
+
+    return posixio_register_dev(&iodev_mem);
+}
+
+#endif  /* MEMFS_SIZE */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -0,0 +1,527 @@
+/** IO Platform driver for pipes.
+ *
+ * Pipes stream bytes from one task to another through a ring buffer.
+ * Anonymous pipes are made with pipe(); named pipes, much like FIFOs,
+ * are made by opening \c "/pipe/NAME" with \c O_CREAT and live until
+ * they are unlinked and every end is closed.
+ *
+ * Each ring has a single producer and a single consumer, so reads and
+ * writes move data with \c memcpy and take no locks; they block only
+ * when the ring is empty or full. At most one task may read and one
+ * task write a pipe at any time, though which tasks those are may
+ * change, for example across dup2().
+ *
+ * Reads return \c 0 once the ring is empty and every writer has gone.
+ * Writes fail with \c EPIPE once every reader has gone. A named pipe
+ * that has not had a writer yet blocks its readers instead, and one
+ * that has not had a reader yet buffers its writers.
+ *
+ * \file lib/posixio/dev/pipe.c
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#define POSIXIO_PRIVATE
+
+#include <config.h>
+#include <posixio/posixio.h>
+#include <posixio/dev/pipe.h>
+
+#include <FreeRTOS.h>
+#include <semphr.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <real_errno.h>
+
+/** A pipe. */
+struct pipe {
+    char                name[POSIXIO_MAX_FILENAME]; ///< Name, or empty if anonymous or unlinked.
+    uint32_t            size;       ///< Size of \c buf; a power of two.
+    volatile uint32_t   head;       ///< Total bytes written; only the writer changes this.
+    volatile uint32_t   tail;       ///< Total bytes read; only the reader changes this.
+    SemaphoreHandle_t   rd_sem;     ///< Given when data is added or the last writer goes.
+    SemaphoreHandle_t   wr_sem;     ///< Given when space is freed or the last reader goes.
+    volatile int        readers;    ///< Open read ends.
+    volatile int        writers;    ///< Open write ends.
+    volatile int        rd_gone;    ///< Every reader that came has gone.
+    volatile int        wr_gone;    ///< Every writer that came has gone.
+    struct pipe         *next;      ///< Next named pipe.
+    uint8_t             buf[];      ///< The ring.
+};
+
+/** An open end of a pipe. This is the handle we give out. */
+struct pipe_end {
+    struct pipe *pipe;  ///< The pipe.
+    int         flags;  ///< Flags given to \c open(), as changed by \c fcntl().
+};
+
+/** Named pipes. */
+static struct pipe *pipes;
+
+/** Protects \ref pipes and the end counts; not used for reads or writes. */
+static SemaphoreHandle_t pipe_sem;
+
+static struct iodev iodev_pipe;
+
+
+/** Make a new, empty pipe. Returns \c NULL with \c errno set on failure. */
+static struct pipe *pipe_new(const char *name)
+{
+    struct pipe *p = malloc(sizeof(*p) + POSIXIO_PIPE_SIZE);
+
+    if (p == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memset(p, '\0', sizeof(*p));
+    strncpy(p->name, name, sizeof(p->name) - 1);
+    p->size = POSIXIO_PIPE_SIZE;
+    p->rd_sem = xSemaphoreCreateBinary();
+    p->wr_sem = xSemaphoreCreateBinary();
+    if (p->rd_sem == NULL || p->wr_sem == NULL) {
+        if (p->rd_sem != NULL) vSemaphoreDelete(p->rd_sem);
+        if (p->wr_sem != NULL) vSemaphoreDelete(p->wr_sem);
+        free(p);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return p;
+}
+
+/** Free a pipe that has no ends and no name. */
+static void pipe_free(struct pipe *p)
+{
+    vSemaphoreDelete(p->rd_sem);
+    vSemaphoreDelete(p->wr_sem);
+    free(p);
+}
+
+/**
+ * Make a handle for a new end of a pipe. Call with \ref pipe_sem held.
+ * Returns \c NULL with \c errno set on failure.
+ */
+static struct pipe_end *pipe_attach(struct pipe *p, int flags)
+{
+    struct pipe_end *end = malloc(sizeof(*end));
+
+    if (end == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    end->pipe = p;
+    end->flags = flags;
+
+    int mode = flags & O_ACCMODE;
+    if (mode != O_WRONLY) {
+        p->readers++;
+        p->rd_gone = 0;
+    }
+    if (mode != O_RDONLY) {
+        p->writers++;
+        p->wr_gone = 0;
+    }
+
+    return end;
+}
+
+/** Find a named pipe. Call with \ref pipe_sem held. */
+static struct pipe *pipe_find(const char *name, struct pipe ***prev)
+{
+    struct pipe **pp;
+
+    for (pp = &pipes; *pp != NULL; pp = &(*pp)->next) {
+        if (!strcmp((*pp)->name, name)) {
+            if (prev != NULL)
+                *prev = pp;
+            return *pp;
+        }
+    }
+    return NULL;
+}
+
+
+static void *pipe_open(const char *name, int flags, ...)
+{
+    struct pipe_end *end = NULL;
+
+    if (!*name) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    xSemaphoreTake(pipe_sem, portMAX_DELAY);
+
+    struct pipe *p = pipe_find(name, NULL);
+
+    if (p != NULL && (flags & O_CREAT) && (flags & O_EXCL)) {
+        errno = EEXIST;
+    } else if (p == NULL && !(flags & O_CREAT)) {
+        errno = ENOENT;
+    } else {
+        if (p == NULL && (p = pipe_new(name)) != NULL) {
+            p->next = pipes;
+            pipes = p;
+        }
+        if (p != NULL)
+            end = pipe_attach(p, flags);
+    }
+
+    xSemaphoreGive(pipe_sem);
+
+    return end;
+}
+
+static int pipe_close(void *fh)
+{
+    struct pipe_end *end = (struct pipe_end *)fh;
+    struct pipe *p = end->pipe;
+    int mode = end->flags & O_ACCMODE;
+
+    xSemaphoreTake(pipe_sem, portMAX_DELAY);
+
+    if (mode != O_WRONLY && !--p->readers) {
+        // a writer waiting for space would wait forever
+        p->rd_gone = 1;
+        xSemaphoreGive(p->wr_sem);
+    }
+    if (mode != O_RDONLY && !--p->writers) {
+        // as would a reader waiting for data
+        p->wr_gone = 1;
+        xSemaphoreGive(p->rd_sem);
+    }
+
+    int unused = !p->readers && !p->writers && !p->name[0];
+
+    xSemaphoreGive(pipe_sem);
+
+    free(end);
+    if (unused)
+        pipe_free(p);
+
+    posixio_poll_wake();
+
+    return 0;
+}
+
+static ssize_t pipe_read(void *fh, void *ptr, size_t len)
+{
+    struct pipe_end *end = (struct pipe_end *)fh;
+    struct pipe *p = end->pipe;
+    uint32_t tail = p->tail;
+    uint32_t avail;
+
+    if ((end->flags & O_ACCMODE) == O_WRONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (!len)
+        return 0;
+
+    while (!(avail = p->head - tail)) {
+        if (p->wr_gone)
+            return 0;
+
+        if (end->flags & O_NONBLOCK) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        xSemaphoreTake(p->rd_sem, portMAX_DELAY);
+    }
+
+    uint32_t n = MIN(len, avail);
+    uint32_t off = tail & (p->size - 1);
+    uint32_t first = MIN(n, p->size - off);
+
+    memcpy(ptr, p->buf + off, first);
+    memcpy((uint8_t *)ptr + first, p->buf, n - first);
+
+    // the writer may reuse the space once it sees the new tail
+    __DMB();
+    p->tail = tail + n;
+
+    xSemaphoreGive(p->wr_sem);
+    posixio_poll_wake();
+
+    return n;
+}
+
+static ssize_t pipe_write(void *fh, const void *ptr, size_t len)
+{
+    struct pipe_end *end = (struct pipe_end *)fh;
+    struct pipe *p = end->pipe;
+    const uint8_t *src = ptr;
+    uint32_t head = p->head;
+    size_t written = 0;
+
+    if ((end->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (!len)
+        return 0;
+
+    while (written < len) {
+        if (p->rd_gone) {
+            errno = EPIPE;
+            break;
+        }
+
+        uint32_t space = p->size - (head - p->tail);
+
+        if (!space) {
+            if (end->flags & O_NONBLOCK) {
+                errno = EAGAIN;
+                break;
+            }
+
+            xSemaphoreTake(p->wr_sem, portMAX_DELAY);
+            continue;
+        }
+
+        uint32_t n = MIN(len - written, space);
+        uint32_t off = head & (p->size - 1);
+        uint32_t first = MIN(n, p->size - off);
+
+        memcpy(p->buf + off, src, first);
+        memcpy(p->buf, src + first, n - first);
+
+        // publish the data before the head that covers it
+        __DMB();
+        head += n;
+        p->head = head;
+        src += n;
+        written += n;
+
+        xSemaphoreGive(p->rd_sem);
+        posixio_poll_wake();
+    }
+
+    return written ? (ssize_t)written : -1;
+}
+
+static int pipe_fcntl(void *fh, int cmd, int arg)
+{
+    struct pipe_end *end = (struct pipe_end *)fh;
+
+    switch (cmd) {
+    case F_SETFL:
+        end->flags = (end->flags & ~O_NONBLOCK) | (arg & O_NONBLOCK);
+        return 0;
+
+    default:
+        break;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+static short pipe_poll(void *fh, short events)
+{
+    struct pipe_end *end = (struct pipe_end *)fh;
+    struct pipe *p = end->pipe;
+    uint32_t used = p->head - p->tail;
+    short revents = 0;
+
+    if ((events & POLLIN) && used)
+        revents |= POLLIN;
+    if ((events & POLLOUT) && used < p->size)
+        revents |= POLLOUT;
+
+    if (((end->flags & O_ACCMODE) != O_WRONLY && p->wr_gone)
+            || ((end->flags & O_ACCMODE) != O_RDONLY && p->rd_gone))
+        revents |= POLLHUP;
+
+    return revents;
+}
+
+static int pipe_fstat(void *fh, struct stat *st)
+{
+    struct pipe *p = ((struct pipe_end *)fh)->pipe;
+
+    if (st == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    memset(st, '\0', sizeof(*st));
+    st->st_mode = S_IFIFO | S_IRUSR | S_IWUSR;
+    st->st_size = p->head - p->tail;
+    st->st_blksize = p->size;
+
+    return 0;
+}
+
+static int pipe_stat(const char *name, struct stat *st)
+{
+    if (name == NULL || st == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    xSemaphoreTake(pipe_sem, portMAX_DELAY);
+    struct pipe *p = pipe_find(name, NULL);
+    xSemaphoreGive(pipe_sem);
+
+    if (p == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    memset(st, '\0', sizeof(*st));
+    st->st_mode = S_IFIFO | S_IRUSR | S_IWUSR;
+    st->st_blksize = POSIXIO_PIPE_SIZE;
+
+    return 0;
+}
+
+static int pipe_unlink(const char *name)
+{
+    struct pipe **prev;
+
+    xSemaphoreTake(pipe_sem, portMAX_DELAY);
+
+    struct pipe *p = pipe_find(name, &prev);
+    int unused = 0;
+
+    if (p != NULL) {
+        *prev = p->next;
+        p->name[0] = '\0';
+        unused = !p->readers && !p->writers;
+    }
+
+    xSemaphoreGive(pipe_sem);
+
+    if (p == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (unused)
+        pipe_free(p);
+
+    return 0;
+}
+
+
+/// Pipe device structure
+static struct iodev iodev_pipe = {
+    .name   = "pipe",
+
+    .close  = pipe_close,
+    .read   = pipe_read,
+    .write  = pipe_write,
+    .fstat  = pipe_fstat,
+    .fcntl  = pipe_fcntl,
+    .poll   = pipe_poll,
+
+    .open   = pipe_open,
+    .stat   = pipe_stat,
+    .unlink = pipe_unlink,
+
+    .flags  = POSIXDEV_CHARACTER_STREAM
+};
+
+
+/**
+ * Make an anonymous pipe. Data written to \c fds[1] can be read from
+ * \c fds[0].
+ *
+ * @param fds Set to the read and write descriptors.
+ * @returns \c 0 on success, \c -1 otherwise with an error value in \c errno.
+ */
+int pipe(int fds[2])
+{
+    struct iofile *rd = NULL, *wr = NULL;
+    struct pipe *p;
+    int attached = 0;
+
+    if ((p = pipe_new("")) == NULL)
+        return -1;
+
+    if ((rd = posixio_file_alloc(&iodev_pipe, "", O_RDONLY)) == NULL
+            || (wr = posixio_file_alloc(&iodev_pipe, "", O_WRONLY)) == NULL)
+        goto fail;
+
+    xSemaphoreTake(pipe_sem, portMAX_DELAY);
+    rd->fh = pipe_attach(p, O_RDONLY);
+    wr->fh = rd->fh != NULL ? pipe_attach(p, O_WRONLY) : NULL;
+    if (rd->fh != NULL && wr->fh == NULL) {
+        free(rd->fh);
+        p->readers--;
+    }
+    xSemaphoreGive(pipe_sem);
+
+    if (wr->fh == NULL)
+        goto fail;
+    attached = 1;
+
+    posixio_fdlock();
+
+    fds[0] = posixio_newfd();
+    if (fds[0] == -1) {
+        posixio_fdunlock();
+        goto fail;
+    }
+    posixio_setfd(fds[0], rd, NULL);
+
+    fds[1] = posixio_newfd();
+    if (fds[1] == -1) {
+        posixio_setfd(fds[0], NULL, NULL);
+        posixio_fdunlock();
+        goto fail;
+    }
+    posixio_setfd(fds[1], wr, NULL);
+
+    posixio_fdunlock();
+
+    return 0;
+
+fail:
+    {
+        int err = errno;
+
+        if (attached) {
+            // closing both ends frees the pipe
+            posixio_file_release(rd);
+            posixio_file_release(wr);
+        } else {
+            if (rd != NULL) posixio_file_free(rd);
+            if (wr != NULL) posixio_file_free(wr);
+            pipe_free(p);
+        }
+
+        errno = err;
+    }
+    return -1;
+}
+
+
+/**
+ * Register the pipe device.
+ *
+ * @returns \c 0 on success, \c -1 otherwise with an error value in \c errno.
+ */
+int posixio_register_pipe(void)
+{
+    ASSERT((pipe_sem = xSemaphoreCreateMutex()));
+
+    return posixio_register_dev(&iodev_pipe);
+}
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
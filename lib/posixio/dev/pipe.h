@@ -0,0 +1,19 @@
+/** IO Platform driver for pipes.
+ * \file lib/posixio/dev/pipe.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef _POSIXIO_DEV_PIPE
+#define _POSIXIO_DEV_PIPE
+
+int posixio_register_pipe(void);
+
+#endif /* _POSIXIO_DEV_PIPE */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -22,137 +22,282 @@
 #include <posixio/dev/serial.h>
 #include <stm32/serial.h>
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <real_errno.h>
 
-static int ser_close(void *fh)
-{
-    if (fh != NULL)
-        return 0;
-
-    errno = ENOENT;
-    return -1;
-}
+/** The posixio state of a serial port, shared by every open of it. */
+struct ser_port {
+    const char  *name;      ///< File name of the port on this device.
+    serial_t    *serial;    ///< The serial port driver instance.
+    int         dev;        ///< Device number, from \ref POSIXIO_DEVICES.
+    unsigned int vmin;      ///< Bytes a blocking read waits for, as termios \c VMIN.
+    unsigned int vtime;     ///< Line idle time that ends a read, in tenths of a second, as termios \c VTIME.
+};
 
-static void *ser_open(const char *name, int flags, ...)
-{
+/** The serial ports we know about. */
+static struct ser_port ser_ports[] = {
 #if USE_SERIAL_USART1
-    if (!strcmp(name, "1"))
-        return &Serial1;
+    { "1", &Serial1, DEV_USART1, 1, 0 },
 #endif
 #if USE_SERIAL_USART2
-    if (!strcmp(name, "2"))
-        return &Serial2;
+    { "2", &Serial2, DEV_USART2, 1, 0 },
 #endif
 #if USE_SERIAL_USART3
-    if (!strcmp(name, "3"))
-        return &Serial3;
+    { "3", &Serial3, DEV_USART3, 1, 0 },
 #endif
 #if USE_SERIAL_UART4
-    if (!strcmp(name, "4"))
-        return &Serial4;
+    { "4", &Serial4, DEV_UART4, 1, 0 },
 #endif
 #if USE_SERIAL_UART5
-    if (!strcmp(name, "5"))
-        return &Serial5;
+    { "5", &Serial5, DEV_UART5, 1, 0 },
 #endif
+    { NULL, NULL, DEV_NONE, 0, 0 }
+};
+
+/**
+ * An open file on the device. This is the handle we give out, so that
+ * file status flags belong to the open file, and to its dup()s, rather
+ * than to the port.
+ */
+struct ser_file {
+    struct ser_port *port;  ///< The port, or \c NULL if this handle is free.
+    int         flags;      ///< File status flags, such as \c O_NONBLOCK.
+};
 
-    errno = ENOENT;
+/** There can be no more open files than posixio has file structures. */
+static struct ser_file ser_files[POSIXIO_MAX_OPEN_FILES];
+
+/** Find a serial port by file name. */
+static struct ser_port *ser_find(const char *name)
+{
+    for (struct ser_port *port = ser_ports; port->name != NULL; port++)
+        if (!strcmp(name, port->name))
+            return port;
     return NULL;
 }
 
-static ssize_t ser_read(void *fh, void *ptr, size_t len)
+/**
+ * Called by the serial driver, from its ISRs, when a byte arrives or
+ * room frees up in the transmit buffer.
+ */
+static void ser_notify(BaseType_t *wakeup)
+{
+    posixio_poll_wake_from_isr(wakeup);
+}
+
+static int ser_close(void *fh)
 {
-    unsigned char *p = ptr;
-    int16_t r;
-    ssize_t written = 0;
+    struct ser_file *file = (struct ser_file *)fh;
+
+    if (file == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
 
-    while (len) {
-        r = serial_get((serial_t *)fh, 1);
-        if (r == -ETIMEDOUT) {
-            if (written)
-                break;
-            // TODO: if nonblock, break here
+    file->port = NULL;
+    return 0;
+}
+
+static void *ser_open(const char *name, int flags, ...)
+{
+    struct ser_port *port = ser_find(name);
+    struct ser_file *file = NULL;
+
+    if (port == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
 
-            continue;
+    taskENTER_CRITICAL();
+    for (int i = 0; i < POSIXIO_MAX_OPEN_FILES; i++) {
+        if (ser_files[i].port == NULL) {
+            file = &ser_files[i];
+            file->port = port;
+            break;
         }
+    }
+    taskEXIT_CRITICAL();
 
-        *p = (unsigned char)r;
-        p++;
-        len--;
-        written++;
+    if (file == NULL) {
+        errno = ENFILE;
+        return NULL;
     }
 
-    if (!written) {
+    file->flags = flags & O_NONBLOCK;
+    port->serial->rx_notify = ser_notify;
+    port->serial->tx_notify = ser_notify;
+
+    return file;
+}
+
+static ssize_t ser_read(void *fh, void *ptr, size_t len)
+{
+    struct ser_file *file = (struct ser_file *)fh;
+    struct ser_port *port = file->port;
+    size_t got;
+
+    if (file->flags & O_NONBLOCK)
+        got = serial_read(port->serial, ptr, len, 0, 0);
+    else
+        got = serial_read(port->serial, ptr, len, port->vmin,
+                          MS2ST(port->vtime * 100));
+
+    // as with termios, a blocking read that times out returns 0
+    if (!got && (file->flags & O_NONBLOCK)) {
         errno = EAGAIN;
         return -1;
     }
 
-    return written;
+    return got;
 }
 
-static ssize_t ser_write(void *fh, const void *ptr, size_t len)
+static ssize_t ser_borrow(void *fh, const void **ptr, size_t len)
 {
-    serial_write((serial_t *)fh, ptr, len);
-    return len;
+    struct ser_file *file = (struct ser_file *)fh;
+    const uint8_t *p;
+    uint16_t avail;
+
+    do {
+        avail = serial_rx_borrow(file->port->serial, &p,
+                                 (file->flags & O_NONBLOCK) ? 0 : portMAX_DELAY);
+    } while (!avail && !(file->flags & O_NONBLOCK));
+
+    if (!avail) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    *ptr = p;
+    return MIN(avail, len);
 }
 
-static int ser_fstat(void *fh, struct stat *st)
+static int ser_release(void *fh, size_t len)
 {
-    if (st == NULL) {
-        errno = EFAULT;
+    struct ser_port *port = ((struct ser_file *)fh)->port;
+
+    if (len > serial_available(port->serial)) {
+        errno = EINVAL;
         return -1;
     }
 
-    memset(st, '\0', sizeof(*st));
+    serial_rx_release(port->serial, len);
+    return 0;
+}
 
-#if USE_SERIAL_USART1
-    if (fh == &Serial1)
-        st->st_dev = DEV_USART1;
+static ssize_t ser_write(void *fh, const void *ptr, size_t len)
+{
+    struct iovec iov = { (void *)ptr, len };
 
-#endif
-#if USE_SERIAL_USART2
-    if (fh == &Serial2)
-        st->st_dev = DEV_USART2;
+    serial_writev(((struct ser_file *)fh)->port->serial, &iov, 1);
+    return len;
+}
 
-#endif
-#if USE_SERIAL_USART3
-    if (fh == &Serial3)
-        st->st_dev = DEV_USART3;
+static ssize_t ser_writev(void *fh, const struct iovec *iov, int iovcnt)
+{
+    ssize_t len = 0;
 
-#endif
-#if USE_SERIAL_UART4
-    if (fh == &Serial4)
-        st->st_dev = DEV_UART4;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
 
-#endif
-#if USE_SERIAL_UART5
-    if (fh == &Serial5)
-        st->st_dev = DEV_UART5;
+    serial_writev(((struct ser_file *)fh)->port->serial, iov, iovcnt);
+    return len;
+}
 
-#endif
-    if (st->st_dev == 0) {
+/** Called by the serial driver, from its DMA ISR, when an aio_write() is done. */
+static void ser_aio_done(void *param, int err, BaseType_t *wakeup)
+{
+    struct aiocb *cb = (struct aiocb *)param;
+
+    posixio_aio_complete(cb, err ? -1 : (ssize_t)cb->aio_nbytes, err, wakeup);
+}
+
+static int ser_aio_write(void *fh, struct aiocb *cb)
+{
+    return serial_write_async(((struct ser_file *)fh)->port->serial,
+                              (const void *)cb->aio_buf, cb->aio_nbytes,
+                              ser_aio_done, cb);
+}
+
+static int ser_fstat(void *fh, struct stat *st)
+{
+    if (st == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (fh == NULL) {
         errno = EBADF;
         return -1;
     }
 
+    memset(st, '\0', sizeof(*st));
+    st->st_dev = ((struct ser_file *)fh)->port->dev;
     st->st_mode = S_IFCHR;
 
     return 0;
 }
 
-static int ser_ioctl(void *fh, unsigned long request, ...)
+static int ser_fcntl(void *fh, int cmd, int arg)
 {
-    va_list ap;
-    int ret = 0;
+    struct ser_file *file = (struct ser_file *)fh;
 
-    va_start(ap, request);
+    switch (cmd) {
+    case F_SETFL:
+        file->flags = arg & O_NONBLOCK;
+        return 0;
+
+    default:
+        break;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+static int ser_ioctl(void *fh, unsigned long request, va_list ap)
+{
+    struct ser_port *port = ((struct ser_file *)fh)->port;
+    serial_t *serial = port->serial;
+    int ret = 0;
 
     switch (request) {
-    case IOCTL_SETBAUD:
-        ((serial_t *)fh)->speed = va_arg(ap, unsigned int);
-        serial_set_speed((serial_t *)fh);
+    case IOCTL_SETBAUD: {
+        // like tcsetattr(TCSADRAIN): let queued output go at the old rate
+        unsigned int old = serial->speed;
+
+        serial_drain(serial);
+        serial->speed = va_arg(ap, unsigned int);
+        if (serial_set_speed(serial)) {
+            serial->speed = old;
+            ret = -1;
+        }
+        break;
+    }
+
+    case IOCTL_GETBAUD:
+        *va_arg(ap, unsigned int *) = serial->baud;
+        break;
+
+    case IOCTL_GETERRORS:
+        serial_get_errors(serial, va_arg(ap, struct serial_errors *));
+        break;
+
+    case IOCTL_SETVMIN:
+        port->vmin = va_arg(ap, unsigned int);
+        break;
+
+    case IOCTL_SETVTIME:
+        port->vtime = va_arg(ap, unsigned int);
+        break;
+
+    case IOCTL_GETVMIN:
+        *va_arg(ap, unsigned int *) = port->vmin;
+        break;
+
+    case IOCTL_GETVTIME:
+        *va_arg(ap, unsigned int *) = port->vtime;
         break;
 
     default:
@@ -161,11 +306,24 @@ static int ser_ioctl(void *fh, unsigned long request, ...)
         break;
     }
 
-    va_end(ap);
-
     return ret;
 }
 
+static short ser_poll(void *fh, short events)
+{
+    struct ser_port *port = ((struct ser_file *)fh)->port;
+    short revents = 0;
+
+    if ((events & POLLIN) && serial_available(port->serial))
+        revents |= POLLIN;
+
+    // writes are taken as soon as they fit in the transmit buffer
+    if ((events & POLLOUT) && serial_tx_space(port->serial))
+        revents |= POLLOUT;
+
+    return revents;
+}
+
 static int ser_stat(const char *file, struct stat *st)
 {
     if (file == NULL || st == NULL) {
@@ -173,38 +331,15 @@ static int ser_stat(const char *file, struct stat *st)
         return -1;
     }
 
-    memset(st, '\0', sizeof(*st));
-
-#if USE_SERIAL_USART1
-    if (!strcmp(file, "1"))
-        st->st_dev = DEV_USART1;
-
-#endif
-#if USE_SERIAL_USART2
-    if (!strcmp(file, "2"))
-        st->st_dev = DEV_USART2;
-
-#endif
-#if USE_SERIAL_USART3
-    if (!strcmp(file, "3"))
-        st->st_dev = DEV_USART3;
+    struct ser_port *port = ser_find(file);
 
-#endif
-#if USE_SERIAL_UART4
-    if (!strcmp(file, "4"))
-        st->st_dev = DEV_UART4;
-
-#endif
-#if USE_SERIAL_UART5
-    if (!strcmp(file, "5"))
-        st->st_dev = DEV_UART5;
-
-#endif
-    if (st->st_dev == 0) {
+    if (port == NULL) {
         errno = ENOENT;
         return -1;
     }
 
+    memset(st, '\0', sizeof(*st));
+    st->st_dev = port->dev;
     st->st_mode = S_IFCHR;
 
     return 0;
@@ -219,8 +354,14 @@ static struct iodev iodev_serial = {
     .open   = ser_open,
     .read   = ser_read,
     .write  = ser_write,
+    .writev = ser_writev,
     .fstat  = ser_fstat,
+    .fcntl  = ser_fcntl,
     .ioctl  = ser_ioctl,
+    .poll   = ser_poll,
+    .borrow = ser_borrow,
+    .release = ser_release,
+    .aio_write = ser_aio_write,
     .stat   = ser_stat,
 
     .flags  = POSIXDEV_CHARACTER_STREAM | POSIXDEV_ISATTY
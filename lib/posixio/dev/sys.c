@@ -0,0 +1,193 @@
+/** IO Platform driver for system information.
+ *
+ * A read-only device of text files that report on the state of the
+ * system. Each file is rendered when it is opened, so a reader sees a
+ * consistent snapshot however it reads it. The files are:
+ *
+ * - \c "/sys/io" I/O statistics for each device and open file, as
+ *   produced by posixio_stats_format().
+ *
+ * \file lib/posixio/dev/sys.c
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#define POSIXIO_PRIVATE
+
+#include <config.h>
+#include <posixio/posixio.h>
+#include <posixio/dev/sys.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <real_errno.h>
+
+/** An open file on the sys device. This is the handle we give out. */
+struct sys_file {
+    size_t  len;    ///< Length of the rendered text.
+    off_t   pos;    ///< Current read position.
+    char    text[]; ///< The rendered text.
+};
+
+/** A file on the sys device. */
+struct sys_node {
+    const char  *name;  ///< File name on this device.
+    size_t      (*render)(char *buf, size_t size);  ///< Fills in the text, as for \c snprintf().
+};
+
+/** The files we provide. */
+static const struct sys_node sys_nodes[] = {
+    { "io", posixio_stats_format },
+    { NULL, NULL }
+};
+
+/** Find a file by name. */
+static const struct sys_node *sys_find(const char *name)
+{
+    for (const struct sys_node *node = sys_nodes; node->name != NULL; node++)
+        if (!strcmp(name, node->name))
+            return node;
+    return NULL;
+}
+
+static void *sys_open(const char *name, int flags, ...)
+{
+    const struct sys_node *node = sys_find(name);
+
+    if (node == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    if ((flags & O_ACCMODE) != O_RDONLY) {
+        errno = EACCES;
+        return NULL;
+    }
+
+    // Size it first, with a little slack in case it grows in between.
+    size_t size = node->render(NULL, 0) + 128;
+    struct sys_file *file = malloc(sizeof(*file) + size);
+
+    if (file == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    file->len = MIN(node->render(file->text, size), size - 1);
+    file->pos = 0;
+
+    return file;
+}
+
+static int sys_close(void *fh)
+{
+    free(fh);
+    return 0;
+}
+
+static ssize_t sys_read(void *fh, void *ptr, size_t len)
+{
+    struct sys_file *file = (struct sys_file *)fh;
+
+    if ((size_t)file->pos >= file->len)
+        return 0;
+
+    len = MIN(len, file->len - file->pos);
+    memcpy(ptr, file->text + file->pos, len);
+    file->pos += len;
+
+    return len;
+}
+
+static off_t sys_lseek(void *fh, off_t ptr, int dir)
+{
+    struct sys_file *file = (struct sys_file *)fh;
+    off_t pos;
+
+    switch (dir) {
+    case SEEK_SET: pos = ptr; break;
+    case SEEK_CUR: pos = file->pos + ptr; break;
+    case SEEK_END: pos = file->len + ptr; break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    file->pos = pos;
+    return pos;
+}
+
+static int sys_fstat(void *fh, struct stat *st)
+{
+    if (st == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    memset(st, '\0', sizeof(*st));
+    st->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+    st->st_size = ((struct sys_file *)fh)->len;
+
+    return 0;
+}
+
+static int sys_stat(const char *file, struct stat *st)
+{
+    if (file == NULL || st == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (sys_find(file) == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // the size is not known until the file is rendered
+    memset(st, '\0', sizeof(*st));
+    st->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+
+    return 0;
+}
+
+
+/// System information device structure
+static struct iodev iodev_sys = {
+    .name   = "sys",
+
+    .close  = sys_close,
+    .lseek  = sys_lseek,
+    .open   = sys_open,
+    .read   = sys_read,
+    .fstat  = sys_fstat,
+    .stat   = sys_stat,
+
+    .flags  = POSIXDEV_BLOCK_FILE
+};
+
+
+/**
+ * Register the system information device, which provides read-only
+ * text files such as \c "/sys/io".
+ *
+ * @returns \c 0 on success, \c -1 otherwise with an error value in \c errno.
+ */
+int posixio_register_sys(void)
+{
+    return posixio_register_dev(&iodev_sys);
+}
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
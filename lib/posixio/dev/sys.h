@@ -0,0 +1,19 @@
+/** IO Platform driver for system information.
+ * \file lib/posixio/dev/sys.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef _POSIXIO_DEV_SYS
+#define _POSIXIO_DEV_SYS
+
+int posixio_register_sys(void);
+
+#endif /* _POSIXIO_DEV_SYS */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -21,19 +21,31 @@
 #include <string.h>
 #include <real_errno.h>
 #include <limits.h>
+#include <sys/time.h>
+#include <FreeRTOS.h>
+#include <task.h>
+
+/// File status flags that \c fcntl(F_SETFL) may change.
+#define SETFL_MASK  (O_APPEND | O_NONBLOCK)
 
 
 /* The POSIX-ish I/O primitives!
  * Here we just indirect through the dev structure associated
  * with open files.
+ *
+ * posixio_fdlock() is only held while the descriptor table is consulted
+ * or changed; calls into a device are made with just a reference held
+ * on the open file so that a task blocked in one device does not stall
+ * I/O on every other descriptor.
  */
 
 static int _dup(struct iofile *file);
 
 /**
- * Implements \c close() on an open file by calling the \c close handler
- * of any underlying device and then removing any association for the
- * file descriptor of the open file.
+ * Implements \c close() on an open file by removing the association
+ * for the file descriptor of the open file and then dropping the
+ * reference the descriptor held. The \c close handler of any underlying
+ * device is called once no other task is still using the file.
  *
  * @param fd File descriptor of a file that needs to be closed.
  * @returns \c 0 on success, \c -1 otherwise with \c errno set to an
@@ -51,15 +63,11 @@ int _close(int fd)
         return -1;
     }
 
-    // Look for a handler
-    if (file->dev->close != NULL)
-        file->dev->close(file->fh);
-
-    int ret = posixio_setfd(fd, NULL);
+    posixio_setfd(fd, NULL, NULL);
 
     posixio_fdunlock();
 
-    return ret;
+    return posixio_file_release(file);
 }
 
 
@@ -104,26 +112,24 @@ int _isatty(int fd)
  */
 off_t _lseek(int fd, off_t ptr, int dir)
 {
-    posixio_fdlock();
+    uint32_t start = posixio_stat_now();
 
-    struct iofile *file = posixio_file_fromfd(fd);
+    struct iofile *file = posixio_file_acquire(fd);
 
-    if (file == NULL) {
-        posixio_fdunlock();
-        errno = EBADF;
+    if (file == NULL)
         return -1;
-    }
+
+    off_t ret = -1;
 
     // Look for a handler
-    if (file->dev->lseek != NULL) {
-        int ret = file->dev->lseek(file->fh, ptr, dir);
-        posixio_fdunlock();
-        return ret;
-    }
+    if (file->dev->lseek != NULL)
+        ret = file->dev->lseek(file->fh, ptr, dir);
+    else
+        errno = EINVAL;
 
-    posixio_fdunlock();
-    errno = EINVAL;
-    return -1;
+    posixio_stat_call(file, start, ret, 0);
+    posixio_file_release(file);
+    return ret;
 }
 
 
@@ -144,26 +150,24 @@ off_t _lseek(int fd, off_t ptr, int dir)
  */
 ssize_t _read(int fd, void *ptr, size_t len)
 {
-    posixio_fdlock();
+    uint32_t start = posixio_stat_now();
 
-    struct iofile *file = posixio_file_fromfd(fd);
+    struct iofile *file = posixio_file_acquire(fd);
 
-    if (file == NULL) {
-        posixio_fdunlock();
-        errno = EBADF;
+    if (file == NULL)
         return -1;
-    }
+
+    ssize_t ret = -1;
 
     // Look for a handler
-    if (file->dev->read != NULL) {
-        int ret = file->dev->read(file->fh, ptr, len);
-        posixio_fdunlock();
-        return ret;
-    }
+    if (file->dev->read != NULL)
+        ret = file->dev->read(file->fh, ptr, len);
+    else
+        errno = EINVAL;
 
-    posixio_fdunlock();
-    errno = EINVAL;
-    return -1;
+    posixio_stat_call(file, start, ret, 1);
+    posixio_file_release(file);
+    return ret;
 }
 
 
@@ -181,25 +185,248 @@ ssize_t _read(int fd, void *ptr, size_t len)
  */
 ssize_t _write(int fd, const void *ptr, size_t len)
 {
-    posixio_fdlock();
+    uint32_t start = posixio_stat_now();
 
-    struct iofile *file = posixio_file_fromfd(fd);
+    struct iofile *file = posixio_file_acquire(fd);
 
-    if (file == NULL) {
-        posixio_fdunlock();
-        errno = EBADF;
+    if (file == NULL)
         return -1;
-    }
+
+    ssize_t ret = -1;
 
     // Look for a handler
-    if (file->dev->write != NULL) {
-        int ret = file->dev->write(file->fh, ptr, len);
-        posixio_fdunlock();
-        return ret;
+    if (file->dev->write != NULL)
+        ret = file->dev->write(file->fh, ptr, len);
+    else
+        errno = EINVAL;
+
+    posixio_stat_call(file, start, ret, 1);
+    posixio_file_release(file);
+    return ret;
+}
+
+
+/**
+ * Reads from an open file into several buffers. If the underlying device
+ * has a \c readv handler it gets the whole list; otherwise the \c read
+ * handler is called for each segment in turn, stopping early on a short
+ * read.
+ *
+ * @param fd An open file to operate on.
+ * @param iov The buffers to fill, in order.
+ * @param iovcnt The number of entries in \c iov; at most \ref IOV_MAX.
+ * @returns The total number of bytes read or \c -1 on error with \c errno
+ *      set to an error value.
+ */
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    uint32_t start = posixio_stat_now();
+
+    if (iovcnt < 0 || iovcnt > IOV_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct iofile *file = posixio_file_acquire(fd);
+
+    if (file == NULL)
+        return -1;
+
+    ssize_t ret = -1;
+
+    if (file->dev->readv != NULL) {
+        ret = file->dev->readv(file->fh, iov, iovcnt);
+    } else if (file->dev->read != NULL) {
+        ret = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            if (!iov[i].iov_len)
+                continue;
+            ssize_t r = file->dev->read(file->fh, iov[i].iov_base, iov[i].iov_len);
+            if (r == -1) {
+                if (!ret)
+                    ret = -1;
+                break;
+            }
+            ret += r;
+            if ((size_t)r < iov[i].iov_len)
+                break;
+        }
+    } else {
+        errno = EINVAL;
+    }
+
+    posixio_stat_call(file, start, ret, 1);
+    posixio_file_release(file);
+    return ret;
+}
+
+
+/**
+ * Writes to an open file from several buffers. If the underlying device
+ * has a \c writev handler it gets the whole list, which lets it send the
+ * segments as one transfer; otherwise the \c write handler is called for
+ * each segment in turn, stopping early on a short write.
+ *
+ * @param fd An open file to operate on.
+ * @param iov The buffers to write, in order.
+ * @param iovcnt The number of entries in \c iov; at most \ref IOV_MAX.
+ * @returns The total number of bytes written or \c -1 on error with
+ *      \c errno set to an error value.
+ */
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    uint32_t start = posixio_stat_now();
+
+    if (iovcnt < 0 || iovcnt > IOV_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct iofile *file = posixio_file_acquire(fd);
+
+    if (file == NULL)
+        return -1;
+
+    ssize_t ret = -1;
+
+    if (file->dev->writev != NULL) {
+        ret = file->dev->writev(file->fh, iov, iovcnt);
+    } else if (file->dev->write != NULL) {
+        ret = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            if (!iov[i].iov_len)
+                continue;
+            ssize_t r = file->dev->write(file->fh, iov[i].iov_base, iov[i].iov_len);
+            if (r == -1) {
+                if (!ret)
+                    ret = -1;
+                break;
+            }
+            ret += r;
+            if ((size_t)r < iov[i].iov_len)
+                break;
+        }
+    } else {
+        errno = EINVAL;
     }
 
-    errno = EINVAL;
-    return -1;
+    posixio_stat_call(file, start, ret, 1);
+    posixio_file_release(file);
+    return ret;
+}
+
+
+/**
+ * Borrows received data from an open file without copying it. On
+ * success \c *ptr points into the device's own receive memory and the
+ * return value says how many bytes there may be read in place. The data
+ * stays put until it is handed back with \ref posixio_release, which
+ * must happen before the next borrow or read on the same file.
+ *
+ * Borrowing blocks for data in the same way \c read() does, honoring
+ * \c O_NONBLOCK. Devices that keep data in a ring may lend out less
+ * than is waiting when it wraps; borrow again after releasing to get
+ * the rest.
+ *
+ * @param fd An open file to operate on.
+ * @param ptr Set to the start of the borrowed data.
+ * @param len The most bytes the caller wants to look at.
+ * @returns The number of bytes at \c *ptr or \c -1 on error with
+ *      \c errno set to an error value. Devices that cannot lend out
+ *      their data fail with \c ENOTSUP; use \c read() on those.
+ */
+ssize_t posixio_borrow(int fd, const void **ptr, size_t len)
+{
+    uint32_t start = posixio_stat_now();
+
+    if (ptr == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct iofile *file = posixio_file_acquire(fd);
+
+    if (file == NULL)
+        return -1;
+
+    ssize_t ret = -1;
+
+    if (file->dev->borrow != NULL)
+        ret = file->dev->borrow(file->fh, ptr, len);
+    else
+        errno = ENOTSUP;
+
+    posixio_stat_call(file, start, ret, 1);
+    posixio_file_release(file);
+    return ret;
+}
+
+
+/**
+ * Hands back data borrowed with \ref posixio_borrow. The device may
+ * then reuse the memory it was in.
+ *
+ * @param fd The file the data was borrowed from.
+ * @param len How many bytes were consumed; at most what was borrowed.
+ *      Any remainder is lent out again by the next borrow.
+ * @returns \c 0 on success or \c -1 on error with \c errno set to an
+ *      error value.
+ */
+int posixio_release(int fd, size_t len)
+{
+    struct iofile *file = posixio_file_acquire(fd);
+
+    if (file == NULL)
+        return -1;
+
+    int ret = -1;
+
+    if (file->dev->release != NULL)
+        ret = file->dev->release(file->fh, len);
+    else
+        errno = ENOTSUP;
+
+    posixio_file_release(file);
+    return ret;
+}
+
+
+/**
+ * Gets a pointer to the memory that backs part of an open file, so it
+ * can be read and written in place. This is a much reduced \c mmap():
+ * there is no paging, so only devices whose files already live in
+ * addressable memory support it, and the mapping is shared with every
+ * other user of the file. Mapping past the end of a file opened for
+ * writing extends it.
+ *
+ * The pointer stays valid until the file is truncated, grown past the
+ * mapped range or removed; see the device for details.
+ *
+ * @param fd An open file to operate on.
+ * @param offset Offset into the file of the start of the mapping.
+ * @param len Length of the mapping.
+ * @returns A pointer to the data at \c offset or \c NULL on error with
+ *      \c errno set to an error value. Devices that cannot map their
+ *      files fail with \c ENODEV.
+ */
+void *posixio_mmap(int fd, off_t offset, size_t len)
+{
+    struct iofile *file = posixio_file_acquire(fd);
+
+    if (file == NULL)
+        return NULL;
+
+    void *ret = NULL;
+
+    if (offset < 0)
+        errno = EINVAL;
+    else if (file->dev->mmap != NULL)
+        ret = file->dev->mmap(file->fh, offset, len);
+    else
+        errno = ENODEV;
+
+    posixio_file_release(file);
+    return ret;
 }
 
 
@@ -214,25 +441,20 @@ ssize_t _write(int fd, const void *ptr, size_t len)
  */
 int _fstat(int fd, struct stat *st)
 {
-    posixio_fdlock();
+    struct iofile *file = posixio_file_acquire(fd);
 
-    struct iofile *file = posixio_file_fromfd(fd);
-
-    if (file == NULL) {
-        posixio_fdunlock();
-        errno = EBADF;
+    if (file == NULL)
         return -1;
-    }
 
-    if (file->dev->stat != NULL) {
-        int ret = file->dev->fstat(file->fh, st);
-        posixio_fdunlock();
-        return ret;
-    }
+    int ret = -1;
 
-    posixio_fdunlock();
-    errno = ENOENT;
-    return -1;
+    if (file->dev->fstat != NULL)
+        ret = file->dev->fstat(file->fh, st);
+    else
+        errno = ENOENT;
+
+    posixio_file_release(file);
+    return ret;
 }
 
 
@@ -249,15 +471,10 @@ int _fstat(int fd, struct stat *st)
  */
 int _fcntl(int fd, int cmd, int arg)
 {
-    posixio_fdlock();
-
-    struct iofile *file = posixio_file_fromfd(fd);
+    struct iofile *file = posixio_file_acquire(fd);
 
-    if (file == NULL) {
-        posixio_fdunlock();
-        errno = EBADF;
+    if (file == NULL)
         return -1;
-    }
 
     int ret = INT_MAX;
 
@@ -267,6 +484,20 @@ int _fcntl(int fd, int cmd, int arg)
         ret = _dup(file);
         break;
 
+    case F_GETFL:
+        ret = file->flags;
+        break;
+
+    case F_SETFL:
+        // let the device see, and veto, the new flags
+        arg = (file->flags & ~SETFL_MASK) | (arg & SETFL_MASK);
+        ret = 0;
+        if (file->dev->fcntl != NULL)
+            ret = file->dev->fcntl(file->fh, cmd, arg);
+        if (ret != -1)
+            file->flags = arg;
+        break;
+
     default:
         break;
     }
@@ -280,7 +511,7 @@ int _fcntl(int fd, int cmd, int arg)
         }
     }
 
-    posixio_fdunlock();
+    posixio_file_release(file);
     return ret;
 }
 
@@ -296,74 +527,226 @@ int _fcntl(int fd, int cmd, int arg)
  */
 int ioctl(int fd, unsigned long request, ...)
 {
-    posixio_fdlock();
+    uint32_t start = posixio_stat_now();
 
-    struct iofile *file = posixio_file_fromfd(fd);
+    struct iofile *file = posixio_file_acquire(fd);
 
-    if (file == NULL) {
-        posixio_fdunlock();
-        errno = EBADF;
+    if (file == NULL)
         return -1;
-    }
+
+    int ret = -1;
 
     if (file->dev->ioctl != NULL) {
         va_list ap;
         va_start(ap, request);
-        int ret = file->dev->ioctl(file->fh, request, ap);
+        ret = file->dev->ioctl(file->fh, request, ap);
         va_end(ap);
-        posixio_fdunlock();
-        return ret;
+    } else {
+        errno = ENOENT;
     }
 
-    posixio_fdunlock();
-    errno = ENOENT;
-    return -1;
+    posixio_stat_call(file, start, ret, 0);
+    posixio_file_release(file);
+    return ret;
 }
 
 
 /**
- * Implementation for \c dup(). Assumes fdlock is held.
+ * Check which of the requested events are ready on each descriptor.
+ *
+ * @returns The number of descriptors with a non-zero \c revents.
  */
-int _dup(struct iofile *file)
+static int _poll_scan(struct pollfd *fds, nfds_t nfds)
 {
-    // Get a new descriptor
-    int fd2 = posixio_newfd();
+    int ready = 0;
+
+    for (nfds_t i = 0; i < nfds; i++) {
+        fds[i].revents = 0;
+
+        // negative descriptors are ignored
+        if (fds[i].fd < 0)
+            continue;
+
+        struct iofile *file = posixio_file_acquire(fds[i].fd);
+        if (file == NULL) {
+            fds[i].revents = POLLNVAL;
+            ready++;
+            continue;
+        }
 
-    if (fd2 == -1)
+        // devices that cannot tell are always ready, like regular files
+        if (file->dev->poll != NULL)
+            fds[i].revents = file->dev->poll(file->fh, fds[i].events);
+        else
+            fds[i].revents = fds[i].events & (POLLIN | POLLOUT);
+
+        posixio_file_release(file);
+
+        if (fds[i].revents)
+            ready++;
+    }
+
+    return ready;
+}
+
+
+/**
+ * Waits for one of a set of file descriptors to become ready to perform
+ * I/O. Devices report readiness through their \c poll handler and wake
+ * pollers with posixio_poll_wake() when it may have changed.
+ *
+ * @param fds The descriptors and the events of interest for each. Entries
+ *      with a negative \c fd are ignored.
+ * @param nfds The number of entries in \c fds.
+ * @param timeout The longest time to wait in milliseconds; \c 0 to return
+ *      at once or a negative value to wait indefinitely.
+ * @returns The number of entries in \c fds with a non-zero \c revents,
+ *      \c 0 if the timeout expired or \c -1 on error with \c errno set
+ *      to an error value.
+ */
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    TickType_t start = xTaskGetTickCount();
+    TickType_t wait = timeout < 0 ? portMAX_DELAY :
+                      timeout == 0 ? 0 : MAX(MS2ST(timeout), 1);
+    int ready;
+
+    if (fds == NULL && nfds) {
+        errno = EFAULT;
         return -1;
+    }
+
+    int slot = posixio_poll_claim();
+    if (slot == -1)
+        return -1;
+
+    for (;; ) {
+        posixio_poll_arm(slot);
+
+        ready = _poll_scan(fds, nfds);
+        if (ready || !wait)
+            break;
+
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (wait != portMAX_DELAY && elapsed >= wait)
+            break;
+
+        if (!posixio_poll_wait(slot,
+                               wait == portMAX_DELAY ? portMAX_DELAY : wait - elapsed))
+            break;
+    }
+
+    posixio_poll_release(slot);
+
+    return ready;
+}
 
-    // allocate a file structure - store it with fd.
-    struct iofile *file2 = malloc(sizeof(struct iofile));
-    if (file2 == NULL) {
-        errno = ENOMEM;
+
+/**
+ * Implements \c select() on top of \c poll(). Only descriptors below
+ * \ref POSIXIO_MAX_OPEN_FILES can be open so \c nfds is limited to that.
+ *
+ * @param nfds One more than the highest descriptor in any of the sets.
+ * @param readfds Descriptors to check for readability, or \c NULL.
+ * @param writefds Descriptors to check for writability, or \c NULL.
+ * @param exceptfds Descriptors to check for exceptional conditions, or
+ *      \c NULL.
+ * @param timeout The longest time to wait or \c NULL to wait
+ *      indefinitely.
+ * @returns The number of ready descriptors across all the sets, which are
+ *      updated to contain only those, \c 0 if the timeout expired or
+ *      \c -1 on error with \c errno set to an error value.
+ */
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+           struct timeval *timeout)
+{
+    struct pollfd fds[POSIXIO_MAX_OPEN_FILES];
+    nfds_t n = 0;
+
+    if (nfds < 0 || nfds > POSIXIO_MAX_OPEN_FILES) {
+        errno = EINVAL;
         return -1;
     }
 
-    // copy it
-    memcpy(file2, file, sizeof(struct iofile));
+    for (int fd = 0; fd < nfds; fd++) {
+        short events = 0;
+        if (readfds != NULL && FD_ISSET(fd, readfds)) events |= POLLIN;
+        if (writefds != NULL && FD_ISSET(fd, writefds)) events |= POLLOUT;
+        if (exceptfds != NULL && FD_ISSET(fd, exceptfds)) events |= POLLPRI;
+        if (events) {
+            fds[n].fd = fd;
+            fds[n].events = events;
+            n++;
+        }
+    }
+
+    int ms = -1;
+    if (timeout != NULL)
+        ms = timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+
+    int ret = poll(fds, n, ms);
+    if (ret == -1)
+        return -1;
+
+    if (readfds != NULL) FD_ZERO(readfds);
+    if (writefds != NULL) FD_ZERO(writefds);
+    if (exceptfds != NULL) FD_ZERO(exceptfds);
 
-    // if the device has an open handler, use it
-    if (file2->dev->open != NULL) {
-        file2->fh = file2->dev->open(file2->name, file2->flags);
-        if (file2->fh == NULL) {
-            free(file2);
+    ret = 0;
+    for (nfds_t i = 0; i < n; i++) {
+        if (fds[i].revents & POLLNVAL) {
+            errno = EBADF;
             return -1;
         }
+        if (readfds != NULL && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+            FD_SET(fds[i].fd, readfds);
+            ret++;
+        }
+        if (writefds != NULL && (fds[i].revents & (POLLOUT | POLLERR))) {
+            FD_SET(fds[i].fd, writefds);
+            ret++;
+        }
+        if (exceptfds != NULL && (fds[i].revents & POLLPRI)) {
+            FD_SET(fds[i].fd, exceptfds);
+            ret++;
+        }
     }
 
+    return ret;
+}
+
+
+/**
+ * Implementation for \c dup(). Expects the caller to hold a reference on
+ * \c file but not posixio_fdlock(). The new descriptor shares the open
+ * file, and so its offset and status flags, as POSIX requires; the
+ * device is not asked to open anything again.
+ */
+int _dup(struct iofile *file)
+{
+    posixio_file_hold(file);
+
+    posixio_fdlock();
+
+    // Get a new descriptor
+    int fd2 = posixio_newfd();
+
     // store the file data
-    if (posixio_setfd(fd2, file2) == -1) {
-        free(file2);
+    if (fd2 == -1 || posixio_setfd(fd2, file, NULL) == -1) {
+        posixio_fdunlock();
+        posixio_file_release(file);
         return -1;
     }
 
+    posixio_fdunlock();
+
     return fd2;
 }
 
 
 /**
  * Duplicates the file descriptor for an open file \c fd. This allocates a new
- * file descriptor and clones the references of the open file \c fd into it.
+ * file descriptor that refers to the same open file as \c fd.
  *
  * @param fd An open file to operate on.
  * @returns A new file descriptor or \c -1 on error with \c errno set to an
@@ -371,19 +754,14 @@ int _dup(struct iofile *file)
  */
 int dup(int fd)
 {
-    posixio_fdlock();
-
-    struct iofile *file = posixio_file_fromfd(fd);
+    struct iofile *file = posixio_file_acquire(fd);
 
-    if (file == NULL) {
-        posixio_fdunlock();
-        errno = EBADF;
+    if (file == NULL)
         return -1;
-    }
 
     int ret = _dup(file);
 
-    posixio_fdunlock();
+    posixio_file_release(file);
     return ret;
 }
 
@@ -391,8 +769,8 @@ int dup(int fd)
 /**
  * Duplicates a file descriptor for the open file \c fd into a specified other
  * file descriptor \c fd2. It closes the descriptor \c fd2 if it has an open
- * file attached to it and then clones the references of the descriptor
- * \c fd into the descriptor \c fd2.
+ * file attached to it and then makes \c fd2 refer to the same open file as
+ * the descriptor \c fd.
  *
  * @param fd An open file to clone.
  * @param fd2 An arbitrary file descriptor value into which fd should be
@@ -402,7 +780,8 @@ int dup(int fd)
  */
 int dup2(int fd, int fd2)
 {
-    if (fd < 0 || fd >= POSIXIO_MAX_OPEN_FILES) {
+    if (fd < 0 || fd >= POSIXIO_MAX_OPEN_FILES ||
+        fd2 < 0 || fd2 >= POSIXIO_MAX_OPEN_FILES) {
         errno = EBADF;
         return -1;
     }
@@ -410,47 +789,23 @@ int dup2(int fd, int fd2)
     // Simple optimization
     if (fd == fd2) return fd;
 
-    posixio_fdlock();
-
-    struct iofile *file = posixio_file_fromfd(fd);
+    // the reference taken here is the one fd2 will hold
+    struct iofile *file = posixio_file_acquire(fd);
 
-    if (file == NULL) {
-        posixio_fdunlock();
-        errno = EBADF;
+    if (file == NULL)
         return -1;
-    }
 
-    // allocate a file structure - store it with fd.
-    struct iofile *file2 = malloc(sizeof(struct iofile));
-    if (file2 == NULL) {
-        posixio_fdunlock();
-        errno = ENOMEM;
-        return -1;
-    }
-
-    // copy it
-    memcpy(file2, file, sizeof(struct iofile));
-
-    // if the device has an open handler, use it
-    if (file2->dev->open != NULL) {
-        file2->fh = file2->dev->open(file2->name, file2->flags);
-        if (file2->fh == NULL) {
-            posixio_fdunlock();
-            free(file2);
-            return -1;
-        }
-    }
-
-    // store the file data
-    // this will close any pre-existing fd2
-    if (posixio_setfd(fd2, file2) == -1) {
-        posixio_fdunlock();
-        free(file2);
-        return -1;
-    }
+    // store the file data, detaching any pre-existing fd2
+    struct iofile *old = NULL;
 
+    posixio_fdlock();
+    posixio_setfd(fd2, file, &old);
     posixio_fdunlock();
 
+    // and close that outside of the lock
+    if (old != NULL)
+        posixio_file_release(old);
+
     return fd2;
 }
 
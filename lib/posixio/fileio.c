@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <string.h>
 #include <real_errno.h>
 
 /* The POSIX-ish I/O primitives!
@@ -36,29 +37,16 @@
  */
 int _link(const char *old, const char *new)
 {
-    // strip out device name from path
-    char *device = NULL, *path = NULL;
+    struct iodev *dev;
+    const char *path;
 
-    if (posixio_split_path_malloc(new, &device, &path) == -1)
+    // find the device and the file name on it
+    if (posixio_resolve(new, &dev, &path) == -1)
         return -1;
 
-    // validate device name
-    struct iodev *dev = posixio_getdev(device);
-    if (dev == NULL) {
-        free(device);
-        free(path);
-        errno = ENODEV;
-        return -1;
-    }
-    free(device);
+    if (dev->link != NULL)
+        return dev->link(path, old);
 
-    if (dev->link != NULL) {
-        int ret = dev->link(path, old);
-        free(path);
-        return ret;
-    }
-
-    free(path);
     errno = EMLINK;
     return -1;
 }
@@ -86,76 +74,42 @@ int _link(const char *old, const char *new)
  */
 int _open(const char *name, int flags, ...)
 {
-    // strip out device name from path
-    char *device = NULL, *path = NULL;
+    struct iodev *dev;
+    const char *file_name;
 
-    if (posixio_split_path_malloc(name, &device, &path) == -1)
+    // find the device and the file name on it
+    if (posixio_resolve(name, &dev, &file_name) == -1)
         return -1;
 
-    posixio_fdlock();
-
-    // validate device name
-    struct iodev *dev = posixio_getdev(device);
-    if (dev == NULL) {
-        posixio_fdunlock();
-        free(device);
-        free(path);
-        errno = ENODEV;
+    // take a file structure from the pool
+    struct iofile *file = posixio_file_alloc(dev, file_name, flags);
+    if (file == NULL)
         return -1;
-    }
 
-    // get an fd
-    int fd = posixio_newfd();
-    if (fd == -1) {
-        posixio_fdunlock();
-        free(device);
-        free(path);
-        return -1;
-    }
-
-    // allocate a file structure - store it with fd.
-    struct iofile *file = malloc(sizeof(struct iofile));
-    if (file == NULL) {
-        posixio_fdunlock();
-        free(device);
-        free(path);
-        errno = ENOMEM;
-        return -1;
-    }
-
-    // store the details
-    file->name = path;
-    file->dev = dev;
-    file->flags = flags;
-    file->fh = NULL;
-
-    // if the device has an open handler, use it
+    // if the device has an open handler, use it; this may block so
+    // is done before we take the descriptor lock
     if (dev->open != NULL) {
         va_list ap;
         va_start(ap, flags);
-        file->fh = dev->open(path, flags, ap);
+        file->fh = dev->open(file->name, flags, ap);
         va_end(ap);
         if (file->fh == NULL) {
-            posixio_fdunlock();
-            free(device);
-            free(path);
-            free(file);
+            posixio_file_free(file);
             return -1;
         }
     }
 
-    // store the file data
-    if (posixio_setfd(fd, file) == -1) {
+    posixio_fdlock();
+
+    // get an fd and store the file data
+    int fd = posixio_newfd();
+    if (fd == -1 || posixio_setfd(fd, file, NULL) == -1) {
         posixio_fdunlock();
-        free(device);
-        free(path);
-        free(file);
+        posixio_file_release(file);
         return -1;
     }
 
     posixio_fdunlock();
-    free(device);
-    // path and file are retained so are not free()ed here
 
     return fd;
 }
@@ -173,32 +127,16 @@ int _open(const char *name, int flags, ...)
  */
 int _stat(const char *file, struct stat *st)
 {
-    // strip out device name from path
-    char *device = NULL, *path = NULL;
+    struct iodev *dev;
+    const char *path;
 
-    if (posixio_split_path_malloc(file, &device, &path) == -1)
+    // find the device and the file name on it
+    if (posixio_resolve(file, &dev, &path) == -1)
         return -1;
 
-    // validate device name
-    posixio_fdlock();
-    struct iodev *dev = posixio_getdev(device);
-    if (dev == NULL) {
-        posixio_fdunlock();
-        free(device);
-        free(path);
-        errno = ENODEV;
-        return -1;
-    }
-
-    if (dev->stat != NULL) {
-        int ret = dev->stat(path, st);
-        posixio_fdunlock();
-        free(device);
-        free(path);
-        return ret;
-    }
+    if (dev->stat != NULL)
+        return dev->stat(path, st);
 
-    posixio_fdunlock();
     errno = ENOENT;
     return -1;
 }
@@ -214,32 +152,16 @@ int _stat(const char *file, struct stat *st)
  */
 int _unlink(const char *name)
 {
-    // strip out device name from path
-    char *device = NULL, *path = NULL;
+    struct iodev *dev;
+    const char *path;
 
-    if (posixio_split_path_malloc(name, &device, &path) == -1)
+    // find the device and the file name on it
+    if (posixio_resolve(name, &dev, &path) == -1)
         return -1;
 
-    // validate device name
-    posixio_fdlock();
-    struct iodev *dev = posixio_getdev(device);
-    if (dev == NULL) {
-        posixio_fdunlock();
-        free(device);
-        free(path);
-        errno = ENODEV;
-        return -1;
-    }
+    if (dev->unlink != NULL)
+        return dev->unlink(path);
 
-    if (dev->unlink != NULL) {
-        int ret = dev->unlink(path);
-        posixio_fdunlock();
-        free(device);
-        free(path);
-        return ret;
-    }
-
-    posixio_fdunlock();
     errno = EINVAL;
     return -1;
 }
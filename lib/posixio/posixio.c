@@ -15,6 +15,7 @@
 #include <config.h>
 
 #include <FreeRTOS.h>
+#include <task.h>
 #include <semphr.h>
 
 #include <fcntl.h>
@@ -25,18 +26,47 @@
 
 #include <posixio/posixio.h>
 #include <posixio/dev/serial.h>
+#include <posixio/dev/frame.h>
+#include <posixio/dev/sys.h>
+#include <posixio/dev/mem.h>
+#include <posixio/dev/pipe.h>
+#include <stdio.h>
 
 /// List of the registered devices.
 static struct iodev *devs[POSIXIO_MAX_DEVICES];
 /// The number of registered devices,
 static volatile int dev_count = 0;
 
+/// Number of slots in the device name hash; a power of two.
+#define DEV_HASH_SIZE 64
+/// Device name hash. Each slot holds an index into \ref devs plus one,
+/// or \c 0 if the slot is empty. Collisions probe linearly.
+static volatile uint8_t dev_hash[DEV_HASH_SIZE];
+
+#if POSIXIO_MAX_DEVICES * 2 > DEV_HASH_SIZE
+#error "POSIXIO_MAX_DEVICES is too large for the device name hash"
+#endif
+
 /// A semaphore to protect critical sections.
 static SemaphoreHandle_t fd_sem;
 
 /// List of currently open files.
 static struct iofile *files[POSIXIO_MAX_OPEN_FILES];
 
+/// Storage for open files.
+static struct iofile file_pool[POSIXIO_MAX_OPEN_FILES];
+/// Stack of unused entries in \ref file_pool.
+static struct iofile *file_free[POSIXIO_MAX_OPEN_FILES];
+/// Number of entries on the \ref file_free stack.
+static volatile int file_free_count;
+
+/// One semaphore for each task that may be blocked in poll().
+static SemaphoreHandle_t poll_sems[POSIXIO_MAX_POLLERS];
+/// Bitmap of the \ref poll_sems slots in use.
+static volatile uint32_t poll_claimed;
+/// Bitmap of the \ref poll_sems slots whose owner wants waking.
+static volatile uint32_t poll_armed;
+
 
 /**
  * Initialize the POSIX I/O layer. At minimum, this will reset the list
@@ -50,10 +80,26 @@ int posixio_start(void)
 
     ASSERT((fd_sem = xSemaphoreCreateMutex()));
 
-    for (i = 0; i < POSIXIO_MAX_OPEN_FILES; i++)
+    for (i = 0; i < POSIXIO_MAX_OPEN_FILES; i++) {
         files[i] = NULL;
+        file_free[i] = &file_pool[i];
+    }
+    file_free_count = POSIXIO_MAX_OPEN_FILES;
+
+    for (i = 0; i < POSIXIO_MAX_POLLERS; i++)
+        ASSERT((poll_sems[i] = xSemaphoreCreateBinary()));
 
-    if (!posixio_register_serial()) return 0;
+#if POSIXIO_STATS
+    dwt_start();
+#endif
+
+    if (posixio_register_serial()) return 0;
+    if (posixio_register_frame()) return 0;
+    if (posixio_register_sys()) return 0;
+    if (posixio_register_pipe()) return 0;
+#if MEMFS_SIZE
+    if (posixio_register_mem()) return 0;
+#endif
 
     // A hack to fool the linker
     _open("", 0);
@@ -63,6 +109,26 @@ int posixio_start(void)
 }
 
 
+/**
+ * Hash a device name of a given length (FNV-1a).
+ *
+ * @param name The device name; need not be NUL terminated.
+ * @param len The number of characters of \c name to hash.
+ * @returns The hash value.
+ */
+static uint32_t posixio_dev_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    while (len--) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+
 /**
  * Register a device.
  *
@@ -72,14 +138,32 @@ int posixio_start(void)
  */
 int posixio_register_dev(struct iodev *dev)
 {
+    size_t len = strlen(dev->name);
+    uint32_t slot = posixio_dev_hash(dev->name, len);
+
+    posixio_fdlock();
+
     if (dev_count == POSIXIO_MAX_DEVICES) {
+        posixio_fdunlock();
         errno = ENOENT;
         return -1;
     }
 
-    posixio_fdlock();
+    if (posixio_getdev_n(dev->name, len) != NULL) {
+        posixio_fdunlock();
+        errno = EEXIST;
+        return -1;
+    }
+
+    while (dev_hash[slot & (DEV_HASH_SIZE - 1)])
+        slot++;
+
+    // Publish the device before the hash slot that refers to it so
+    // that lookups, which do not take the lock, never see a half entry.
     devs[dev_count] = dev;
     dev_count++;
+    dev_hash[slot & (DEV_HASH_SIZE - 1)] = dev_count;
+
     posixio_fdunlock();
 
     return 0;
@@ -138,14 +222,18 @@ struct iofile *posixio_file_fromfd(int fd)
  * This function assumes that the current task holds posixio_fdlock().
  * This is an internal function.
  *
- * @param fd The file descriptor to update. If the descriptor currently
- *      references an open file that file will first be closed.
- * @param file The struct \ref iofile to update the descriptor with.
- *      The contents are copied.
+ * @param fd The file descriptor to update.
+ * @param file The struct \ref iofile to update the descriptor with. The
+ *      descriptor table takes over the reference the caller holds on it.
+ * @param old If the descriptor currently references an open file, that file
+ *      is detached from the descriptor and returned here. The caller must
+ *      pass it to posixio_file_release() once it has dropped
+ *      posixio_fdlock(). May be \c NULL only if the caller knows the
+ *      descriptor is unused.
  * @returns \c 0 on success or, if there is an error, \c -1 with an error code
  *      in \c errno.
  */
-int posixio_setfd(int fd, struct iofile *file)
+int posixio_setfd(int fd, struct iofile *file, struct iofile **old)
 {
     // assumes we have fdlock
     if (fd < 0 || fd >= POSIXIO_MAX_OPEN_FILES) {
@@ -153,17 +241,202 @@ int posixio_setfd(int fd, struct iofile *file)
         return -1;
     }
 
+    if (old != NULL)
+        *old = files[fd];
+
+    files[fd] = file;
+
+    return 0;
+}
+
+
+/**
+ * Take an unused iofile structure from the pool and fill it in. The new
+ * file holds a single reference, ready to be stored in the descriptor
+ * table with posixio_setfd().
+ * This function does not need posixio_fdlock().
+ * This is an internal function.
+ *
+ * @param dev The device the file resides on.
+ * @param name The name of the file on the device. This is copied.
+ * @param flags Any flags given to \c open().
+ * @returns The new file on success or \c NULL with \c errno set to
+ *      \c ENAMETOOLONG or \c ENFILE.
+ */
+struct iofile *posixio_file_alloc(struct iodev *dev, const char *name, int flags)
+{
+    struct iofile *file = NULL;
+    size_t len = strlen(name);
+
+    if (len >= POSIXIO_MAX_FILENAME) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    taskENTER_CRITICAL();
+    if (file_free_count > 0)
+        file = file_free[--file_free_count];
+    taskEXIT_CRITICAL();
+
     if (file == NULL) {
-        // Assume it was closed already
-        files[fd] = NULL;
+        errno = ENFILE;
+        return NULL;
+    }
+
+    memcpy(file->name, name, len + 1);
+    file->dev = dev;
+    file->fh = NULL;
+    file->flags = flags;
+    file->refs = 1;
+#if POSIXIO_STATS
+    memset(&file->stats, '\0', sizeof(file->stats));
+#endif
+
+    return file;
+}
+
+
+/**
+ * Return an iofile structure to the pool without calling the device.
+ * Used to back out of an open that the device refused; open files
+ * should be given up with posixio_file_release() instead.
+ * This is an internal function.
+ *
+ * @param file The file to return to the pool.
+ */
+void posixio_file_free(struct iofile *file)
+{
+    file->dev = NULL;
+
+    taskENTER_CRITICAL();
+    file_free[file_free_count++] = file;
+    taskEXIT_CRITICAL();
+}
+
+
+/**
+ * Find the iofile structure for an open file identified by a file
+ * descriptor and take a reference on it. The reference keeps the file,
+ * and the device handle within it, valid after posixio_fdlock() is
+ * dropped, so the caller may block in the device without holding up
+ * other tasks. Every successful call must be paired with a call to
+ * posixio_file_release().
+ * This function takes posixio_fdlock() itself.
+ * This is an internal function.
+ *
+ * @param fd The file descriptor to fetch the iofile for.
+ * @returns A struct iofile on success or \c NULL, with \c errno set to
+ *      \c EBADF, if the descriptor is not open.
+ */
+struct iofile *posixio_file_acquire(int fd)
+{
+    struct iofile *file;
+    uint32_t start = posixio_stat_now();
+
+    posixio_fdlock();
+    uint32_t waited = posixio_stat_now() - start;
+    file = posixio_file_fromfd(fd);
+    if (file != NULL) {
+        taskENTER_CRITICAL();
+        file->refs++;
+        taskEXIT_CRITICAL();
+    }
+    posixio_fdunlock();
+
+    if (file == NULL) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    posixio_stat_wait(file, waited);
+
+    return file;
+}
+
+
+/**
+ * Take a further reference on a file the caller already holds one on,
+ * such as to store it in a second descriptor for \c dup().
+ * This function does not need posixio_fdlock().
+ * This is an internal function.
+ *
+ * @param file The file to take a reference on.
+ */
+void posixio_file_hold(struct iofile *file)
+{
+    taskENTER_CRITICAL();
+    file->refs++;
+    taskEXIT_CRITICAL();
+}
+
+
+/**
+ * Drop a reference to an open file. When the last reference goes away
+ * the \c close handler of the underlying device is called and the iofile
+ * structure is returned to the pool.
+ * This may be called with or without posixio_fdlock() held, though
+ * callers should prefer to release files outside of the lock since the
+ * device may block in its close handler.
+ * This is an internal function.
+ *
+ * @param file The file to release.
+ * @returns \c 0 on success or the value returned by the device \c close
+ *      handler when the last reference was dropped.
+ */
+int posixio_file_release(struct iofile *file)
+{
+    int refs, ret = 0;
+
+    taskENTER_CRITICAL();
+    refs = --file->refs;
+    taskEXIT_CRITICAL();
+
+    if (refs > 0)
         return 0;
+
+    if (file->dev->close != NULL)
+        ret = file->dev->close(file->fh);
+
+    posixio_file_free(file);
+
+    return ret;
+}
+
+
+/**
+ * Resolves a path that looks like \c "/DEVICE/FILE" to the registered
+ * device \c "DEVICE" and the \c "FILE" part of the path. The path is
+ * parsed in place; nothing is copied or allocated and the returned file
+ * name points into \c path.
+ * This function does not need posixio_fdlock().
+ *
+ * @param path The path to resolve.
+ * @param dev Set to the device named in the path.
+ * @param file Set to the file part of the path, after the device name.
+ * @returns \c 0 on success, \c -1 otherwise with \c errno set to
+ *      \c EINVAL if the path is malformed or \c ENODEV if no such device
+ *      is registered.
+ */
+int posixio_resolve(const char *path, struct iodev **dev, const char **file)
+{
+    if (path == NULL || path[0] != '/') {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const char *p = strchr(path + 1, '/');
+    if (p == NULL) {
+        errno = EINVAL;
+        return -1;
     }
 
-    if (files[fd] != NULL)
-        // We need to close the file we're replacing
-        close(fd);
+    *dev = posixio_getdev_n(path + 1, p - (path + 1));
+    if (*dev == NULL) {
+        errno = ENODEV;
+        return -1;
+    }
 
-    files[fd] = file;
+    *file = p + 1;
 
     return 0;
 }
@@ -173,13 +446,13 @@ int posixio_setfd(int fd, struct iofile *file)
  * Attempts to split a string that looks like \c "/DEVICE/FILE"
  * into two strings; one for \c "DEVICE" and one for \c "FILE". This
  * helper copies the results into two string buffers provided
- * by the caller.
+ * by the caller. Either part is truncated if its buffer is too small.
  *
  * @param path The string to split.
  * @param device The string to copy the device name into.
- * @param device_len The maximum length that may be copied into device.
+ * @param device_len The size of the device buffer.
  * @param file The string to copy the file name into.
- * @param file_len The maximum length that may be copied into file.
+ * @param file_len The size of the file buffer.
  * @returns \c 0 on success, \c -1 otherwise with \c errno set to an error
  *      code.
  */
@@ -187,7 +460,7 @@ int posixio_split_path(const char *path,
                        char *device, size_t device_len,
                        char *file, size_t file_len)
 {
-    if (path == NULL || path[0] != '/') {
+    if (path == NULL || path[0] != '/' || device_len == 0 || file_len == 0) {
         errno = EINVAL;
         return -1;
     }
@@ -203,10 +476,10 @@ int posixio_split_path(const char *path,
     len = p - (path + 1);
     if (len > (device_len - 1))
         len = device_len - 1;
-    strncpy((char *)path + 1, device, len);
-    device[len - 1] = '\0';
+    memcpy(device, path + 1, len);
+    device[len] = '\0';
 
-    strncpy(p + 1, file, file_len);
+    strncpy(file, p + 1, file_len);
     file[file_len - 1] = '\0';
 
     return 0;
@@ -219,6 +492,8 @@ int posixio_split_path(const char *path,
  * helper copies the results into two string buffers allocated
  * using \c malloc(). It is the callers responsibilty to \c free() these
  * strings when no longer needed.
+ * The file I/O functions use posixio_resolve() instead, which does not
+ * allocate.
  *
  * @param path The string to split.
  * @param device Pointer to the string to copy the device name into.
@@ -263,23 +538,305 @@ int posixio_split_path_malloc(const char *path,
 }
 
 
+/**
+ * Find a device by name amongst the list of registered devices using
+ * the device name hash.
+ * This function does not need posixio_fdlock().
+ *
+ * @param name The name of the device to search for; need not be NUL
+ *      terminated.
+ * @param len The length of the name.
+ * @returns A struct \ref iodev on success or \c NULL otherwise.
+ */
+struct iodev *posixio_getdev_n(const char *name, size_t len)
+{
+    uint32_t slot = posixio_dev_hash(name, len);
+    uint8_t idx;
+
+    while ((idx = dev_hash[slot & (DEV_HASH_SIZE - 1)]) != 0) {
+        struct iodev *dev = devs[idx - 1];
+        if (!strncmp(name, dev->name, len) && dev->name[len] == '\0')
+            return dev;
+        slot++;
+    }
+
+    return NULL;
+}
+
+
 /**
  * Attempt to find a named device amongst the list of registered devices.
- * This function assumes that the current task holds posixio_fdlock().
+ * This function does not need posixio_fdlock().
  *
  * @param name The name of the device to search for.
  * @returns A struct \ref iodev on success or \c NULL otherwise.
  */
-struct iodev *posixio_getdev(char *name)
+struct iodev *posixio_getdev(const char *name)
 {
-    // assumes we have fdlock
-    int i;
+    return posixio_getdev_n(name, strlen(name));
+}
 
-    for (i = 0; i < dev_count; i++)
-        if (!strcmp(name, devs[i]->name))
-            return devs[i];
-    return NULL;
+
+/**
+ * Claim a poller slot for the current task. A task in \c poll() holds a
+ * slot for the duration of the call; devices wake every armed slot
+ * when something changes that might make a descriptor ready.
+ * This is an internal function.
+ *
+ * @returns The slot number or \c -1, with \c errno set to \c EAGAIN, if
+ *      \ref POSIXIO_MAX_POLLERS tasks are already polling.
+ */
+int posixio_poll_claim(void)
+{
+    int slot = -1;
+
+    taskENTER_CRITICAL();
+    for (int i = 0; i < POSIXIO_MAX_POLLERS; i++) {
+        if (!(poll_claimed & (1 << i))) {
+            poll_claimed |= 1 << i;
+            slot = i;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    if (slot == -1) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // discard any wakeup left over from a previous owner
+    xSemaphoreTake(poll_sems[slot], 0);
+
+    return slot;
+}
+
+
+/**
+ * Ask to be woken by the next call to posixio_poll_wake(). This must be
+ * done before checking whether any descriptor is ready so that an event
+ * arriving between the check and posixio_poll_wait() is not lost.
+ * This is an internal function.
+ *
+ * @param slot A slot from posixio_poll_claim().
+ */
+void posixio_poll_arm(int slot)
+{
+    taskENTER_CRITICAL();
+    poll_armed |= 1 << slot;
+    taskEXIT_CRITICAL();
+}
+
+
+/**
+ * Wait for a wakeup on an armed poller slot. The slot is disarmed
+ * when this returns.
+ * This is an internal function.
+ *
+ * @param slot A slot from posixio_poll_claim().
+ * @param timeout The longest time to wait, in ticks.
+ * @returns \c 1 if woken or \c 0 if the timeout expired.
+ */
+int posixio_poll_wait(int slot, TickType_t timeout)
+{
+    int ret = xSemaphoreTake(poll_sems[slot], timeout) == pdTRUE;
+
+    taskENTER_CRITICAL();
+    poll_armed &= ~(1 << slot);
+    taskEXIT_CRITICAL();
+
+    return ret;
+}
+
+
+/**
+ * Give up a poller slot.
+ * This is an internal function.
+ *
+ * @param slot A slot from posixio_poll_claim().
+ */
+void posixio_poll_release(int slot)
+{
+    taskENTER_CRITICAL();
+    poll_armed &= ~(1 << slot);
+    poll_claimed &= ~(1 << slot);
+    taskEXIT_CRITICAL();
+}
+
+
+/**
+ * Wake every task blocked in \c poll() so that it checks its descriptors
+ * again. Devices call this when a file may have become readable or
+ * writable.
+ */
+void posixio_poll_wake(void)
+{
+    uint32_t armed;
+
+    taskENTER_CRITICAL();
+    armed = poll_armed;
+    poll_armed = 0;
+    taskEXIT_CRITICAL();
+
+    for (int i = 0; armed; i++, armed >>= 1)
+        if (armed & 1)
+            xSemaphoreGive(poll_sems[i]);
+}
+
+
+/**
+ * Interrupt-safe version of posixio_poll_wake(). This is cheap when no
+ * task is polling, so devices may call it for every event.
+ *
+ * @param wakeup Set to \c pdTRUE if a higher priority task was woken;
+ *      the ISR should pass this to \c portEND_SWITCHING_ISR().
+ */
+void posixio_poll_wake_from_isr(BaseType_t *wakeup)
+{
+    uint32_t armed;
+    UBaseType_t mask;
+
+    mask = portSET_INTERRUPT_MASK_FROM_ISR();
+    armed = poll_armed;
+    poll_armed = 0;
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+
+    for (int i = 0; armed; i++, armed >>= 1)
+        if (armed & 1)
+            xSemaphoreGiveFromISR(poll_sems[i], wakeup);
+}
+
+
+#if POSIXIO_STATS
+/// Add to a statistics counter without a lock.
+#define STAT_ADD(field, n) __sync_fetch_and_add(&(field), (n))
+
+/** Account for one call in a set of statistics. */
+static void _stat_add(struct iostat *st, int bucket, uint32_t us, ssize_t ret, int data)
+{
+    STAT_ADD(st->calls, 1);
+    if (ret < 0)
+        STAT_ADD(st->errors, 1);
+    else if (data)
+        STAT_ADD(st->bytes, ret);
+    STAT_ADD(st->time_us, us);
+    STAT_ADD(st->hist[bucket], 1);
+}
+
+
+/**
+ * Account for a completed call on an open file, in the statistics of
+ * both the file and its device. This takes no locks so it is cheap
+ * enough to leave enabled.
+ * This is an internal function.
+ *
+ * @param file The file the call was made on.
+ * @param start The value of posixio_stat_now() when the call began.
+ * @param ret The value the call returns; negative for failure.
+ * @param data Non-zero if \c ret counts bytes transferred.
+ */
+void posixio_stat_call(struct iofile *file, uint32_t start, ssize_t ret, int data)
+{
+    uint32_t cycles = dwt_cycles() - start;
+    int bucket = 32 - __builtin_clz(cycles | 1) - POSIXIO_STAT_SHIFT;
+
+    if (bucket < 0)
+        bucket = 0;
+    else if (bucket >= POSIXIO_STAT_BUCKETS)
+        bucket = POSIXIO_STAT_BUCKETS - 1;
+
+    uint32_t us = dwt_cycles_to_us(cycles);
+
+    _stat_add(&file->stats, bucket, us, ret, data);
+    _stat_add(&file->dev->stats, bucket, us, ret, data);
+}
+
+
+/**
+ * Account for time spent waiting for posixio_fdlock() on behalf of an
+ * open file.
+ * This is an internal function.
+ *
+ * @param file The file that was being looked up.
+ * @param cycles The CPU cycles spent waiting.
+ */
+void posixio_stat_wait(struct iofile *file, uint32_t cycles)
+{
+    STAT_ADD(file->stats.lock_wait, cycles);
+    STAT_ADD(file->dev->stats.lock_wait, cycles);
+}
+
+
+/** Append one set of statistics to a report; see posixio_stats_format(). */
+static size_t _stat_format(char *buf, size_t size, size_t len,
+                           const char *name, const char *fd,
+                           const struct iostat *st)
+{
+    size_t n;
+
+#define STAT_PRINTF(...) \
+    n = MIN(len, size); \
+    len += snprintf(buf + n, size - n, __VA_ARGS__)
+
+    STAT_PRINTF("%-8s %3s %8lu %10lu %6lu %10lu %10lu" EOL "    ",
+                name, fd,
+                (unsigned long)st->calls, (unsigned long)st->bytes,
+                (unsigned long)st->errors, (unsigned long)st->time_us,
+                (unsigned long)st->lock_wait);
+    for (int i = 0; i < POSIXIO_STAT_BUCKETS; i++) {
+        STAT_PRINTF(" %lu", (unsigned long)st->hist[i]);
+    }
+    STAT_PRINTF(EOL);
+
+#undef STAT_PRINTF
+
+    return len;
+}
+
+
+/**
+ * Write a text report of the I/O statistics of every device and every
+ * open file into a buffer. Each has a line of counters followed by a
+ * line with its latency histogram, fastest bucket first.
+ *
+ * @param buf The buffer to write to; may be \c NULL if \c size is \c 0.
+ * @param size The size of \c buf. The report is truncated, but always
+ *      NUL terminated, if it does not fit.
+ * @returns The length of the whole report, not counting the NUL, as for
+ *      \c snprintf().
+ */
+size_t posixio_stats_format(char *buf, size_t size)
+{
+    size_t len;
+    char fd[8];
+
+    len = snprintf(buf, size, "%-8s %3s %8s %10s %6s %10s %10s" EOL
+                   "    latency histogram from <2^%d cycles" EOL,
+                   "name", "fd", "calls", "bytes", "errors", "time_us",
+                   "lock_cyc", POSIXIO_STAT_SHIFT);
+
+    for (int i = 0; i < dev_count; i++)
+        len = _stat_format(buf, size, len, devs[i]->name, "-",
+                           &devs[i]->stats);
+
+    posixio_fdlock();
+    for (int i = 0; i < POSIXIO_MAX_OPEN_FILES; i++) {
+        if (files[i] == NULL)
+            continue;
+        snprintf(fd, sizeof(fd), "%d", i);
+        len = _stat_format(buf, size, len, files[i]->dev->name, fd,
+                           &files[i]->stats);
+    }
+    posixio_fdunlock();
+
+    return len;
+}
+#else
+size_t posixio_stats_format(char *buf, size_t size)
+{
+    return snprintf(buf, size, "I/O statistics are disabled." EOL);
 }
+#endif
 
 
 /// Acquire the posixio semaphore.
@@ -13,19 +13,126 @@
 #define _POSIXIO_H
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <FreeRTOS.h>
+#include <event_groups.h>
 
 #ifndef POSIXIO_MAX_OPEN_FILES
 /// Maximum number of concurrently open files.
 #define POSIXIO_MAX_OPEN_FILES 32
 #endif
+#ifndef POSIXIO_MAX_FILENAME
+/// Longest file name, after the device part, that may be opened; this
+/// includes the terminating NUL.
+#define POSIXIO_MAX_FILENAME 16
+#endif
+#ifndef POSIXIO_MAX_POLLERS
+/// Maximum number of tasks that may be blocked in \c poll() at once.
+#define POSIXIO_MAX_POLLERS 4
+#endif
 #ifndef POSIXIO_MAX_DEVICES
-/// Maxium number of registered devices.
+/// Maxium number of registered devices. At most half the size of the
+/// device name hash.
 #define POSIXIO_MAX_DEVICES 32
 #endif
 
+#ifndef POSIXIO_PIPE_SIZE
+/// Size of the ring buffer of each pipe; a power of two.
+#define POSIXIO_PIPE_SIZE 256
+#endif
+#ifndef POSIXIO_STATS
+/// Keep I/O statistics for each open file and each device.
+#define POSIXIO_STATS 1
+#endif
+#ifndef POSIXIO_STAT_BUCKETS
+/// Number of buckets in each call latency histogram.
+#define POSIXIO_STAT_BUCKETS 16
+#endif
+/// Log2 of the latency, in CPU cycles, below which calls fall in the
+/// first histogram bucket. Each following bucket covers twice the range
+/// of the one before, and the last catches everything slower.
+#define POSIXIO_STAT_SHIFT 8
+
 struct stat;
+struct timeval;
+struct timespec;
+struct iofile;
+
+#if !defined(__iovec_defined) && !defined(_SYS_UIO_H_)
+/// A buffer segment, for \c readv() and \c writev().
+struct iovec {
+    void    *iov_base;  ///< Start of the segment.
+    size_t  iov_len;    ///< Length of the segment in bytes.
+};
+#endif
+
+#ifndef IOV_MAX
+/// Most segments accepted by \c readv() and \c writev().
+#define IOV_MAX 16
+#endif
+
+#ifndef POLLIN
+/// Events to wait for on a descriptor, for \c poll().
+struct pollfd {
+    int     fd;         ///< The file descriptor to poll.
+    short   events;     ///< The events of interest.
+    short   revents;    ///< The events that occurred.
+};
+
+/// Number of entries in a \c poll() list.
+typedef unsigned int nfds_t;
+
+#define POLLIN      0x0001  ///< Data may be read without blocking.
+#define POLLPRI     0x0002  ///< Priority data may be read without blocking.
+#define POLLOUT     0x0004  ///< Data may be written without blocking.
+#define POLLERR     0x0008  ///< An error has occurred (output only).
+#define POLLHUP     0x0010  ///< The device has been disconnected (output only).
+#define POLLNVAL    0x0020  ///< The descriptor is not open (output only).
+#endif
+
+/**
+ * I/O statistics, kept for each open file and for each device when
+ * \ref POSIXIO_STATS is set. Counters are updated without locks and
+ * wrap silently.
+ */
+struct iostat {
+    uint32_t    calls;      ///< Number of calls made.
+    uint32_t    bytes;      ///< Bytes read or written.
+    uint32_t    errors;     ///< Number of calls that failed.
+    uint32_t    time_us;    ///< Total time spent in calls, in microseconds.
+    uint32_t    lock_wait;  ///< CPU cycles spent waiting for the descriptor table lock.
+    uint32_t    hist[POSIXIO_STAT_BUCKETS]; ///< Call latencies; see \ref POSIXIO_STAT_SHIFT.
+};
+
+/**
+ * An asynchronous I/O request. Fill in the descriptor, buffer and length
+ * and, optionally, one or both of the completion notifications, then pass
+ * it to \c aio_read() or \c aio_write(). The request must stay put until
+ * \c aio_return() has been called on it.
+ *
+ * In place of POSIX signals completion may call a function, which runs
+ * in interrupt context on devices that complete from their DMA interrupt,
+ * and may set bits in an event group.
+ */
+struct aiocb {
+    int                 aio_fildes; ///< The file to operate on.
+    off_t               aio_offset; ///< File offset; ignored by stream devices.
+    volatile void       *aio_buf;   ///< The data buffer.
+    size_t              aio_nbytes; ///< Number of bytes to transfer.
+
+    /// Called on completion, or \c NULL. \c wakeup is as for the
+    /// FreeRTOS \c FromISR calls, and is \c NULL in task context.
+    void                (*aio_notify)(struct aiocb *cb, BaseType_t *wakeup);
+    EventGroupHandle_t  aio_event;  ///< Event group to signal on completion, or \c NULL.
+    EventBits_t         aio_bits;   ///< Bits to set in \c aio_event.
+
+    // private
+    struct iofile       *__file;    ///< The file, held until \c aio_return().
+    volatile int        __error;    ///< \c EINPROGRESS until complete, then the error.
+    ssize_t             __return;   ///< The result, once complete.
+};
 
 /**
  * The definition of an IO device, specifically the handlers it provides
@@ -39,9 +146,17 @@ struct iodev {
     off_t   (*lseek)(void *fh, off_t ptr, int dir);             ///< Handler for \c lseek() of a file on this device.
     ssize_t (*read)(void *fh, void *ptr, size_t len);           ///< Handler for \c read() from a file on this device.
     ssize_t (*write)(void *fh, const void *ptr, size_t len);    ///< Handler for \c write() to a file on this device.
+    ssize_t (*readv)(void *fh, const struct iovec *iov, int iovcnt);    ///< Optional handler for \c readv(); \c read is used per segment if absent.
+    ssize_t (*writev)(void *fh, const struct iovec *iov, int iovcnt);   ///< Optional handler for \c writev(); \c write is used per segment if absent.
     int     (*fstat)(void *fh, struct stat *st);                ///< Handler for \c fstat() of a file on this device.
     int     (*fcntl)(void *fh, int cmd, int arg);               ///< Handler for \c fcntl() of a file on this device.
-    int     (*ioctl)(void *fh, unsigned long request, ...);     ///< Handler for \c ioctl() of a file on this device.
+    int     (*ioctl)(void *fh, unsigned long request, va_list ap); ///< Handler for \c ioctl() of a file on this device, given the request's argument in \c ap.
+    short   (*poll)(void *fh, short events);                    ///< Handler for \c poll(); returns which of \c events are ready now, without blocking.
+    ssize_t (*borrow)(void *fh, const void **ptr, size_t len);  ///< Optional handler for \c posixio_borrow(); lends out received data in place.
+    int     (*release)(void *fh, size_t len);                   ///< Handler for \c posixio_release(); required if \c borrow is given.
+    int     (*aio_read)(void *fh, struct aiocb *cb);            ///< Optional handler for \c aio_read(); starts the transfer and calls posixio_aio_complete() when it finishes.
+    int     (*aio_write)(void *fh, struct aiocb *cb);           ///< Optional handler for \c aio_write(); as for \c aio_read.
+    void    * (*mmap)(void *fh, off_t offset, size_t len);      ///< Optional handler for \c posixio_mmap(); returns a pointer to the file's backing memory.
 
     // fileio handlers
     int     (*link)(const char *old, const char *new);      ///< Handler for \c link() targeting filenames on this device.
@@ -50,6 +165,10 @@ struct iodev {
     int     (*unlink)(const char *name);                    ///< Handler for \c unlink() of a filename on this device.
 
     int     flags;                                          ///< Device flags. See \ref POSIXIO_DEVICE_FLAGS.
+
+#if POSIXIO_STATS
+    struct iostat   stats;                                  ///< Totals for all files on this device.
+#endif
 };
 
 enum POSIXIO_DEVICE_FLAGS {
@@ -61,13 +180,24 @@ enum POSIXIO_DEVICE_FLAGS {
 
 
 /**
- * The state of an open file.
+ * The state of an open file. These are allocated from a fixed pool of
+ * \ref POSIXIO_MAX_OPEN_FILES entries, so opening and closing files
+ * never touches the heap.
+ *
+ * Open files are reference counted. The descriptor table holds one
+ * reference and every I/O call in progress on the file holds another,
+ * so a file that is closed while a task is blocked inside the device
+ * is only handed back to the device once that call returns.
  */
 struct iofile {
-    char            *name;  ///< The name of the file.
+    char            name[POSIXIO_MAX_FILENAME]; ///< The name of the file.
     struct iodev    *dev;   ///< The device the file resides on.
     void            *fh;    ///< An opaque handle given to us by the dev.
     int             flags;  ///< Any flags given to \c open()
+    volatile int    refs;   ///< Number of references held on this file.
+#if POSIXIO_STATS
+    struct iostat   stats;  ///< Statistics since the file was opened.
+#endif
 };
 
 /**
@@ -86,20 +216,32 @@ enum POSIXIO_DEVICES {
     DEV_I2C1,       ///< I2C port 1
     DEV_I2C2,       ///< I2C port 2
     DEV_MMC1,       ///< MMC/SDIO port 1
+    DEV_MEM,        ///< RAM-backed files
 };
 
 /**
  * Our IOCTL's. We lack real ones, but these will do for us, for now.
  */
 enum POSIXIO_IOCTLS {
-    IOCTL_SETBAUD = 1,
+    IOCTL_SETBAUD = 1,  ///< Set the serial baud rate (\c unsigned \c int); \c EINVAL if it cannot be reached closely enough.
+    IOCTL_SETVMIN,      ///< Set the bytes a blocking serial read waits for (\c unsigned \c int).
+    IOCTL_SETVTIME,     ///< Set the serial line idle time that ends a read, in tenths of a second (\c unsigned \c int).
+    IOCTL_GETVMIN,      ///< Get the serial read minimum (\c unsigned \c int \c *).
+    IOCTL_GETVTIME,     ///< Get the serial read idle time (\c unsigned \c int \c *).
+    IOCTL_GETBAUD,      ///< Get the baud rate the serial port really runs at (\c unsigned \c int \c *).
+    IOCTL_GETERRORS,    ///< Get the serial receive error counts (\c struct \c serial_errors \c *).
+    IOCTL_SETCODEC,     ///< Set how frames are delimited (\c enum \c frame_codec).
+    IOCTL_SETCHECK,     ///< Set the check frames carry (\c enum \c frame_check).
+    IOCTL_GETFRAMESTATS, ///< Get the frame decoder counts (\c struct \c frame_stats \c *).
 };
 
 
 int posixio_start(void);
 
+int posixio_resolve(const char *path, struct iodev **dev, const char **file);
 int posixio_split_path(const char *path, char *device, size_t device_len, char *file, size_t file_len);
 int posixio_split_path_malloc(const char *path, char **device, char **file);
+size_t posixio_stats_format(char *buf, size_t size);
 
 int _link(const char *old, const char *new);
 int _open(const char *name, int flags, ...);
@@ -111,21 +253,59 @@ int _isatty(int fd);
 off_t _lseek(int fd, off_t ptr, int dir);
 ssize_t _read(int fd, void *ptr, size_t len);
 ssize_t _write(int fd, const void *ptr, size_t len);
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
 int _fstat(int fd, struct stat *st);
 int _fcntl(int fd, int cmd, int arg);
 int ioctl(int fd, unsigned long request, ...);
 int dup(int fd);
 int dup2(int fd, int fd2);
+int pipe(int fds[2]);
+int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout);
+ssize_t posixio_borrow(int fd, const void **ptr, size_t len);
+int posixio_release(int fd, size_t len);
+void *posixio_mmap(int fd, off_t offset, size_t len);
+int aio_read(struct aiocb *cb);
+int aio_write(struct aiocb *cb);
+int aio_error(const struct aiocb *cb);
+ssize_t aio_return(struct aiocb *cb);
+int aio_suspend(const struct aiocb *const list[], int nent, const struct timespec *timeout);
 
 
 #ifdef POSIXIO_PRIVATE
 int posixio_register_dev(struct iodev *dev);
 int posixio_newfd(void);
 struct iofile *posixio_file_fromfd(int fd);
-int posixio_setfd(int fd, struct iofile *file);
-struct iodev *posixio_getdev(char *name);
+int posixio_setfd(int fd, struct iofile *file, struct iofile **old);
+struct iofile *posixio_file_alloc(struct iodev *dev, const char *name, int flags);
+void posixio_file_free(struct iofile *file);
+struct iofile *posixio_file_acquire(int fd);
+void posixio_file_hold(struct iofile *file);
+int posixio_file_release(struct iofile *file);
+struct iodev *posixio_getdev(const char *name);
+struct iodev *posixio_getdev_n(const char *name, size_t len);
 void posixio_fdlock(void);
 void posixio_fdunlock(void);
+int posixio_poll_claim(void);
+void posixio_poll_arm(int slot);
+int posixio_poll_wait(int slot, TickType_t timeout);
+void posixio_poll_release(int slot);
+void posixio_poll_wake(void);
+void posixio_poll_wake_from_isr(BaseType_t *wakeup);
+void posixio_aio_complete(struct aiocb *cb, ssize_t ret, int err, BaseType_t *wakeup);
+
+#if POSIXIO_STATS
+#include <stm32/dwt.h>
+/// Timestamp to pass to posixio_stat_call().
+#define posixio_stat_now() dwt_cycles()
+void posixio_stat_call(struct iofile *file, uint32_t start, ssize_t ret, int data);
+void posixio_stat_wait(struct iofile *file, uint32_t cycles);
+#else
+#define posixio_stat_now() 0
+#define posixio_stat_call(file, start, ret, data) ((void)(start))
+#define posixio_stat_wait(file, cycles) ((void)(cycles))
+#endif
 #endif  /* POSIXIO_PRIVATE */
 
 #endif  /* POSIXIO_H */
@@ -11,7 +11,11 @@
 
 #include <config.h>
 #include <task.h>
+#include <semphr.h>
+#include <errno.h>
+#include <string.h>
 #include <stm32/dma.h>
+#include <stm32/dwt.h>
 
 
 const dma_ch_t dma_streams[DMA_STREAMS] = {
@@ -35,47 +39,821 @@ const dma_ch_t dma_streams[DMA_STREAMS] = {
 #endif
 };
 
-#ifndef STM32F10X_CL
-uint8_t dma2_ch4 = 0, dma2_ch5 = 0;
+/* The CMSIS header only has this for the HD, HD_VL and CL parts */
+#ifndef RCC_AHBENR_DMA2EN
+#define RCC_AHBENR_DMA2EN ((uint32_t)0x0002)
 #endif
 
+/* The channel each peripheral request is wired to, as an index into
+ * dma_streams; -1 for memory to memory, which can use any. */
+static const int8_t dma_request_map[DMA_REQ_COUNT] = {
+    [DMA_REQ_MEM]       = -1,
+    [DMA_REQ_ADC1]      = 0,
+    [DMA_REQ_ADC3]      = 11,
+    [DMA_REQ_DAC1]      = 9,
+    [DMA_REQ_DAC2]      = 10,
+    [DMA_REQ_I2C1_RX]   = 6,
+    [DMA_REQ_I2C1_TX]   = 5,
+    [DMA_REQ_I2C2_RX]   = 4,
+    [DMA_REQ_I2C2_TX]   = 3,
+    [DMA_REQ_SDIO]      = 10,
+    [DMA_REQ_SPI1_RX]   = 1,
+    [DMA_REQ_SPI1_TX]   = 2,
+    [DMA_REQ_SPI2_RX]   = 3,
+    [DMA_REQ_SPI2_TX]   = 4,
+    [DMA_REQ_SPI3_RX]   = 7,
+    [DMA_REQ_SPI3_TX]   = 8,
+    [DMA_REQ_USART1_RX] = 4,
+    [DMA_REQ_USART1_TX] = 3,
+    [DMA_REQ_USART2_RX] = 5,
+    [DMA_REQ_USART2_TX] = 6,
+    [DMA_REQ_USART3_RX] = 2,
+    [DMA_REQ_USART3_TX] = 1,
+    [DMA_REQ_UART4_RX]  = 9,
+    [DMA_REQ_UART4_TX]  = 11,
+};
+
 static dma_isr_t isr_funcs[DMA_STREAMS];
 static void *isr_params[DMA_STREAMS];
 
+/* Claims on each channel, and the client holding it, if any */
+static dma_client_t *dma_claims[DMA_STREAMS];
+static dma_client_t *volatile dma_owners[DMA_STREAMS];
+/* Shared memory to memory claims, which have no channel until acquired */
+static dma_client_t *dma_mem_claims;
+/* Descriptors queued on each channel; the head is the one running */
+static dma_desc_t *volatile dma_queue_head[DMA_STREAMS];
+static dma_desc_t *dma_queue_tail[DMA_STREAMS];
+
+#if DMA_STATS
+static struct dma_stats dma_stats[DMA_STREAMS];
+/* When each channel's transfer was started, and how many items it had */
+static uint32_t dma_started[DMA_STREAMS];
+static uint16_t dma_started_items[DMA_STREAMS];
+#endif
 
-void
-dma_allocate(const dma_ch_t *ch, uint32_t irq_priority, dma_isr_t func, void *param)
+
+/* A channel nothing has claimed or holds, for memory to memory use.
+ * Call in a critical section. */
+static int
+_dma_unclaimed(void)
+{
+    for (int i = 0; i < DMA_STREAMS; i++)
+        if (dma_claims[i] == NULL && dma_owners[i] == NULL)
+            return i;
+    return -1;
+}
+
+
+/* Can a claim go on this channel alongside those already there? Only if
+ * it and they are all shared. A shared memory claim holding the channel
+ * for a burst is no obstacle; it will be back. Call in a critical
+ * section. */
+static int
+_dma_can_claim(int index, int shared)
+{
+    if (dma_claims[index] == NULL)
+        return 1;
+    if (!shared)
+        return 0;
+    for (dma_client_t *cl = dma_claims[index]; cl != NULL; cl = cl->next)
+        if (!(cl->flags & DMA_CLAIM_SHARED))
+            return 0;
+    /* a shared memory claim holds it for now; it will be back */
+    return 1;
+}
+
+
+/* Hand a channel to a client: install its ISR and priorities. Call in a
+ * critical section. */
+static void
+_dma_take(dma_client_t *client, const dma_ch_t *ch)
 {
-    isr_funcs[ch->index] = func;
-    isr_params[ch->index] = param;
+    dma_owners[ch->index] = client;
+    client->ch = ch;
     dma_disable(ch);
-    ch->ch->CCR = 0;
-    NVIC_SetPriority(ch->vector, irq_priority);
+    ch->ch->CCR = DMA_PL(client->priority);
+    isr_funcs[ch->index] = client->isr;
+    isr_params[ch->index] = client->param;
+    NVIC_SetPriority(ch->vector, client->irq_priority);
     NVIC_EnableIRQ(ch->vector);
+}
+
+
+/* Take a channel back from whoever holds it. Call in a critical section,
+ * or from its ISR. */
+static void
+_dma_give(const dma_ch_t *ch)
+{
+    dma_client_t *client = dma_owners[ch->index];
+
+    dma_disable(ch);
+    ch->ch->CCR = 0;
+    isr_funcs[ch->index] = NULL;
+    isr_params[ch->index] = NULL;
+    dma_owners[ch->index] = NULL;
+    if (dma_request_map[client->request] < 0 && (client->flags & DMA_CLAIM_SHARED))
+        client->ch = NULL;
+
 #ifndef STM32F10X_CL
-    if (ch->ch == DMA2_Channel4) dma2_ch4 = 1;
-    else if (ch->ch == DMA2_Channel5) dma2_ch5 = 1;
+    /* DMA2 channels 4 and 5 share an interrupt */
+    if (ch->vector == DMA2_Channel4_5_IRQn
+            && dma_owners[ch->index == 10 ? 11 : 10] != NULL)
+        return;
+#endif
+    NVIC_DisableIRQ(ch->vector);
+}
+
+
+/* The channel a client could take now, or NULL. Call in a critical
+ * section. */
+static const dma_ch_t *
+_dma_pick(dma_client_t *client)
+{
+    if (client->ch != NULL) {
+        dma_client_t *owner = dma_owners[client->ch->index];
+
+        return (owner == NULL || owner == client) ? client->ch : NULL;
+    }
+
+    int index = _dma_unclaimed();
+
+    return index < 0 ? NULL : &dma_streams[index];
+}
+
+
+/* Register a driver's claim on a DMA channel; see dma_client_t. The
+ * channel is checked against the peripheral request map, and a claim that
+ * would clash with another is refused. An exclusive claim on a channel a
+ * shared memory claim is using waits for that burst to end. Call from a
+ * task. Returns 0, or -1 with errno set to EINVAL for an unknown request
+ * or EBUSY if the channel is taken.
+ */
+int
+dma_claim(dma_client_t *client)
+{
+    int shared = client->flags & DMA_CLAIM_SHARED;
+    int index;
+
+    if (client->request >= DMA_REQ_COUNT || client->priority > DMA_PRIO_VERY_HIGH) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#if DMA_STATS
+    dwt_start();
 #endif
+
+    client->ch = NULL;
+    client->waiting = 0;
+    ASSERT((client->freed = xSemaphoreCreateBinary()));
+    index = dma_request_map[client->request];
+
+    taskENTER_CRITICAL();
+    if (index < 0 && shared) {
+        client->next = dma_mem_claims;
+        dma_mem_claims = client;
+        taskEXIT_CRITICAL();
+        RCC->AHBENR |= RCC_AHBENR_DMA1EN | RCC_AHBENR_DMA2EN;
+        return 0;
+    }
+
+    if (index < 0)
+        index = _dma_unclaimed();
+    if (index < 0 || !_dma_can_claim(index, shared)) {
+        taskEXIT_CRITICAL();
+        vSemaphoreDelete(client->freed);
+        client->freed = NULL;
+        errno = EBUSY;
+        return -1;
+    }
+
+    client->ch = &dma_streams[index];
+    client->next = dma_claims[index];
+    dma_claims[index] = client;
+    RCC->AHBENR |= index < 7 ? RCC_AHBENR_DMA1EN : RCC_AHBENR_DMA2EN;
+    /* Being on the claims list keeps memory claims from picking the
+     * channel again, so the one using it now is the last to wait for. */
+    while (!shared && dma_owners[index] != NULL) {
+        client->waiting = 1;
+        taskEXIT_CRITICAL();
+        xSemaphoreTake(client->freed, portMAX_DELAY);
+        taskENTER_CRITICAL();
+    }
+    if (!shared)
+        _dma_take(client, client->ch);
+    taskEXIT_CRITICAL();
+
+    return 0;
 }
 
 
+/* Withdraw a claim, releasing the channel first if the client holds it. */
 void
-dma_release(const dma_ch_t *ch)
+dma_unclaim(dma_client_t *client)
 {
-#ifdef STM32F10X_CL
-    NVIC_DisableIRQ(ch->vector);
-#else
-    if (ch->vector != DMA2_Channel4_5_IRQn) {
-        NVIC_DisableIRQ(ch->vector);
+    dma_release(client);
+
+    taskENTER_CRITICAL();
+    dma_client_t **pp = client->ch != NULL ? &dma_claims[client->ch->index]
+                                           : &dma_mem_claims;
+
+    for (; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == client) {
+            *pp = client->next;
+            break;
+        }
+    }
+    client->ch = NULL;
+    client->next = NULL;
+    taskEXIT_CRITICAL();
+
+    if (client->freed != NULL) {
+        vSemaphoreDelete(client->freed);
+        client->freed = NULL;
+    }
+}
+
+
+/* Wake every task in dma_acquire() that a channel's release may help,
+ * since each may be after a different channel. A waiter is marked in the
+ * same critical section as it finds nothing free, so a release after that
+ * always wakes it. Call in a critical section, or from an ISR. */
+static void
+_dma_wake_waiters(const dma_ch_t *ch, BaseType_t *wakeup)
+{
+    dma_client_t *lists[2] = { dma_claims[ch->index], dma_mem_claims };
+
+    for (int i = 0; i < 2; i++) {
+        for (dma_client_t *cl = lists[i]; cl != NULL; cl = cl->next) {
+            if (!cl->waiting)
+                continue;
+            cl->waiting = 0;
+            xSemaphoreGiveFromISR(cl->freed, wakeup);
+        }
+    }
+}
+
+
+/* Take the claimed channel for a burst, waiting up to timeout for whoever
+ * has it to let go. A shared memory claim gets any channel that nothing
+ * has claimed; client->ch says which. The channel is disabled, with the
+ * client's priority in CCR and its ISR installed. Returns 0, or -1 with
+ * errno set to EBUSY if no channel came free in time.
+ */
+int
+dma_acquire(dma_client_t *client, TickType_t timeout)
+{
+    const dma_ch_t *ch;
+    TimeOut_t start;
+
+    /* discard a wakeup left over from an earlier wait */
+    if (client->freed != NULL)
+        xSemaphoreTake(client->freed, 0);
+
+    vTaskSetTimeOutState(&start);
+    for (;;) {
+        taskENTER_CRITICAL();
+        ch = _dma_pick(client);
+        if (ch != NULL && dma_owners[ch->index] != client)
+            _dma_take(client, ch);
+        client->waiting = ch == NULL;
+        taskEXIT_CRITICAL();
+
+        if (ch != NULL)
+            return 0;
+
+        if (xTaskCheckForTimeOut(&start, &timeout)
+                || !xSemaphoreTake(client->freed, timeout)) {
+            taskENTER_CRITICAL();
+            client->waiting = 0;
+            taskEXIT_CRITICAL();
+            errno = EBUSY;
+            return -1;
+        }
+    }
+}
+
+
+/* Take everything off a channel's queue, for _dma_queue_cancel(). Call in
+ * a critical section, or from its ISR. */
+static dma_desc_t *
+_dma_queue_take(const dma_ch_t *ch)
+{
+    dma_desc_t *queue = dma_queue_head[ch->index];
+
+    dma_queue_head[ch->index] = NULL;
+    dma_queue_tail[ch->index] = NULL;
+    return queue;
+}
+
+
+/* Tell the owners of descriptors taken off a queue that they will not run. */
+static void
+_dma_queue_cancel(dma_desc_t *d, BaseType_t *wakeup)
+{
+    while (d != NULL) {
+        dma_desc_t *next = d->next;
+
+        if (d->last)
+            d->next = NULL;
+        d->queued = 0;
+        if (d->last && d->done != NULL)
+            d->done(d->param, ECANCELED, wakeup);
+        d = next;
+    }
+}
+
+
+/* Stop the client's transfer and hand its channel back, if it holds one.
+ * Anything it had queued is cancelled. */
+void
+dma_release(dma_client_t *client)
+{
+    BaseType_t wakeup = pdFALSE;
+    dma_desc_t *queue = NULL;
+    int held;
+
+    taskENTER_CRITICAL();
+    held = client->ch != NULL && dma_owners[client->ch->index] == client;
+    if (held) {
+        const dma_ch_t *ch = client->ch;
+
+        queue = _dma_queue_take(ch);
+        _dma_give(ch);
+        _dma_wake_waiters(ch, &wakeup);
+    }
+    taskEXIT_CRITICAL();
+
+    if (held)
+        _dma_queue_cancel(queue, &wakeup);
+    if (wakeup)
+        taskYIELD();
+}
+
+
+/* As dma_release(), from an ISR such as the client's own at the end of a
+ * burst. */
+void
+dma_release_from_isr(dma_client_t *client, BaseType_t *wakeup)
+{
+    if (client->ch == NULL || dma_owners[client->ch->index] != client)
+        return;
+
+    const dma_ch_t *ch = client->ch;
+    dma_desc_t *queue = _dma_queue_take(ch);
+
+    _dma_give(ch);
+    _dma_wake_waiters(ch, wakeup);
+    _dma_queue_cancel(queue, wakeup);
+}
+
+
+/* Load a descriptor into its channel and start it. */
+static void
+_dma_desc_start(const dma_ch_t *ch, const dma_desc_t *d)
+{
+    ch->ch->CCR = d->ccr;
+    ch->ch->CPAR = d->cpar;
+    ch->ch->CMAR = d->cmar;
+    ch->ch->CNDTR = d->cndtr;
+    dma_stats_start(ch);
+    ch->ch->CCR = d->ccr | DMA_CCR1_EN;
+}
+
+
+/* A queued transfer has finished: start the next one straight away, so
+ * the bus does not sit idle while anyone is told, and call back if that
+ * was the end of a chain. A failed transfer takes the rest of its chain
+ * with it. */
+static void
+_dma_queue_isr(const dma_ch_t *ch, uint32_t flags)
+{
+    dma_desc_t *first = dma_queue_head[ch->index];
+    dma_desc_t *d = first, *next;
+    BaseType_t wakeup = pdFALSE;
+    int err = (flags & DMA_FLAG_TE) ? EIO : 0;
+
+    if (!(flags & (DMA_FLAG_TC | DMA_FLAG_TE)))
+        return;
+
+    dma_disable(ch);
+    if (err)
+        while (!d->last)
+            d = d->next;
+
+    next = d->next;
+    if (d->last)
+        d->next = NULL;
+    dma_queue_head[ch->index] = next;
+    if (next == NULL)
+        dma_queue_tail[ch->index] = NULL;
+    else
+        _dma_desc_start(ch, next);
+
+    for (dma_desc_t *p = first; p != d; p = p->next)
+        p->queued = 0;
+    d->queued = 0;
+    if (d->last && d->done != NULL) {
+        d->done(d->param, err, &wakeup);
+        portEND_SWITCHING_ISR(wakeup);
+    }
+}
+
+
+/* Queue a chain of transfers on the client's channel, which it must hold.
+ * Each descriptor is started from the DMA interrupt as soon as the one
+ * before it finishes, whichever chain it is in, and the last of the chain
+ * is called back once it is done. The client's ISR is not called for
+ * queued transfers, and it must not touch the channel while any are
+ * queued. Call from a task or an ISR at or below
+ * configMAX_SYSCALL_INTERRUPT_PRIORITY. Returns 0, or -1 with errno set to
+ * EINVAL for an empty chain or transfer, EPERM if the client does not hold
+ * the channel or EBUSY if a descriptor is still queued.
+ */
+int
+dma_submit(dma_client_t *client, dma_desc_t *chain)
+{
+    UBaseType_t mask;
+    dma_desc_t *last = NULL;
+    int index;
+
+    for (dma_desc_t *d = chain; d != NULL; d = d->next) {
+        if (!d->cndtr) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (d->queued) {
+            errno = EBUSY;
+            return -1;
+        }
+        last = d;
+    }
+    if (last == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mask = portSET_INTERRUPT_MASK_FROM_ISR();
+    if (client->ch == NULL || dma_owners[client->ch->index] != client) {
+        portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+        errno = EPERM;
+        return -1;
+    }
+
+    for (dma_desc_t *d = chain; d != NULL; d = d->next) {
+        d->ccr &= ~(DMA_CCR1_EN | DMA_CCR1_HTIE | DMA_CCR1_PL);
+        d->ccr |= dma_client_pl(client) | DMA_CCR1_TCIE | DMA_CCR1_TEIE;
+        d->last = d == last;
+        d->queued = 1;
+    }
+
+    index = client->ch->index;
+    if (dma_queue_tail[index] != NULL) {
+        dma_queue_tail[index]->next = chain;
     } else {
-        if (ch->ch == DMA2_Channel4) dma2_ch4 = 0;
-        else if (ch->ch == DMA2_Channel5) dma2_ch5 = 0;
+        dma_queue_head[index] = chain;
+        _dma_desc_start(client->ch, chain);
+    }
+    dma_queue_tail[index] = last;
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+
+    return 0;
+}
+
+
+/* Stop the client's channel and cancel everything queued on it, calling
+ * back each chain with ECANCELED. The client keeps the channel. */
+void
+dma_flush(dma_client_t *client)
+{
+    BaseType_t wakeup = pdFALSE;
+    dma_desc_t *queue = NULL;
+
+    taskENTER_CRITICAL();
+    if (client->ch != NULL && dma_owners[client->ch->index] == client) {
+        dma_disable(client->ch);
+        queue = _dma_queue_take(client->ch);
+    }
+    taskEXIT_CRITICAL();
+
+    _dma_queue_cancel(queue, &wakeup);
+    if (wakeup)
+        taskYIELD();
+}
+
+
+/* A memory to memory copy or fill in progress. Transfers longer than a
+ * channel can do at once are run as a chain of chunks from the ISR. */
+struct dma_mem {
+    dma_client_t        client;
+    volatile uint8_t    busy;
+    uint8_t             width;      /* bytes per item */
+    uint32_t            ccr;        /* CCR for each chunk */
+    uintptr_t           src;        /* next chunk's source, or &fill */
+    uintptr_t           dst;        /* and destination */
+    uint32_t            items;      /* items still to move */
+    uint32_t            fill;       /* memset's byte, four times over */
+    dma_done_t          done;
+    void                *param;
+};
+
+static struct dma_mem dma_mems[DMA_MEM_ENGINES];
+static uint8_t dma_mem_ready;
+
+/* Copies and fills shorter than this are done by the CPU */
+size_t dma_mem_min_size = DMA_MEM_MIN_SIZE;
+
+
+/* Start the next chunk of a copy or fill. */
+static void
+_dma_mem_next(struct dma_mem *m)
+{
+    DMA_Channel_TypeDef *ch = m->client.ch->ch;
+    uint32_t n = MIN(m->items, DMA_MAX_ITEMS);
+
+    ch->CCR = m->ccr;
+    ch->CMAR = (uint32_t)m->src;
+    ch->CPAR = (uint32_t)m->dst;
+    ch->CNDTR = n;
+
+    m->items -= n;
+    if (m->ccr & DMA_CCR1_MINC)
+        m->src += n * m->width;
+    m->dst += n * m->width;
+
+    dma_stats_start(m->client.ch);
+    ch->CCR = m->ccr | DMA_CCR1_EN;
+}
+
+
+static void
+_dma_mem_isr(void *param, uint32_t flags)
+{
+    struct dma_mem *m = (struct dma_mem *)param;
+    BaseType_t wakeup = pdFALSE;
+
+    if (m->items && !(flags & DMA_FLAG_TE)) {
+        dma_disable(m->client.ch);
+        _dma_mem_next(m);
+        return;
+    }
+
+    dma_done_t done = m->done;
+    void *done_param = m->param;
+
+    dma_release_from_isr(&m->client, &wakeup);
+    m->busy = 0;
+    if (done != NULL)
+        done(done_param, (flags & DMA_FLAG_TE) ? EIO : 0, &wakeup);
+    portEND_SWITCHING_ISR(wakeup);
+}
+
+
+/* Register the memory to memory engines with the DMA broker. Their
+ * claims are shared, so channels are only held while a copy runs. Call
+ * once at startup, before anything uses dma_memcpy_async() or
+ * dma_memset_async(); until then they leave the work to the CPU.
+ */
+void
+dma_mem_init(void)
+{
+    if (dma_mem_ready)
+        return;
+
+    for (int i = 0; i < DMA_MEM_ENGINES; i++) {
+        dma_client_t *cl = &dma_mems[i].client;
+
+        cl->name = "memcpy";
+        cl->request = DMA_REQ_MEM;
+        cl->priority = DMA_PRIO_MEM;
+        cl->flags = DMA_CLAIM_SHARED;
+        cl->irq_priority = IRQ_PRIO_DMA_MEM;
+        cl->isr = _dma_mem_isr;
+        cl->param = &dma_mems[i];
+        ASSERT(!dma_claim(cl));
+    }
+    dma_mem_ready = 1;
+}
+
 
-        if (!dma2_ch4 && !dma2_ch5)
-            NVIC_DisableIRQ(ch->vector);
+/* Find an idle engine and a channel for it, or return NULL if either is
+ * short or dma_mem_init() has not been called. */
+static struct dma_mem *
+_dma_mem_get(void)
+{
+    struct dma_mem *m = NULL;
+
+    if (!dma_mem_ready)
+        return NULL;
+
+    taskENTER_CRITICAL();
+    for (int i = 0; i < DMA_MEM_ENGINES; i++) {
+        if (!dma_mems[i].busy) {
+            m = &dma_mems[i];
+            m->busy = 1;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL();
+
+    if (m != NULL && dma_acquire(&m->client, 0)) {
+        m->busy = 0;
+        m = NULL;
     }
+    return m;
+}
+
+
+/* Set an engine going on a transfer of len bytes, width at a time. */
+static void
+_dma_mem_start(struct dma_mem *m, uintptr_t dst, uintptr_t src, size_t len,
+               uint8_t width, uint32_t minc, dma_done_t done, void *param)
+{
+    static const uint32_t sizes[] = {
+        [1] = 0,
+        [2] = DMA_CCR1_PSIZE_0 | DMA_CCR1_MSIZE_0,
+        [4] = DMA_CCR1_PSIZE_1 | DMA_CCR1_MSIZE_1,
+    };
+
+    /* the source is the "memory" side, the destination the "peripheral" */
+    m->ccr = dma_client_pl(&m->client)
+             | DMA_CCR1_MEM2MEM
+             | DMA_CCR1_DIR
+             | DMA_CCR1_PINC
+             | minc
+             | sizes[width]
+             | DMA_CCR1_TCIE
+             | DMA_CCR1_TEIE;
+    m->width = width;
+    m->src = src;
+    m->dst = dst;
+    m->items = len / width;
+    m->done = done;
+    m->param = param;
+
+    taskENTER_CRITICAL();
+    _dma_mem_next(m);
+    taskEXIT_CRITICAL();
+}
+
+
+/* Widest item size both addresses are aligned to. */
+static uint8_t
+_dma_mem_width(uintptr_t a)
+{
+    return !(a & 3) ? 4 : !(a & 1) ? 2 : 1;
+}
+
+
+/* Copy len bytes from src to dst with a DMA channel, and call done from its
+ * interrupt when they are there. The buffers must not overlap, and must be
+ * left alone until then. Items are words or half-words when both addresses
+ * allow; any odd bytes at the end are copied by the CPU first. Copies
+ * shorter than dma_mem_min_size, or made while no channel is free, are done
+ * by the CPU before returning, and done is called from here. Returns 0 if
+ * the DMA is doing the copy, or 1 if the CPU has done it.
+ */
+int
+dma_memcpy_async(void *dst, const void *src, size_t len,
+                 dma_done_t done, void *param)
+{
+    struct dma_mem *m = NULL;
+
+    if (len >= dma_mem_min_size && len >= 4)
+        m = _dma_mem_get();
+
+    if (m == NULL) {
+        BaseType_t wakeup = pdFALSE;
+
+        memcpy(dst, src, len);
+        if (done != NULL)
+            done(param, 0, &wakeup);
+        return 1;
+    }
+
+    uint8_t width = _dma_mem_width((uintptr_t)dst | (uintptr_t)src);
+    size_t body = len & ~(size_t)(width - 1);
+
+    memcpy((uint8_t *)dst + body, (const uint8_t *)src + body, len - body);
+    _dma_mem_start(m, (uintptr_t)dst, (uintptr_t)src, body, width,
+                   DMA_CCR1_MINC, done, param);
+    return 0;
+}
+
+
+/* Fill len bytes at dst with the byte c using a DMA channel, as for
+ * dma_memcpy_async(). The channel reads c over and over from a word of
+ * its own, so dst can be written a word at a time when aligned. */
+int
+dma_memset_async(void *dst, int c, size_t len, dma_done_t done, void *param)
+{
+    struct dma_mem *m = NULL;
+
+    if (len >= dma_mem_min_size && len >= 4)
+        m = _dma_mem_get();
+
+    if (m == NULL) {
+        BaseType_t wakeup = pdFALSE;
+
+        memset(dst, c, len);
+        if (done != NULL)
+            done(param, 0, &wakeup);
+        return 1;
+    }
+
+    uint8_t width = _dma_mem_width((uintptr_t)dst);
+    size_t body = len & ~(size_t)(width - 1);
+
+    memset((uint8_t *)dst + body, c, len - body);
+    m->fill = (uint8_t)c * 0x01010101UL;
+    _dma_mem_start(m, (uintptr_t)dst, (uintptr_t)&m->fill, body, width,
+                   0, done, param);
+    return 0;
+}
+
+
+#if DMA_STATS
+/* Note that a transfer is starting on a channel, for its busy time. Called
+ * by dma_enable(), just before the channel is enabled. */
+void
+dma_stats_start(const dma_ch_t *chn)
+{
+    dma_started[chn->index] = dwt_cycles();
+    dma_started_items[chn->index] = chn->ch->CNDTR;
+}
+
+
+/* Count a transfer that has ended, or for a circular one wrapped, with
+ * these interrupt flags. */
+static inline void
+_dma_stats_end(const dma_ch_t *ch, uint32_t flags, uint32_t now)
+{
+    struct dma_stats *st = &dma_stats[ch->index];
+    uint16_t left = (flags & DMA_FLAG_TE) ? ch->ch->CNDTR : 0;
+
+    st->busy += now - dma_started[ch->index];
+    st->items += dma_started_items[ch->index] - left;
+    if (flags & DMA_FLAG_TE)
+        st->errors++;
+    else
+        st->transfers++;
+    dma_started[ch->index] = now;
+}
 #endif
-    dma_disable(ch);
+
+
+/* Copy a channel's counts. Returns 0, or -1 with errno set to EINVAL if
+ * there is no such channel. The counts are all zero without DMA_STATS. */
+int
+dma_get_stats(int index, struct dma_stats *stats)
+{
+    if (index < 0 || index >= DMA_STREAMS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#if DMA_STATS
+    taskENTER_CRITICAL();
+    *stats = dma_stats[index];
+    taskEXIT_CRITICAL();
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+    return 0;
+}
+
+
+/* Zero every channel's counts. */
+void
+dma_clear_stats(void)
+{
+#if DMA_STATS
+    taskENTER_CRITICAL();
+    memset(dma_stats, 0, sizeof(dma_stats));
+    taskEXIT_CRITICAL();
+#endif
+}
+
+
+/* The name of whoever holds a channel, or else of its first claim, or NULL
+ * if it is free. */
+const char *
+dma_channel_owner(int index)
+{
+    const char *name = NULL;
+
+    if (index < 0 || index >= DMA_STREAMS)
+        return NULL;
+
+    taskENTER_CRITICAL();
+    if (dma_owners[index] != NULL)
+        name = dma_owners[index]->name;
+    else if (dma_claims[index] != NULL)
+        name = dma_claims[index]->name;
+    taskEXIT_CRITICAL();
+
+    return name;
 }
 
 
@@ -83,11 +861,28 @@ static inline void
 dma_service_irq(DMA_TypeDef *dma, const dma_ch_t *ch)
 {
     uint32_t flags;
+#if DMA_STATS
+    uint32_t t0 = dwt_cycles(), t;
+#endif
 
     flags = (dma->ISR >> ch->ishift) & 0xF;
     dma->IFCR = 0xF << ch->ishift;
-    if (isr_funcs[ch->index])
+#if DMA_STATS
+    dma_stats[ch->index].irqs++;
+    if (flags & (DMA_FLAG_TC | DMA_FLAG_TE))
+        _dma_stats_end(ch, flags, t0);
+#endif
+
+    if (dma_queue_head[ch->index] != NULL)
+        _dma_queue_isr(ch, flags);
+    else if (isr_funcs[ch->index])
         isr_funcs[ch->index](isr_params[ch->index], flags);
+
+#if DMA_STATS
+    t = dwt_cycles() - t0;
+    if (t > dma_stats[ch->index].isr_max)
+        dma_stats[ch->index].isr_max = t;
+#endif
 }
 
 
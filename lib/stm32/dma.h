@@ -1,4 +1,4 @@
-/** RTOS-friendly STM32 Ethernet peripheral driver.
+/** RTOS-friendly STM32 DMA peripheral driver.
  * \file
  *
  * \author Michael Tharp <gxti@partiallystapled.com>
@@ -13,6 +13,7 @@
 #define _DMA_H
 
 #include <config.h>
+#include <semphr.h>
 
 
 typedef struct {
@@ -25,13 +26,175 @@ typedef struct {
 
 typedef void (*dma_isr_t)(void *param, uint32_t flags);
 
+/* Completion callback for asynchronous DMA-driven driver calls. Runs in
+ * interrupt context; err is 0 or an errno value. */
+typedef void (*dma_done_t)(void *param, int err, BaseType_t *wakeup);
+
+#ifndef DMA_STATS
+/* count transfers, busy time and errors per channel, for the dma command */
+#define DMA_STATS   1
+#endif
+
+/* Per-channel activity counts, kept if DMA_STATS is set. Busy time runs
+ * from a transfer being started with dma_enable() or dma_submit() to its
+ * TC or TE interrupt, so only transfers with one of those enabled are
+ * counted; a circular transfer is busy for as long as it runs. */
+struct dma_stats {
+    uint32_t    transfers;  /* transfers completed */
+    uint32_t    items;      /* items they moved */
+    uint64_t    busy;       /* CPU cycles spent running them */
+    uint32_t    errors;     /* transfers ended by a transfer error */
+    uint32_t    irqs;       /* interrupts taken */
+    uint32_t    isr_max;    /* most CPU cycles one of them took */
+};
+
+/* Bits of the flags passed to a dma_isr_t */
+#define DMA_FLAG_GI     0x1
+#define DMA_FLAG_TC     0x2
+#define DMA_FLAG_HT     0x4
+#define DMA_FLAG_TE     0x8
+
+
+/* DMA requests a client can claim a channel for. Each peripheral request
+ * is wired to one channel; memory to memory transfers can use any. */
+enum dma_request {
+    DMA_REQ_MEM,
+    DMA_REQ_ADC1,
+    DMA_REQ_ADC3,
+    DMA_REQ_DAC1,
+    DMA_REQ_DAC2,
+    DMA_REQ_I2C1_RX,
+    DMA_REQ_I2C1_TX,
+    DMA_REQ_I2C2_RX,
+    DMA_REQ_I2C2_TX,
+    DMA_REQ_SDIO,
+    DMA_REQ_SPI1_RX,
+    DMA_REQ_SPI1_TX,
+    DMA_REQ_SPI2_RX,
+    DMA_REQ_SPI2_TX,
+    DMA_REQ_SPI3_RX,
+    DMA_REQ_SPI3_TX,
+    DMA_REQ_USART1_RX,
+    DMA_REQ_USART1_TX,
+    DMA_REQ_USART2_RX,
+    DMA_REQ_USART2_TX,
+    DMA_REQ_USART3_RX,
+    DMA_REQ_USART3_TX,
+    DMA_REQ_UART4_RX,
+    DMA_REQ_UART4_TX,
+    DMA_REQ_COUNT
+};
+
+/* Channel priorities, for the CCR PL field */
+#define DMA_PRIO_LOW        0
+#define DMA_PRIO_MEDIUM     1
+#define DMA_PRIO_HIGH       2
+#define DMA_PRIO_VERY_HIGH  3
+
+/* dma_claim() flags */
+#define DMA_CLAIM_SHARED    0x1     /* others may claim the channel too */
+
+/* A driver's claim on a DMA channel. The driver fills in the first part
+ * and passes it to dma_claim(); it must stay in place until dma_unclaim().
+ *
+ * An exclusive claim holds its channel from dma_claim() on, and nothing
+ * else may claim it. A shared claim only reserves the right to use the
+ * channel: the client takes it with dma_acquire() for each burst and hands
+ * it back with dma_release(), and its ISR is only installed in between.
+ * A shared claim for DMA_REQ_MEM has no channel of its own and is given
+ * any unclaimed one by dma_acquire().
+ */
+typedef struct dma_client {
+    const char          *name;
+    uint8_t             request;        /* one of enum dma_request */
+    uint8_t             priority;       /* DMA_PRIO_ */
+    uint8_t             flags;          /* DMA_CLAIM_ */
+    uint8_t             irq_priority;
+    dma_isr_t           isr;
+    void                *param;
+
+    /* the channel, while claimed for a peripheral or held */
+    const dma_ch_t      *ch;
+    struct dma_client   *next;
+    /* given when a channel is released while the client waits for it, in
+     * dma_acquire() or in dma_claim() for a channel in use */
+    SemaphoreHandle_t   freed;
+    volatile uint8_t    waiting;
+} dma_client_t;
+
+/* The PL bits for a client's CCR; drivers that write CCR whole include
+ * these so the broker's priority sticks */
+#define DMA_PL(prio)        ((uint32_t)(prio) << 12)
+#define dma_client_pl(cl)   DMA_PL((cl)->priority)
+
+
+/* One transfer in a channel's queue; see dma_submit(). The caller fills in
+ * the register values and links the descriptors of a chain through next,
+ * and must leave them alone while queued is set. TCIE, TEIE and the
+ * client's PL are added to ccr; EN must not be set. done and param are only
+ * used on the last descriptor of a chain, which is called back when the
+ * whole chain has run, or failed. */
+typedef struct dma_desc {
+    uint32_t            ccr;
+    uint32_t            cpar;
+    uint32_t            cmar;
+    uint16_t            cndtr;
+    uint8_t             last;           /* set by dma_submit() */
+    volatile uint8_t    queued;
+    dma_done_t          done;
+    void                *param;
+    struct dma_desc     *next;
+} dma_desc_t;
+
+
+/* Memory to memory copies and fills: how many may run at once, the
+ * priority their channels run at, and the size below which the CPU does
+ * the work instead, since setting up the DMA costs more. */
+#ifndef DMA_MEM_ENGINES
+#define DMA_MEM_ENGINES     2
+#endif
+#ifndef DMA_PRIO_MEM
+#define DMA_PRIO_MEM        0
+#endif
+#ifndef IRQ_PRIO_DMA_MEM
+#define IRQ_PRIO_DMA_MEM    12
+#endif
+#ifndef DMA_MEM_MIN_SIZE
+#define DMA_MEM_MIN_SIZE    128
+#endif
+
+/* Most items one channel moves in a transfer */
+#define DMA_MAX_ITEMS   65535
+
 
 #define DMA_STREAMS     12
 extern const dma_ch_t dma_streams[DMA_STREAMS];
+extern size_t dma_mem_min_size;
 
-void dma_allocate(const dma_ch_t *ch, uint32_t irq_priority, dma_isr_t func, void *param);
-void dma_release(const dma_ch_t *ch);
-#define dma_enable(chn) { (chn)->ch->CCR |= DMA_CCR1_EN; }
+int dma_claim(dma_client_t *client);
+void dma_unclaim(dma_client_t *client);
+int dma_acquire(dma_client_t *client, TickType_t timeout);
+void dma_release(dma_client_t *client);
+void dma_release_from_isr(dma_client_t *client, BaseType_t *wakeup);
+int dma_submit(dma_client_t *client, dma_desc_t *chain);
+void dma_flush(dma_client_t *client);
+int dma_get_stats(int index, struct dma_stats *stats);
+void dma_clear_stats(void);
+const char *dma_channel_owner(int index);
+#if DMA_STATS
+void dma_stats_start(const dma_ch_t *chn);
+#else
+#define dma_stats_start(chn) ((void)0)
+#endif
+void dma_mem_init(void);
+int dma_memcpy_async(void *dst, const void *src, size_t len,
+                     dma_done_t done, void *param);
+int dma_memset_async(void *dst, int c, size_t len,
+                     dma_done_t done, void *param);
+#define dma_enable(chn) { \
+        dma_stats_start(chn); \
+        (chn)->ch->CCR |= DMA_CCR1_EN; \
+}
 #define dma_disable(chn) { \
         (chn)->ch->CCR &= ~DMA_CCR1_EN; \
         *(chn)->ifcr = 0xF << (chn)->ishift; \
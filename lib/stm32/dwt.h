@@ -0,0 +1,38 @@
+/** STM32 (Cortex-M3) DWT cycle counter.
+ * \file
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef _DWT_H
+#define _DWT_H
+
+#include <config.h>
+
+// Our CMSIS core header predates the DWT register definitions.
+#define DWT_CTRL            (*(volatile uint32_t *)0xE0001000)
+#define DWT_CYCCNT          (*(volatile uint32_t *)0xE0001004)
+#define DWT_CTRL_CYCCNTENA  0x00000001
+
+/** Start the free-running CPU cycle counter. Safe to call more than once. */
+static inline void
+dwt_start(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+}
+
+/** Read the CPU cycle counter. It wraps every 2^32 cycles. */
+#define dwt_cycles() (DWT_CYCCNT)
+
+/** Convert a count of CPU cycles to microseconds. */
+#define dwt_cycles_to_us(c) ((c) / (SystemCoreClock / 1000000))
+
+#endif
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -422,6 +422,21 @@ mac_read_rx_descriptor(mac_desc_t *rdes, uint8_t *buf, uint16_t size)
 }
 
 
+/* Lend out the unread part of a received frame in place, instead of copying
+ * it as mac_read_rx_descriptor() does. The data stays valid until the
+ * descriptor is released back to the MAC.
+ */
+uint16_t
+mac_borrow_rx_descriptor(mac_desc_t *rdes, const uint8_t **buf)
+{
+    uint16_t size = rdes->size - rdes->offset;
+
+    *buf = rdes->des_buf + rdes->offset;
+    rdes->offset = rdes->size;
+    return size;
+}
+
+
 void
 mac_release_rx_descriptor(mac_desc_t *rdes)
 {
@@ -40,6 +40,7 @@ uint16_t mac_write_tx_descriptor(mac_desc_t *tdes, const uint8_t *buf, uint16_t
 void mac_release_tx_descriptor(mac_desc_t *tdes);
 mac_desc_t *mac_get_rx_descriptor(void);
 uint16_t mac_read_rx_descriptor(mac_desc_t *rdes, uint8_t *buf, uint16_t size);
+uint16_t mac_borrow_rx_descriptor(mac_desc_t *rdes, const uint8_t **buf);
 void mac_release_rx_descriptor(mac_desc_t *rdes);
 
 #define STM32_RDES0_OWN             0x80000000
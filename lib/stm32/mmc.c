@@ -20,6 +20,52 @@ mmc_state_t mmc_state;
 
 static uint8_t mmc_block_mode;
 
+/* The card, selected by the bus's own chip select */
+static spi_dev_t mmc_dev;
+
+
+/* One step of a command: exchange size bytes with the card selected. It is
+ * left selected, holding the bus against other devices, unless this is the
+ * last step.
+ */
+static void
+mmc_ll_exchange(const uint8_t *tx_buf, uint8_t *rx_buf, uint16_t size, int last)
+{
+    spi_xfer_t x = {
+        .dev    = &mmc_dev,
+        .tx_buf = tx_buf,
+        .rx_buf = rx_buf,
+        .size   = size,
+        .flags  = last ? 0 : SPI_XFER_KEEP_CS,
+    };
+
+    spi_transact(MMCSPI, &x);
+}
+
+
+/* End a command whose last step could not be known in advance: clock one
+ * more byte and deselect the card. */
+static void
+mmc_ll_deselect(void)
+{
+    mmc_ll_exchange(NULL, NULL, 1, 1);
+}
+
+
+/* Switch the bus between the slow clock the card is identified at and full
+ * speed. The card is held selected meanwhile, so no other device's
+ * transfer is running or can start while CR1 changes; it ignores the 0xFF
+ * it is sent.
+ */
+static void
+mmc_ll_set_slow(int slow)
+{
+    mmc_ll_exchange(NULL, NULL, 1, 0);
+    MMCSPI->spi->CR1 &= ~(SPI_CR1_SPE | SPI_CR1_BR_2 | SPI_CR1_BR_1);
+    MMCSPI->spi->CR1 |= SPI_CR1_SPE | (slow ? SPI_CR1_BR_2 | SPI_CR1_BR_1 : 0);
+    mmc_ll_deselect();
+}
+
 
 static void
 mmc_ll_wait_idle(void)
@@ -29,13 +75,13 @@ mmc_ll_wait_idle(void)
     TickType_t start;
 
     for (i = 0; i < 16; i++) {
-        spi_exchange(MMCSPI, NULL, &result, 1);
+        mmc_ll_exchange(NULL, &result, 1, 0);
         if (result == 0xFF)
             return;
     }
     start = xTaskGetTickCount();
     while (1) {
-        spi_exchange(MMCSPI, NULL, &result, 1);
+        mmc_ll_exchange(NULL, &result, 1, 0);
         if (result == 0xFF)
             return;
         if (xTaskGetTickCount() - start > MMC_IDLE_DEADLINE)
@@ -59,7 +105,7 @@ mmc_ll_send_header(uint8_t cmd, uint32_t arg)
     crc = crc7_init();
     crc = crc7_update(crc, buf, 5);
     buf[5] = (crc7_finalize(crc) << 1) | 0x01;
-    spi_exchange(MMCSPI, buf, NULL, 6);
+    mmc_ll_exchange(buf, NULL, 6, 0);
 }
 
 
@@ -70,7 +116,7 @@ mmc_ll_receive_r1(void)
     uint8_t r;
 
     for (i = 0; i < 9; i++) {
-        spi_exchange(MMCSPI, NULL, &r, 1);
+        mmc_ll_exchange(NULL, &r, 1, 0);
         if (r != 0xFF)
             return r;
     }
@@ -83,12 +129,11 @@ mmc_cmd_r1(uint8_t cmd, uint32_t arg)
 {
     uint8_t ret;
 
-    spi_select(MMCSPI);
     if (cmd != MMC_CMDGOIDLE)
         mmc_ll_wait_idle();
     mmc_ll_send_header(cmd, arg);
     ret = mmc_ll_receive_r1();
-    spi_deselect(MMCSPI);
+    mmc_ll_deselect();
     return ret;
 }
 
@@ -98,12 +143,10 @@ mmc_cmd_r3(uint8_t cmd, uint32_t arg, uint8_t *buf)
 {
     uint8_t ret;
 
-    spi_select(MMCSPI);
     mmc_ll_wait_idle();
     mmc_ll_send_header(cmd, arg);
     ret = mmc_ll_receive_r1();
-    spi_exchange(MMCSPI, NULL, buf, 4);
-    spi_deselect(MMCSPI);
+    mmc_ll_exchange(NULL, buf, 4, 1);
     return ret;
 }
 
@@ -113,6 +156,9 @@ mmc_start(void)
 {
     mmc_state = MMC_UNLOADED;
     mmc_block_mode = 0;
+    mmc_dev.name = "mmc";
+    mmc_dev.cs_pad = MMCSPI->cs_pad;
+    mmc_dev.cs_pin = MMCSPI->cs_pin;
 }
 
 
@@ -122,10 +168,9 @@ mmc_connect(void)
     TickType_t start;
     uint8_t n, buf[4];
 
-    /* Run SPI in slow mode and clear the bus by clocking a few bytes */
-    spi_deselect(MMCSPI);
-    MMCSPI->spi->CR1 &= ~SPI_CR1_SPE;
-    MMCSPI->spi->CR1 |= SPI_CR1_SPE | SPI_CR1_BR_2 | SPI_CR1_BR_1;
+    /* Run SPI in slow mode and clear the bus by clocking a few bytes with
+     * the card deselected */
+    mmc_ll_set_slow(1);
     spi_exchange(MMCSPI, NULL, NULL, 16);
 
     /* Select SPI mode */
@@ -178,8 +223,7 @@ mmc_connect(void)
     }
 
     /* Full speed */
-    MMCSPI->spi->CR1 &= ~(SPI_CR1_SPE | SPI_CR1_BR_2 | SPI_CR1_BR_1);
-    MMCSPI->spi->CR1 |= SPI_CR1_SPE;
+    mmc_ll_set_slow(0);
 
     /* Check block size */
     if (mmc_cmd_r1(MMC_CMDSETBLOCKLEN, 512) != 0) {
@@ -210,9 +254,8 @@ mmc_disconnect(void)
 void
 mmc_sync(void)
 {
-    spi_select(MMCSPI);
     mmc_ll_wait_idle();
-    spi_deselect(MMCSPI);
+    mmc_ll_deselect();
 }
 
 
@@ -223,7 +266,6 @@ mmc_start_read(uint32_t lba)
         return EERR_INVALID;
     mmc_state = MMC_READING;
 
-    spi_select(MMCSPI);
     mmc_ll_wait_idle();
     if (mmc_block_mode != 0)
         mmc_ll_send_header(MMC_CMDREADMULTIPLE, lba);
@@ -231,7 +273,7 @@ mmc_start_read(uint32_t lba)
         mmc_ll_send_header(MMC_CMDREADMULTIPLE, lba * 512);
     uint8_t rc = mmc_ll_receive_r1();
     if (rc != 0x00) {
-        spi_deselect(MMCSPI);
+        mmc_ll_deselect();
         mmc_state = MMC_READY;
         return EERR_FAULT;
     }
@@ -249,10 +291,10 @@ mmc_read_sector(uint8_t *out)
         return EERR_INVALID;
     start = xTaskGetTickCount();
     while (1) {
-        spi_exchange(MMCSPI, NULL, &r, 1);
+        mmc_ll_exchange(NULL, &r, 1, 0);
         if (r == 0xFE) {
-            spi_exchange(MMCSPI, NULL, out, 512);
-            spi_exchange(MMCSPI, NULL, NULL, 2);
+            mmc_ll_exchange(NULL, out, 512, 0);
+            mmc_ll_exchange(NULL, NULL, 2, 0);
             /* TODO: check CRC */
             return EERR_OK;
         }
@@ -260,7 +302,7 @@ mmc_read_sector(uint8_t *out)
             break;
     }
 
-    spi_deselect(MMCSPI);
+    mmc_ll_deselect();
     if (mmc_state == MMC_READING)
         mmc_state = MMC_READY;
     return EERR_TIMEOUT;
@@ -274,9 +316,9 @@ mmc_stop_read(void)
 
     if (mmc_state != MMC_READING)
         return EERR_INVALID;
-    spi_exchange(MMCSPI, stop_cmd, NULL, sizeof(stop_cmd));
+    mmc_ll_exchange(stop_cmd, NULL, sizeof(stop_cmd), 0);
     mmc_ll_receive_r1();
-    spi_deselect(MMCSPI);
+    mmc_ll_deselect();
     mmc_state = MMC_READY;
     return EERR_OK;
 }
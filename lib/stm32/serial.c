@@ -19,6 +19,20 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stm32/serial.h>
+#include <stm32f10x_rcc.h>
+#include <posixio/posixio.h>
+#include <misc/fmt.h>
+#if SERIAL_STATS
+#include <stm32/dwt.h>
+#endif
+
+/* The CMSIS header only has these for the HD and CL parts */
+#ifndef RCC_APB1ENR_UART4EN
+#define RCC_APB1ENR_UART4EN ((uint32_t)0x00080000)
+#endif
+#ifndef RCC_APB1ENR_UART5EN
+#define RCC_APB1ENR_UART5EN ((uint32_t)0x00100000)
+#endif
 
 #if USE_SERIAL_USART1
 serial_t Serial1;
@@ -36,34 +50,72 @@ serial_t Serial4;
 serial_t Serial5;
 #endif
 
-#define _serial_putc(serial, val_ptr, timeout) \
-    do { xQueueSend(serial->tx_q, val_ptr, timeout); \
-         serial->usart->CR1 |= USART_CR1_TXEIE; } while (0)
+static void usart_tcie(void *param, uint32_t flags);
+#if USE_SERIAL_RX_DMA
+static void usart_rx_dma(void *param, uint32_t flags);
+static void _serial_rx_dma_arm(serial_t *serial);
+static void _serial_rx_dma_start(serial_t *serial);
+#endif
 
 
-static void usart_tcie(void *param, uint32_t flags);
+/* Claim one of the port's DMA channels from the broker. If another driver
+ * has it, the port makes do with interrupts in that direction.
+ */
+static const dma_ch_t *
+_serial_dma_claim(serial_t *serial, dma_client_t *claim, int request,
+                  dma_isr_t isr)
+{
+    if (request < 0)
+        return NULL;
+
+    claim->name = "serial";
+    claim->request = request;
+    claim->priority = DMA_PRIO_USART;
+    claim->flags = 0;
+    claim->irq_priority = IRQ_PRIO_USART;
+    claim->isr = isr;
+    claim->param = serial;
+    if (dma_claim(claim))
+        return NULL;
+
+    return claim->ch;
+}
 
 
 void
-serial_start(serial_t *serial, int speed
+serial_start(serial_t *serial, int speed, unsigned int flow
 #if configUSE_QUEUE_SETS
              , QueueSetHandle_t queue_set
 #endif
              )
 {
     IRQn_Type irqn = 0;
+    int tx_req = -1;
+#if USE_SERIAL_RX_DMA
+    int rx_req = -1;
+#endif
 
-    ASSERT((serial->rx_q = xQueueCreate(SERIAL_RX_SIZE, 1)));
+    serial->rx_head = serial->rx_tail = 0;
+    memset((void *)&serial->errors, 0, sizeof(serial->errors));
+#if SERIAL_STATS
+    memset((void *)&serial->stats, 0, sizeof(serial->stats));
+    dwt_start();
+#endif
+    ASSERT((serial->rx_sem = xSemaphoreCreateBinary()));
     ASSERT((serial->mutex = xSemaphoreCreateMutex()));
 #if configUSE_QUEUE_SETS
     if (queue_set)
         /* Must be added to set while it's still empty */
-        xQueueAddToSet(serial->rx_q, queue_set);
+        xQueueAddToSet(serial->rx_sem, queue_set);
 
 #endif
 
     serial->speed = speed;
+    serial->flow = flow;
+    serial->rts_gpio = NULL;
+    serial->rts_off = 0;
     serial->tx_dma = NULL;
+    serial->rx_dma = serial->rx_dma_ch = NULL;
 
     // we alter GPIO settings which *might* be worked on
     // elsewhere, so disable interrupts
@@ -82,21 +134,45 @@ serial_start(serial_t *serial, int speed
         gpioa_crh |= GPIO_CRH_MODE9_0 | GPIO_CRH_MODE9_1 | GPIO_CRH_CNF9_1;
         gpioa_crh &= ~(GPIO_CRH_MODE10 | GPIO_CRH_CNF10);
         gpioa_crh |= GPIO_CRH_CNF10_0;
+        if (flow & SERIAL_FLOW_RTSCTS) {
+            /* CTS on PA11, RTS on PA12 */
+            gpioa_crh &= ~(GPIO_CRH_MODE11 | GPIO_CRH_CNF11);
+            gpioa_crh |= GPIO_CRH_CNF11_0;
+            gpioa_crh &= ~(GPIO_CRH_MODE12 | GPIO_CRH_CNF12);
+            gpioa_crh |= GPIO_CRH_MODE12_0 | GPIO_CRH_MODE12_1 | GPIO_CRH_CNF12_1;
+            serial->rts_gpio = GPIOA;
+            serial->rts_pin = 12;
+        }
         irqn = USART1_IRQn;
         serial->usart = USART1;
-        serial->tx_dma = &dma_streams[3];
+        tx_req = DMA_REQ_USART1_TX;
+#if USE_SERIAL_RX_DMA
+        rx_req = DMA_REQ_USART1_RX;
+#endif
     } else
 #endif
 #if USE_SERIAL_USART2
     if (serial == &Serial2) {
         RCC->APB1ENR |= RCC_APB1ENR_USART2EN;
-        gpioa_crl &= ~(GPIO_CRH_MODE2 | GPIO_CRH_CNF2);
-        gpioa_crl |= GPIO_CRH_MODE2_0 | GPIO_CRH_MODE2_1 | GPIO_CRH_CNF2_1;
-        gpioa_crl &= ~(GPIO_CRH_MODE3 | GPIO_CRH_CNF3);
-        gpioa_crl |= GPIO_CRH_CNF3_0;
+        gpioa_crl &= ~(GPIO_CRL_MODE2 | GPIO_CRL_CNF2);
+        gpioa_crl |= GPIO_CRL_MODE2_0 | GPIO_CRL_MODE2_1 | GPIO_CRL_CNF2_1;
+        gpioa_crl &= ~(GPIO_CRL_MODE3 | GPIO_CRL_CNF3);
+        gpioa_crl |= GPIO_CRL_CNF3_0;
+        if (flow & SERIAL_FLOW_RTSCTS) {
+            /* CTS on PA0, RTS on PA1 */
+            gpioa_crl &= ~(GPIO_CRL_MODE0 | GPIO_CRL_CNF0);
+            gpioa_crl |= GPIO_CRL_CNF0_0;
+            gpioa_crl &= ~(GPIO_CRL_MODE1 | GPIO_CRL_CNF1);
+            gpioa_crl |= GPIO_CRL_MODE1_0 | GPIO_CRL_MODE1_1 | GPIO_CRL_CNF1_1;
+            serial->rts_gpio = GPIOA;
+            serial->rts_pin = 1;
+        }
         irqn = USART2_IRQn;
         serial->usart = USART2;
-        serial->tx_dma = &dma_streams[6];
+        tx_req = DMA_REQ_USART2_TX;
+#if USE_SERIAL_RX_DMA
+        rx_req = DMA_REQ_USART2_RX;
+#endif
     } else
 #endif
 #if USE_SERIAL_USART3
@@ -106,9 +182,21 @@ serial_start(serial_t *serial, int speed
         gpiob_crh |= GPIO_CRH_MODE10_0 | GPIO_CRH_MODE10_1 | GPIO_CRH_CNF10_1;
         gpiob_crh &= ~(GPIO_CRH_MODE11 | GPIO_CRH_CNF11);
         gpiob_crh |= GPIO_CRH_CNF11_0;
+        if (flow & SERIAL_FLOW_RTSCTS) {
+            /* CTS on PB13, RTS on PB14 */
+            gpiob_crh &= ~(GPIO_CRH_MODE13 | GPIO_CRH_CNF13);
+            gpiob_crh |= GPIO_CRH_CNF13_0;
+            gpiob_crh &= ~(GPIO_CRH_MODE14 | GPIO_CRH_CNF14);
+            gpiob_crh |= GPIO_CRH_MODE14_0 | GPIO_CRH_MODE14_1 | GPIO_CRH_CNF14_1;
+            serial->rts_gpio = GPIOB;
+            serial->rts_pin = 14;
+        }
         irqn = USART3_IRQn;
         serial->usart = USART3;
-        serial->tx_dma = &dma_streams[1];
+        tx_req = DMA_REQ_USART3_TX;
+#if USE_SERIAL_RX_DMA
+        rx_req = DMA_REQ_USART3_RX;
+#endif
     } else
 #endif
 #if USE_SERIAL_UART4
@@ -118,9 +206,16 @@ serial_start(serial_t *serial, int speed
         gpioc_crh |= GPIO_CRH_MODE10_0 | GPIO_CRH_MODE10_1 | GPIO_CRH_CNF10_1;
         gpioc_crh &= ~(GPIO_CRH_MODE11 | GPIO_CRH_CNF11);
         gpioc_crh |= GPIO_CRH_CNF11_0;
+        if (flow & SERIAL_FLOW_RTSCTS) {
+            taskEXIT_CRITICAL();
+            HALT_WITH_MSG("no flow control on this port");
+        }
         irqn = UART4_IRQn;
         serial->usart = UART4;
-        serial->tx_dma = &dma_streams[11];
+        tx_req = DMA_REQ_UART4_TX;
+#if USE_SERIAL_RX_DMA
+        rx_req = DMA_REQ_UART4_RX;
+#endif
     } else
 #endif
 #if USE_SERIAL_UART5
@@ -128,8 +223,12 @@ serial_start(serial_t *serial, int speed
         RCC->APB1ENR |= RCC_APB1ENR_UART5EN;
         gpioc_crh &= ~(GPIO_CRH_MODE12 | GPIO_CRH_CNF12);
         gpioc_crh |= GPIO_CRH_MODE12_0 | GPIO_CRH_MODE12_1 | GPIO_CRH_CNF12_1;
-        gpiod_crl &= ~(GPIO_CRH_MODE2 | GPIO_CRH_CNF2);
-        gpiod_crl |= GPIO_CRH_CNF2_0;
+        gpiod_crl &= ~(GPIO_CRL_MODE2 | GPIO_CRL_CNF2);
+        gpiod_crl |= GPIO_CRL_CNF2_0;
+        if (flow & SERIAL_FLOW_RTSCTS) {
+            taskEXIT_CRITICAL();
+            HALT_WITH_MSG("no flow control on this port");
+        }
         irqn = UART5_IRQn;
         serial->usart = UART5;
     } else
@@ -140,10 +239,6 @@ serial_start(serial_t *serial, int speed
     }
 
     RCC->APB2ENR |= RCC_APB2ENR_AFIOEN | RCC_APB2ENR_IOPAEN;
-    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
-#if defined (STM32F10X_HD) || defined  (STM32F10X_CL) || defined  (STM32F10X_HD_VL)
-    RCC->AHBENR |= RCC_AHBENR_DMA2EN;
-#endif
     GPIOA->CRL = gpioa_crl;
     GPIOA->CRH = gpioa_crh;
     GPIOB->CRH = gpiob_crh;
@@ -155,20 +250,63 @@ serial_start(serial_t *serial, int speed
 
     NVIC_SetPriority(irqn, IRQ_PRIO_USART);
     NVIC_EnableIRQ(irqn);
-    serial_set_speed(serial);
+    if (serial_set_speed(serial))
+        HALT_WITH_MSG("unsupported baud rate");
     serial->usart->CR3 = 0;
+    if (flow & SERIAL_FLOW_RTSCTS)
+        /* RTS is dropped whenever DR holds a byte nobody has read, and
+         * by _serial_rx_flow() before the ring gets that full */
+        serial->usart->CR3 |= USART_CR3_RTSE | USART_CR3_CTSE;
 
+    serial->tx_head = serial->tx_tail = 0;
+    serial->tx_run = 0;
+    serial->tx_busy = serial->tx_pend = serial->tx_wait = 0;
+    ASSERT((serial->tx_space = xSemaphoreCreateBinary()));
+    serial->tx_dma = serial->tx_dma_ch =
+        _serial_dma_claim(serial, &serial->tx_claim, tx_req, usart_tcie);
     if (serial->tx_dma) {
-        dma_allocate(serial->tx_dma, IRQ_PRIO_USART, usart_tcie, serial);
         serial->tx_dma->ch->CPAR = (uint32_t)&serial->usart->DR;
+        serial->tx_dma->ch->CCR = dma_client_pl(&serial->tx_claim)
+                                  | DMA_CCR1_DIR
+                                  | DMA_CCR1_MINC
+                                  | DMA_CCR1_TEIE
+                                  | DMA_CCR1_TCIE
+        ;
         serial->usart->CR3 |= USART_CR3_DMAT;
-        serial->tx_q = NULL;
+        serial->tx_done = NULL;
         ASSERT((serial->tcie_sem = xSemaphoreCreateBinary()));
+        xSemaphoreGive(serial->tcie_sem);
     } else {
-        ASSERT((serial->tx_q = xQueueCreate(SERIAL_TX_SIZE, 1)));
         serial->tcie_sem = NULL;
     }
 
+#if USE_SERIAL_RX_DMA
+    serial->rx_dma = serial->rx_dma_ch =
+        _serial_dma_claim(serial, &serial->rx_claim, rx_req, usart_rx_dma);
+    if (serial->rx_dma) {
+        /* The DMA channel fills rx_buf round and round; the ISRs only move
+         * rx_head up to where it has got to, at each half of the buffer
+         * and whenever the line goes idle after a burst. With flow control
+         * it fills only the free part of the ring instead; see
+         * _serial_rx_dma_arm(). */
+        serial->rx_dma->ch->CPAR = (uint32_t)&serial->usart->DR;
+        serial->rx_dma->ch->CCR = dma_client_pl(&serial->rx_claim)
+                                  | DMA_CCR1_MINC
+                                  | DMA_CCR1_HTIE
+                                  | DMA_CCR1_TCIE
+        ;
+        serial->usart->CR1 = 0
+                             | USART_CR1_UE
+                             | USART_CR1_TE
+                             | USART_CR1_RE
+        ;
+        taskENTER_CRITICAL();
+        _serial_rx_dma_start(serial);
+        taskEXIT_CRITICAL();
+        return;
+    }
+#endif
+
     serial->usart->CR1 = 0
                          | USART_CR1_UE
                          | USART_CR1_TE
@@ -178,45 +316,243 @@ serial_start(serial_t *serial, int speed
 }
 
 
-void
+/* Clock feeding the port's baud rate generator: PCLK2 for USART1, PCLK1 for
+ * the rest, as the RCC is really configured.
+ */
+static uint32_t
+_serial_pclk(serial_t *serial)
+{
+    RCC_ClocksTypeDef clocks;
+
+    RCC_GetClocksFreq(&clocks);
+    if (serial->usart == USART1)
+        return clocks.PCLK2_Frequency;
+    return clocks.PCLK1_Frequency;
+}
+
+
+/* Work out the BRR value for a baud rate on a port clocked by pclk. BRR
+ * holds USARTDIV in 12.4 fixed point, so it is PCLK / baud rounded to the
+ * nearest sixteenth. Returns the
+ * BRR value, or 0 if the rate is out of the generator's range. If actual is
+ * not NULL it gets the rate that BRR really gives, and if err is not NULL
+ * the error against the requested rate in hundredths of a percent.
+ */
+uint16_t
+serial_calc_brr(uint32_t pclk, unsigned int speed, unsigned int *actual,
+                int *err)
+{
+    uint32_t brr;
+
+    /* USARTDIV must be at least 1, so the fastest rate is PCLK / 16 */
+    if (!speed || speed > pclk / 16)
+        return 0;
+
+    brr = (pclk + speed / 2) / speed;
+    if (brr > 0xffff)
+        return 0;
+
+    unsigned int got = (pclk + brr / 2) / brr;
+
+    if (actual)
+        *actual = got;
+    if (err)
+        *err = (int)(((int64_t)got - speed) * 10000 / speed);
+    return (uint16_t)brr;
+}
+
+
+/* Program the baud rate generator for serial->speed. The rate is refused,
+ * leaving the port as it was, if the generator cannot reach it or would be
+ * off by more than SERIAL_BAUD_TOLERANCE. On success serial->baud is set to
+ * the rate actually achieved. Returns 0 on success or -1 with errno set to
+ * EINVAL.
+ */
+int
 serial_set_speed(serial_t *serial)
 {
-    USART_TypeDef *u = serial->usart;
+    unsigned int actual;
+    int err;
+    uint16_t brr = serial_calc_brr(_serial_pclk(serial), serial->speed,
+                                   &actual, &err);
 
-    if (u == USART1)
-        /* FIXME: assuming PCLK2=HCLK */
-        u->BRR = SystemCoreClock / serial->speed;
-    else
-        /* FIXME: assuming PCLK1=HCLK/2 */
-        u->BRR = SystemCoreClock / 2 / serial->speed;
+    if (!brr || err > SERIAL_BAUD_TOLERANCE || err < -SERIAL_BAUD_TOLERANCE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    serial->usart->BRR = brr;
+    serial->baud = actual;
+    return 0;
 }
 
 
-static void
-_serial_write(serial_t *serial, const char *value, uint16_t size)
+/* Load the next piece of an asynchronous write into the TX DMA channel and
+ * start it; a write too big for CNDTR is sent in pieces. Returns 0 if there
+ * was nothing left to send. Called with the channel disabled and the TC
+ * interrupt masked or running.
+ */
+static int
+_serial_dma_next(serial_t *serial)
 {
+    if (!serial->tx_left)
+        return 0;
+
+    uint16_t chunk = MIN(serial->tx_left, 0xffff);
+
+    serial->tx_dma->ch->CMAR = (uint32_t)serial->tx_next;
+    serial->tx_dma->ch->CNDTR = chunk;
+    serial->tx_next += chunk;
+    serial->tx_left -= chunk;
     serial->usart->SR = ~USART_SR_TC;
-    if (serial->tx_dma) {
-        dma_disable(serial->tx_dma);
-        serial->tx_dma->ch->CCR = 0
-                                  | DMA_CCR1_DIR
-                                  | DMA_CCR1_MINC
-                                  | DMA_CCR1_TEIE
-                                  | DMA_CCR1_TCIE
-        ;
-        serial->tx_dma->ch->CMAR = (uint32_t)value;
-        serial->tx_dma->ch->CNDTR = size;
-        dma_enable(serial->tx_dma);
-        xSemaphoreTake(serial->tcie_sem, portMAX_DELAY);
-    } else {
-        while (size--) {
-            _serial_putc(serial, value, portMAX_DELAY);
-            value++;
+    dma_enable(serial->tx_dma);
+    return 1;
+}
+
+
+/* Send the next contiguous run of the transmit ring. If an asynchronous
+ * write is waiting, stop at the point the ring had reached when it was
+ * queued so it goes out in order. Returns 0 if there was nothing to send.
+ * Called like _serial_dma_next().
+ */
+static int
+_serial_ring_next(serial_t *serial)
+{
+    uint16_t tail = serial->tx_tail;
+    uint16_t avail = (serial->tx_pend ? serial->tx_mark : serial->tx_head) - tail;
+    uint16_t off = tail & (SERIAL_TX_RING_SIZE - 1);
+
+    if (!avail)
+        return 0;
+
+    serial->tx_run = MIN(avail, SERIAL_TX_RING_SIZE - off);
+    serial->tx_dma->ch->CMAR = (uint32_t)&serial->tx_buf[off];
+    serial->tx_dma->ch->CNDTR = serial->tx_run;
+    serial->usart->SR = ~USART_SR_TC;
+    dma_enable(serial->tx_dma);
+    return 1;
+}
+
+
+/* Start whatever should go next on an idle channel: a waiting asynchronous
+ * write once the ring has caught up with it, otherwise more of the ring.
+ * Clears tx_busy if there is nothing. Called from the TC interrupt or with
+ * it masked.
+ */
+static void
+_serial_tx_kick(serial_t *serial)
+{
+    if (serial->tx_pend && serial->tx_tail == serial->tx_mark) {
+        serial->tx_pend = 0;
+        serial->tx_run = 0;
+        if (_serial_dma_next(serial))
+            return;
+    }
+    if (!_serial_ring_next(serial))
+        serial->tx_busy = 0;
+}
+
+
+/* Sleep until the transmit interrupt has made progress, unless ready()
+ * already holds. The TC interrupt gives tx_space after every transfer; the
+ * TXE interrupt only does so when asked through tx_wait, so that it makes
+ * no kernel calls while nobody is waiting.
+ */
+static void
+_serial_tx_wait(serial_t *serial, int (*ready)(serial_t *serial))
+{
+    serial->tx_wait = 1;
+    __DMB();
+    if (!ready(serial))
+        xSemaphoreTake(serial->tx_space, portMAX_DELAY);
+    serial->tx_wait = 0;
+}
+
+
+static int
+_serial_tx_has_space(serial_t *serial)
+{
+    return serial->tx_head - serial->tx_tail != SERIAL_TX_RING_SIZE;
+}
+
+
+static int
+_serial_tx_idle(serial_t *serial)
+{
+    return serial->tx_head == serial->tx_tail && !serial->tx_busy
+           && !serial->tx_pend;
+}
+
+
+/* Copy a buffer into the transmit ring, waiting for the interrupt side to
+ * make room whenever it fills. Each piece is handed over as soon as it is
+ * in, so a write larger than the ring streams through it. The caller holds
+ * the port mutex.
+ */
+static void
+_serial_ring_put(serial_t *serial, const char *value, size_t size)
+{
+    while (size) {
+        uint16_t head = serial->tx_head;
+        uint16_t space = SERIAL_TX_RING_SIZE - (uint16_t)(head - serial->tx_tail);
+
+        if (!space) {
+#if SERIAL_STATS
+            uint32_t t0 = dwt_cycles();
+
+            _serial_tx_wait(serial, _serial_tx_has_space);
+            serial->stats.tx_stall += dwt_cycles() - t0;
+#else
+            _serial_tx_wait(serial, _serial_tx_has_space);
+#endif
+            continue;
+        }
+
+        uint16_t off = head & (SERIAL_TX_RING_SIZE - 1);
+        uint16_t n = MIN(space, SERIAL_TX_RING_SIZE - off);
+
+        if (n > size)
+            n = size;
+
+        memcpy(&serial->tx_buf[off], value, n);
+        __DMB();
+        value += n;
+        size -= n;
+
+        taskENTER_CRITICAL();
+        serial->tx_head = head + n;
+        if (!serial->tx_dma) {
+            serial->usart->CR1 |= USART_CR1_TXEIE;
+        } else if (!serial->tx_busy) {
+            serial->tx_busy = 1;
+            _serial_tx_kick(serial);
         }
+        taskEXIT_CRITICAL();
     }
 }
 
 
+/* Queue a gather list for sending. The bytes are copied into the transmit
+ * ring and this returns as soon as they fit; writes from several tasks
+ * coalesce there, into long DMA runs on ports that have TX DMA.
+ */
+static void
+_serial_writev(serial_t *serial, const struct iovec *iov, int iovcnt)
+{
+    for (; iovcnt; iov++, iovcnt--)
+        _serial_ring_put(serial, iov->iov_base, iov->iov_len);
+}
+
+
+static void
+_serial_write(serial_t *serial, const char *value, uint16_t size)
+{
+    struct iovec iov = { (void *)value, size };
+
+    _serial_writev(serial, &iov, 1);
+}
+
+
 void
 serial_puts(serial_t *serial, const char *value)
 {
@@ -235,20 +571,118 @@ serial_write(serial_t *serial, const char *value, uint16_t size)
 }
 
 
+/* Write several buffers as one. Nothing from another task's write can land
+ * between them.
+ */
+void
+serial_writev(serial_t *serial, const struct iovec *iov, int iovcnt)
+{
+    xSemaphoreTake(serial->mutex, portMAX_DELAY);
+    _serial_writev(serial, iov, iovcnt);
+    xSemaphoreGive(serial->mutex);
+}
+
+
+/* Hold the transmit side for a run of serial_tx_put() calls, so that
+ * something built up a piece at a time, such as an encoded frame, goes
+ * into the ring whole and without being staged anywhere else first.
+ */
+void
+serial_tx_lock(serial_t *serial)
+{
+    xSemaphoreTake(serial->mutex, portMAX_DELAY);
+}
+
+
+/* Copy bytes into the transmit ring; the caller holds serial_tx_lock().
+ */
+void
+serial_tx_put(serial_t *serial, const void *value, size_t size)
+{
+    _serial_ring_put(serial, value, size);
+}
+
+
+void
+serial_tx_unlock(serial_t *serial)
+{
+    xSemaphoreGive(serial->mutex);
+}
+
+
+/* Start writing a buffer and return at once, leaving the DMA interrupt to
+ * call done when it has gone out. The buffer is sent in place, after
+ * anything already in the transmit ring, and must be left alone until
+ * then. Only one can be outstanding; another waits for the first to
+ * finish. Only ports with TX DMA support this; others fail with ENOTSUP.
+ */
+int
+serial_write_async(serial_t *serial, const void *value, size_t size,
+                   dma_done_t done, void *param)
+{
+    if (!serial->tx_dma) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (!size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    xSemaphoreTake(serial->mutex, portMAX_DELAY);
+    xSemaphoreTake(serial->tcie_sem, portMAX_DELAY);
+    serial->tx_done = done;
+    serial->tx_done_param = param;
+    serial->tx_next = value;
+    serial->tx_left = size;
+    serial->tx_err = 0;
+
+    taskENTER_CRITICAL();
+    serial->tx_mark = serial->tx_head;
+    serial->tx_pend = 1;
+    if (!serial->tx_busy) {
+        serial->tx_busy = 1;
+        _serial_tx_kick(serial);
+    }
+    taskEXIT_CRITICAL();
+
+    xSemaphoreGive(serial->mutex);
+    return 0;
+}
+
+
+/* Room left to queue bytes for sending; a write of this much will not
+ * block.
+ */
+uint16_t
+serial_tx_space(serial_t *serial)
+{
+    return SERIAL_TX_RING_SIZE - (uint16_t)(serial->tx_head - serial->tx_tail);
+}
+
+
 #if USE_SERIAL_PRINTF
+static void
+_serial_fmt_out(void *ctx, const char *s, size_t len)
+{
+    _serial_ring_put((serial_t *)ctx, s, len);
+}
+
+
+/* Format straight into the transmit ring, a piece at a time, so there is
+ * no scratch buffer to share or overflow. The port mutex is held
+ * throughout, so the output of one call is never split by another.
+ */
 void
 serial_printf(serial_t *serial, const char *fmt, ...)
 {
-    unsigned len;
-    static char fmt_buf[64];
     va_list ap;
 
     va_start(ap, fmt);
     xSemaphoreTake(serial->mutex, portMAX_DELAY);
-    len = vsnprintf(fmt_buf, sizeof(fmt_buf), fmt, ap);
-    _serial_write(serial, fmt_buf, MIN(len, sizeof(fmt_buf)));
-    va_end(ap);
+    fmt_vformat(_serial_fmt_out, serial, fmt, ap);
     xSemaphoreGive(serial->mutex);
+    va_end(ap);
 }
 #endif
 
@@ -257,21 +691,389 @@ void
 serial_drain(serial_t *serial)
 {
     xSemaphoreTake(serial->mutex, portMAX_DELAY);
+    while (!_serial_tx_idle(serial))
+        _serial_tx_wait(serial, _serial_tx_idle);
     while (!(serial->usart->SR & USART_SR_TC)) {
     }
     xSemaphoreGive(serial->mutex);
 }
 
 
+/* Bytes the receive ring holds before RTS is dropped. */
+#define RX_HIGH_WATER   (SERIAL_RX_SIZE - SERIAL_RX_HEADROOM)
+
+/* Hold RTS off, or hand it back to the USART. The pin is switched between
+ * its alternate function and a plain push-pull output driven high. Call
+ * from the ISRs or in a critical section.
+ */
+static void
+_serial_rts(serial_t *serial, int off)
+{
+    GPIO_TypeDef *gpio = serial->rts_gpio;
+
+    if (gpio == NULL || serial->rts_off == off)
+        return;
+
+    volatile uint32_t *cr = serial->rts_pin < 8 ? &gpio->CRL : &gpio->CRH;
+    unsigned int shift = (serial->rts_pin & 7) * 4;
+
+    serial->rts_off = off;
+    if (off)
+        gpio->BSRR = 1 << serial->rts_pin;
+    /* 50MHz output; CNF 10 is alternate function, 00 general purpose */
+    *cr = (*cr & ~(0xfUL << shift))
+          | ((off ? 0x3UL : 0xbUL) << shift);
+}
+
+
+/* With flow control, drop RTS once the receive ring is past its high-water
+ * mark, so that bytes the sender has in flight when it sees that still
+ * fit, and raise it again once the reader has made room. Call from the
+ * ISRs or in a critical section.
+ */
+static void
+_serial_rx_flow(serial_t *serial)
+{
+    uint16_t used = serial->rx_head - serial->rx_tail;
+
+    _serial_rts(serial, used >= RX_HIGH_WATER);
+}
+
+
+#if USE_SERIAL_RX_DMA
+/* With flow control the RX DMA channel is not circular. It is pointed at
+ * the free run of the ring after rx_head, ending at the high-water mark
+ * while the ring is below it so that RTS can be dropped there, and stops
+ * when that is full. If the ring is full it is left stopped, so the next
+ * byte stays in DR and the USART holds RTS off until serial_rx_release()
+ * makes room and calls this again. Call from the ISRs or in a critical
+ * section.
+ */
+static void
+_serial_rx_dma_arm(serial_t *serial)
+{
+    uint16_t head = serial->rx_head;
+    uint16_t off = head & (SERIAL_RX_SIZE - 1);
+    uint16_t used = head - serial->rx_tail;
+    uint16_t len = MIN(SERIAL_RX_SIZE - off,
+                       (used < RX_HIGH_WATER ? RX_HIGH_WATER : SERIAL_RX_SIZE)
+                       - used);
+
+    _serial_rx_flow(serial);
+
+    dma_disable(serial->rx_dma);
+    serial->rx_dma_base = head;
+    serial->rx_dma_len = len;
+    if (!len)
+        return;
+
+    serial->rx_dma->ch->CMAR = (uint32_t)&serial->rx_buf[off];
+    serial->rx_dma->ch->CNDTR = len;
+    dma_enable(serial->rx_dma);
+    serial->usart->CR1 |= USART_CR1_IDLEIE;
+}
+
+
+/* Hand DR over to the RX DMA channel, which starts filling an empty ring.
+ * Call in a critical section.
+ */
+static void
+_serial_rx_dma_start(serial_t *serial)
+{
+    serial->usart->CR3 |= USART_CR3_DMAR | USART_CR3_EIE;
+    if (serial->flow & SERIAL_FLOW_RTSCTS) {
+        _serial_rx_dma_arm(serial);
+    } else {
+        serial->rx_dma->ch->CMAR = (uint32_t)serial->rx_buf;
+        serial->rx_dma->ch->CNDTR = SERIAL_RX_SIZE;
+        serial->rx_dma->ch->CCR |= DMA_CCR1_CIRC;
+        dma_enable(serial->rx_dma);
+        serial->usart->CR1 |= USART_CR1_IDLEIE;
+    }
+}
+
+
+/* Move rx_head up to where the RX DMA channel has written to. In circular
+ * mode the channel counts CNDTR down from SERIAL_RX_SIZE and wraps; the HT
+ * and TC interrupts guarantee we look at least twice a lap, so the
+ * distance is never ambiguous. With flow control, a finished run is
+ * followed by the next free one. Call from the ISRs or in a critical
+ * section. Returns the number of new bytes.
+ */
+static uint16_t
+_serial_rx_dma_sync(serial_t *serial)
+{
+    uint16_t head = serial->rx_head;
+    uint16_t fresh;
+
+    if (serial->flow & SERIAL_FLOW_RTSCTS) {
+        if (!serial->rx_dma_len)
+            return 0;
+
+        uint16_t left = serial->rx_dma->ch->CNDTR;
+
+        fresh = serial->rx_dma_base + serial->rx_dma_len - left - head;
+        serial->rx_head = head + fresh;
+        if (!left)
+            _serial_rx_dma_arm(serial);
+        return fresh;
+    }
+
+    uint16_t pos = SERIAL_RX_SIZE - serial->rx_dma->ch->CNDTR;
+
+    fresh = (pos - head) & (SERIAL_RX_SIZE - 1);
+    serial->rx_head = head + fresh;
+    return fresh;
+}
+
+
+static void
+_serial_rx_dma_event(serial_t *serial, BaseType_t *wakeup)
+{
+    if (_serial_rx_dma_sync(serial)) {
+#if SERIAL_STATS
+        serial->stats.rx_stamp = dwt_cycles();
+#endif
+        xSemaphoreGiveFromISR(serial->rx_sem, wakeup);
+        if (serial->rx_notify)
+            serial->rx_notify(wakeup);
+    }
+}
+#endif
+
+
+/* Number of bytes waiting in the receive ring. With circular DMA the
+ * channel is asked directly, so bytes show up without waiting for an
+ * interrupt. If the DMA has lapped the reader, the oldest data has been
+ * overwritten; skip it.
+ */
+static uint16_t
+_serial_rx_avail(serial_t *serial)
+{
+#if USE_SERIAL_RX_DMA
+    if (serial->rx_dma) {
+        taskENTER_CRITICAL();
+        _serial_rx_dma_sync(serial);
+        taskEXIT_CRITICAL();
+    }
+#endif
+
+    uint16_t avail = serial->rx_head - serial->rx_tail;
+
+    if (avail > SERIAL_RX_SIZE) {
+        serial->errors.dropped += avail - SERIAL_RX_SIZE;
+        serial->rx_tail = serial->rx_head - SERIAL_RX_SIZE;
+        avail = SERIAL_RX_SIZE;
+    }
+    return avail;
+}
+
+
+/* Wait until the receive ring has something in it. The semaphore is only
+ * a hint that the ISR has added bytes since it was last taken, so the ring
+ * itself is checked each time round. Returns the number of bytes waiting,
+ * or 0 on timeout.
+ */
+static uint16_t
+_serial_rx_wait(serial_t *serial, TickType_t timeout)
+{
+    TimeOut_t start;
+    uint16_t avail;
+
+    vTaskSetTimeOutState(&start);
+    while (!(avail = _serial_rx_avail(serial))) {
+        if (xTaskCheckForTimeOut(&start, &timeout)
+                || !xSemaphoreTake(serial->rx_sem, timeout))
+            return 0;
+    }
+    return avail;
+}
+
+
 int16_t
 serial_get(serial_t *serial, TickType_t timeout)
 {
     uint8_t val;
 
-    if (xQueueReceive(serial->rx_q, &val, timeout))
-        return val;
-    else
+    if (!_serial_rx_wait(serial, timeout))
         return -ETIMEDOUT;
+
+    val = serial->rx_buf[serial->rx_tail & (SERIAL_RX_SIZE - 1)];
+    serial->rx_tail++;
+    return val;
+}
+
+
+/* Read up to len bytes, in the manner of termios VMIN and VTIME. With min
+ * set, wait as long as it takes for the first byte, then return once min
+ * have arrived or the line has been quiet for timeout (0 waits for all
+ * min). With min 0, wait up to timeout for anything at all. Whatever else
+ * is already in the ring, up to len, is taken too. Returns the number of
+ * bytes read, which is 0 only if min is 0 and nothing came.
+ */
+size_t
+serial_read(serial_t *serial, void *buf, size_t len, size_t min,
+            TickType_t timeout)
+{
+    uint8_t *p = buf;
+    const uint8_t *chunk;
+    size_t got = 0;
+    uint16_t avail;
+    TickType_t wait;
+
+    while (got < len) {
+        if (got < min)
+            wait = (got && timeout) ? timeout : portMAX_DELAY;
+        else
+            wait = (got || !timeout) ? 0 : timeout;
+
+        avail = serial_rx_borrow(serial, &chunk, wait);
+        if (!avail) {
+            if (wait == portMAX_DELAY)
+                continue;
+            break;
+        }
+
+        if (avail > len - got)
+            avail = len - got;
+        memcpy(p + got, chunk, avail);
+        serial_rx_release(serial, avail);
+        got += avail;
+    }
+
+    return got;
+}
+
+
+uint16_t
+serial_available(serial_t *serial)
+{
+    return _serial_rx_avail(serial);
+}
+
+
+/* Lend out received bytes in place. Waits up to timeout for the first one,
+ * then points ptr at the oldest byte and returns how many follow it
+ * contiguously in the ring. They stay valid until serial_rx_release(),
+ * unless receive DMA laps the reader first.
+ */
+uint16_t
+serial_rx_borrow(serial_t *serial, const uint8_t **ptr, TickType_t timeout)
+{
+    uint16_t avail = _serial_rx_wait(serial, timeout);
+    uint16_t tail = serial->rx_tail & (SERIAL_RX_SIZE - 1);
+
+    *ptr = &serial->rx_buf[tail];
+    return MIN(avail, SERIAL_RX_SIZE - tail);
+}
+
+
+/* Hand back len bytes from the front of the ring, as lent out by
+ * serial_rx_borrow(), so the ISR may reuse their space.
+ */
+void
+serial_rx_release(serial_t *serial, uint16_t len)
+{
+    ASSERT(len <= SERIAL_RX_SIZE);
+    serial->rx_tail += len;
+
+    /* raise RTS and restart a receiver that stopped for want of room */
+    if ((serial->flow & SERIAL_FLOW_RTSCTS) && len) {
+        taskENTER_CRITICAL();
+        _serial_rx_flow(serial);
+#if USE_SERIAL_RX_DMA
+        if (serial->rx_dma) {
+            if (!serial->rx_dma_len)
+                _serial_rx_dma_arm(serial);
+        } else
+#endif
+            serial->usart->CR1 |= USART_CR1_RXNEIE;
+        taskEXIT_CRITICAL();
+    }
+}
+
+
+/* Copy out the receive error counts. */
+void
+serial_get_errors(serial_t *serial, struct serial_errors *errors)
+{
+    taskENTER_CRITICAL();
+    *errors = serial->errors;
+    taskEXIT_CRITICAL();
+}
+
+
+/* Copy out the driver activity counts; all zero without SERIAL_STATS. */
+void
+serial_get_stats(serial_t *serial, struct serial_stats *stats)
+{
+#if SERIAL_STATS
+    taskENTER_CRITICAL();
+    *stats = serial->stats;
+    taskEXIT_CRITICAL();
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+
+/* Move bytes with the port's DMA channels, or with the USART interrupt a
+ * byte at a time, so the two can be compared. Output is drained first and
+ * anything received but not yet read is discarded, so the port should be
+ * otherwise quiet. Returns 0, or -1 with errno set to ENOTSUP if DMA is
+ * asked for on a port that has no channels.
+ */
+int
+serial_set_dma(serial_t *serial, int on)
+{
+    USART_TypeDef *u = serial->usart;
+
+    if (on && !serial->tx_dma_ch && !serial->rx_dma_ch) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    xSemaphoreTake(serial->mutex, portMAX_DELAY);
+    while (!_serial_tx_idle(serial))
+        _serial_tx_wait(serial, _serial_tx_idle);
+
+    taskENTER_CRITICAL();
+    if (on && serial->tx_dma_ch) {
+        /* the TXE interrupt may not yet have seen the ring empty */
+        u->CR1 &= ~USART_CR1_TXEIE;
+        u->CR3 |= USART_CR3_DMAT;
+        serial->tx_dma = serial->tx_dma_ch;
+    } else {
+        u->CR3 &= ~USART_CR3_DMAT;
+        serial->tx_dma = NULL;
+    }
+
+#if USE_SERIAL_RX_DMA
+    if (serial->rx_dma_ch) {
+        if (serial->rx_dma) {
+            dma_disable(serial->rx_dma);
+            u->CR3 &= ~(USART_CR3_DMAR | USART_CR3_EIE);
+            u->CR1 &= ~USART_CR1_IDLEIE;
+        } else {
+            u->CR1 &= ~USART_CR1_RXNEIE;
+        }
+        serial->rx_head = serial->rx_tail = 0;
+        serial->rx_dma_len = 0;
+        _serial_rts(serial, 0);
+
+        if (on) {
+            serial->rx_dma = serial->rx_dma_ch;
+            _serial_rx_dma_start(serial);
+        } else {
+            serial->rx_dma = NULL;
+            u->CR1 |= USART_CR1_RXNEIE;
+        }
+    }
+#endif
+    taskEXIT_CRITICAL();
+
+    xSemaphoreGive(serial->mutex);
+    return 0;
 }
 
 
@@ -279,23 +1081,83 @@ static inline void
 usart_irq(serial_t *serial)
 {
     USART_TypeDef *u = serial->usart;
-    uint16_t sr, dr;
-    uint8_t val;
+    uint16_t sr;
     BaseType_t wakeup = pdFALSE;
 
+#if SERIAL_STATS
+    serial->stats.irqs++;
+#endif
     sr = u->SR;
-    dr = u->DR;
 
-    if ((sr & USART_SR_RXNE) && serial->rx_q) {
-        val = (uint8_t)dr;
-        xQueueSendToBackFromISR(serial->rx_q, &val, &wakeup);
+    if (sr & (USART_SR_ORE | USART_SR_NE | USART_SR_FE | USART_SR_PE)) {
+        if (sr & USART_SR_ORE)
+            serial->errors.overrun++;
+        if (sr & USART_SR_NE)
+            serial->errors.noise++;
+        if (sr & USART_SR_FE)
+            serial->errors.framing++;
+        if (sr & USART_SR_PE)
+            serial->errors.parity++;
     }
 
-    if (sr & USART_SR_TXE) {
-        if (serial->tx_q && xQueueReceiveFromISR(serial->tx_q, &val, &wakeup))
-            u->DR = val;
-        else
+#if USE_SERIAL_RX_DMA
+    if (serial->rx_dma) {
+        /* The DMA owns DR. Its own read of DR clears NE and FE along with
+         * the byte, but an overrun byte has to go to clear ORE. The SR
+         * then DR read clears IDLE; if a byte is waiting, the DMA's read
+         * of it does that instead. */
+        if ((sr & USART_SR_ORE) || ((sr & USART_SR_IDLE) && !(sr & USART_SR_RXNE)))
+            (void)u->DR;
+        else if ((sr & USART_SR_IDLE) && !serial->rx_dma_len)
+            /* stopped for flow control; wait for the reader to re-arm us */
+            u->CR1 &= ~USART_CR1_IDLEIE;
+        if (sr & USART_SR_IDLE)
+            _serial_rx_dma_event(serial, &wakeup);
+    } else
+#endif
+    if (sr & USART_SR_RXNE) {
+        uint16_t head = serial->rx_head;
+
+        if ((uint16_t)(head - serial->rx_tail) < SERIAL_RX_SIZE) {
+            serial->rx_buf[head & (SERIAL_RX_SIZE - 1)] = (uint8_t)u->DR;
+            __DMB();
+            serial->rx_head = head + 1;
+            if (serial->flow & SERIAL_FLOW_RTSCTS)
+                _serial_rx_flow(serial);
+        } else if (serial->flow & SERIAL_FLOW_RTSCTS) {
+            /* leave the byte in DR, which holds RTS off, until a reader
+             * makes room */
+            u->CR1 &= ~USART_CR1_RXNEIE;
+        } else {
+            (void)u->DR;
+            serial->errors.dropped++;
+        }
+#if SERIAL_STATS
+        serial->stats.rx_stamp = dwt_cycles();
+#endif
+        xSemaphoreGiveFromISR(serial->rx_sem, &wakeup);
+        if (serial->rx_notify)
+            serial->rx_notify(&wakeup);
+    }
+
+    if (!serial->tx_dma && (sr & USART_SR_TXE) && (u->CR1 & USART_CR1_TXEIE)) {
+        uint16_t tail = serial->tx_tail;
+
+        if (tail != serial->tx_head) {
+            int was_full = (uint16_t)(serial->tx_head - tail) == SERIAL_TX_RING_SIZE;
+
+            u->DR = serial->tx_buf[tail & (SERIAL_TX_RING_SIZE - 1)];
+            serial->tx_tail = tail + 1;
+            if (serial->tx_wait) {
+                serial->tx_wait = 0;
+                xSemaphoreGiveFromISR(serial->tx_space, &wakeup);
+            }
+            /* writable again, for poll() */
+            if (was_full && serial->tx_notify)
+                serial->tx_notify(&wakeup);
+        } else {
             u->CR1 &= ~USART_CR1_TXEIE;
+        }
     }
 
     portEND_SWITCHING_ISR(wakeup);
@@ -308,12 +1170,52 @@ usart_tcie(void *param, uint32_t flags)
     serial_t *serial = (serial_t *)param;
     BaseType_t wakeup = pdFALSE;
 
+#if SERIAL_STATS
+    serial->stats.irqs++;
+#endif
     dma_disable(serial->tx_dma);
-    xSemaphoreGiveFromISR(serial->tcie_sem, &wakeup);
+    if (serial->tx_run) {
+        /* a run from the ring; a transfer error just loses it */
+        serial->tx_tail += serial->tx_run;
+        serial->tx_run = 0;
+    } else {
+        if (flags & DMA_FLAG_TE)
+            serial->tx_err = EIO;
+        else if (_serial_dma_next(serial))
+            return;
+
+        dma_done_t done = serial->tx_done;
+        serial->tx_done = NULL;
+        if (done)
+            done(serial->tx_done_param, serial->tx_err, &wakeup);
+        xSemaphoreGiveFromISR(serial->tcie_sem, &wakeup);
+    }
+
+    _serial_tx_kick(serial);
+    xSemaphoreGiveFromISR(serial->tx_space, &wakeup);
+    if (serial->tx_notify)
+        serial->tx_notify(&wakeup);
     portEND_SWITCHING_ISR(wakeup);
 }
 
 
+#if USE_SERIAL_RX_DMA
+static void
+usart_rx_dma(void *param, uint32_t flags)
+{
+    serial_t *serial = (serial_t *)param;
+    BaseType_t wakeup = pdFALSE;
+
+#if SERIAL_STATS
+    serial->stats.irqs++;
+#endif
+    if (flags & (DMA_FLAG_HT | DMA_FLAG_TC))
+        _serial_rx_dma_event(serial, &wakeup);
+    portEND_SWITCHING_ISR(wakeup);
+}
+#endif
+
+
 #if USE_SERIAL_USART1
 void
 USART1_IRQHandler(void)
@@ -19,20 +19,122 @@
 #include <semphr.h>
 #include <stm32/dma.h>
 
-#define SERIAL_TX_SIZE  16
-#define SERIAL_RX_SIZE  16
+#ifndef SERIAL_BAUD_TOLERANCE
+/* largest baud rate error accepted, in hundredths of a percent */
+#define SERIAL_BAUD_TOLERANCE   200
+#endif
+#ifndef SERIAL_TX_RING_SIZE
+/* size of the transmit ring; must be a power of two */
+#define SERIAL_TX_RING_SIZE 256
+#endif
+#ifndef SERIAL_RX_SIZE
+/* size of the receive ring; must be a power of two */
+#define SERIAL_RX_SIZE  64
+#endif
+#ifndef SERIAL_RX_HEADROOM
+/* with flow control, RTS is dropped this many bytes short of a full
+ * receive ring, to leave room for what the sender already has in flight */
+#define SERIAL_RX_HEADROOM  8
+#endif
+#ifndef SERIAL_STATS
+/* count interrupts and time spent waiting, for serbench */
+#define SERIAL_STATS    1
+#endif
 
+struct iovec;
+
+/* serial_start() flags */
+#define SERIAL_FLOW_NONE    0
+/* hardware RTS/CTS flow control; USART1-3 only */
+#define SERIAL_FLOW_RTSCTS  1
+
+/* receive error counts */
+struct serial_errors {
+    uint32_t    overrun;    /* ORE: a byte arrived before DR was read */
+    uint32_t    noise;      /* NE */
+    uint32_t    framing;    /* FE: bad stop bit, or a break */
+    uint32_t    parity;     /* PE */
+    uint32_t    dropped;    /* received but lost because the ring was full */
+};
+
+/* driver activity counts, kept if SERIAL_STATS is set */
+struct serial_stats {
+    uint32_t    irqs;       /* USART and DMA interrupts taken */
+    uint32_t    tx_stall;   /* CPU cycles writers waited for ring space */
+    uint32_t    rx_stamp;   /* cycle count when an ISR last woke the reader */
+};
 
 typedef struct {
     USART_TypeDef       *usart;
     unsigned int        speed;
+    /* rate the baud rate generator actually gives */
+    unsigned int        baud;
+    /* SERIAL_FLOW_ flags given to serial_start() */
+    unsigned int        flow;
     SemaphoreHandle_t   mutex;
-    /* non-DMA */
-    QueueHandle_t       tx_q;
-    QueueHandle_t       rx_q;
-    /* DMA */
+    /* receive ring, filled by the ISR or by circular DMA and drained by
+     * one reader */
+    uint8_t             rx_buf[SERIAL_RX_SIZE];
+    volatile uint16_t   rx_head;
+    volatile uint16_t   rx_tail;
+    SemaphoreHandle_t   rx_sem;
+    /* RX DMA channel, or NULL if bytes are taken by the RXNE interrupt */
+    const dma_ch_t      *rx_dma;
+    /* with flow control, the part of the ring the RX DMA is filling;
+     * rx_dma_len is 0 while the ring is full and the DMA stopped */
+    uint16_t            rx_dma_base;
+    volatile uint16_t   rx_dma_len;
+    /* with flow control, the RTS pin, and whether it is being held off
+     * because the ring is past its high-water mark */
+    GPIO_TypeDef        *rts_gpio;
+    uint16_t            rts_pin;
+    volatile uint8_t    rts_off;
+    volatile struct serial_errors errors;
+    /* transmit ring; writers copy in at tx_head under the mutex, the DMA
+     * TC interrupt sends from tx_tail in contiguous runs, or on ports
+     * without TX DMA the TXE interrupt sends a byte at a time */
+    uint8_t             tx_buf[SERIAL_TX_RING_SIZE];
+    volatile uint16_t   tx_head;
+    volatile uint16_t   tx_tail;
+    /* bytes of the ring in flight, or 0 if the channel is sending from
+     * a caller's buffer */
+    uint16_t            tx_run;
+    /* the channel is running; only changed with the ISR masked */
+    volatile uint8_t    tx_busy;
+    /* an asynchronous write waits for the ring to reach tx_mark */
+    volatile uint8_t    tx_pend;
+    uint16_t            tx_mark;
+    /* given by the TC interrupt each time a transfer finishes, or by the
+     * TXE interrupt when tx_wait is set */
+    SemaphoreHandle_t   tx_space;
+    volatile uint8_t    tx_wait;
+    /* DMA; tcie_sem is available while no asynchronous write is queued
+     * or running */
     SemaphoreHandle_t   tcie_sem;
     const dma_ch_t      *tx_dma;
+    /* the port's DMA channels, whether or not serial_set_dma() has them
+     * in use */
+    const dma_ch_t      *tx_dma_ch;
+    const dma_ch_t      *rx_dma_ch;
+    /* their claims with the DMA broker */
+    dma_client_t        tx_claim;
+#if USE_SERIAL_RX_DMA
+    dma_client_t        rx_claim;
+#endif
+    /* asynchronous write in progress, advanced by the TC interrupt */
+    const char          *tx_next;
+    size_t              tx_left;
+    /* completion of an asynchronous write, if one is running */
+    dma_done_t          tx_done;
+    void                *tx_done_param;
+    int                 tx_err;
+    /* called from the ISR when a byte is received, if set */
+    void                (*rx_notify)(BaseType_t *wakeup);
+    /* called from the ISR when room frees up in the transmit ring, if set */
+    void                (*tx_notify)(BaseType_t *wakeup);
+#if SERIAL_STATS
+    volatile struct serial_stats stats;
+#endif
 } serial_t;
 
 #if USE_SERIAL_USART1
@@ -52,17 +154,35 @@ extern serial_t Serial5;
 #endif
 
 
-void serial_start(serial_t *serial, int speed
+void serial_start(serial_t *serial, int speed, unsigned int flow
 #if configUSE_QUEUE_SETS
                   , QueueSetHandle_t queue_set
 #endif
                   );
-void serial_set_speed(serial_t *serial);
+int serial_set_speed(serial_t *serial);
+uint16_t serial_calc_brr(uint32_t pclk, unsigned int speed,
+                         unsigned int *actual, int *err);
 void serial_puts(serial_t *serial, const char *value);
 void serial_write(serial_t *serial, const char *value, uint16_t size);
-void serial_printf(serial_t *serial, const char *fmt, ...);
+void serial_writev(serial_t *serial, const struct iovec *iov, int iovcnt);
+void serial_tx_lock(serial_t *serial);
+void serial_tx_put(serial_t *serial, const void *value, size_t size);
+void serial_tx_unlock(serial_t *serial);
+int serial_write_async(serial_t *serial, const void *value, size_t size,
+                       dma_done_t done, void *param);
+void serial_printf(serial_t *serial, const char *fmt, ...)
+    __attribute__ ((format(printf, 2, 3)));
 void serial_drain(serial_t *serial);
+uint16_t serial_tx_space(serial_t *serial);
+void serial_get_errors(serial_t *serial, struct serial_errors *errors);
+void serial_get_stats(serial_t *serial, struct serial_stats *stats);
+int serial_set_dma(serial_t *serial, int on);
 int16_t serial_get(serial_t *serial, TickType_t timeout);
+size_t serial_read(serial_t *serial, void *buf, size_t len, size_t min,
+                   TickType_t timeout);
+uint16_t serial_available(serial_t *serial);
+uint16_t serial_rx_borrow(serial_t *serial, const uint8_t **ptr, TickType_t timeout);
+void serial_rx_release(serial_t *serial, uint16_t len);
 
 #if USE_SERIAL_USART1
 void USART1_IRQHandler(void) __attribute__ ((interrupt));
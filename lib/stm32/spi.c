@@ -12,7 +12,10 @@
  */
 
 #include <config.h>
+#include <task.h>
+#include <queue.h>
 #include <stm32/spi.h>
+#include <errno.h>
 
 #if USE_SPI1
 spi_t SPI1_Dev;
@@ -24,44 +27,86 @@ spi_t SPI2_Dev;
 spi_t SPI3_Dev;
 #endif
 
+/* Transactions this short, or shorter, are polled by spi_transact() */
+uint16_t spi_poll_max = SPI_POLL_MAX;
+
+/* Semaphores for spi_transact() to wait on, one per waiting task, handed
+ * out and back through a queue */
+static QueueHandle_t spi_waits;
+
 static void rx_isr(void *param, uint32_t flags);
 
 
+/* Claim one of the bus's DMA channels from the broker. The driver has no
+ * other way to move data, so the bus cannot run without it.
+ */
+static const dma_ch_t *
+_spi_dma_claim(spi_t *spi, dma_client_t *claim, int request, dma_isr_t isr)
+{
+    claim->name = "spi";
+    claim->request = request;
+    claim->priority = DMA_PRIO_SPI;
+    claim->flags = 0;
+    claim->irq_priority = IRQ_PRIO_SPI;
+    claim->isr = isr;
+    claim->param = spi;
+    if (dma_claim(claim))
+        HALT_WITH_MSG("SPI DMA channel in use");
+
+    return claim->ch;
+}
+
+
 void
 spi_start(spi_t *spi, uint32_t cr1)
 {
+    int tx_req, rx_req;
+
     ASSERT(spi->cs_pad != NULL);
     ASSERT((spi->sem = xSemaphoreCreateBinary()));
+    xSemaphoreGive(spi->sem);
+    spi->queue_head = spi->queue_tail = NULL;
+    spi->cur = NULL;
+    spi->held = NULL;
+    if (spi_waits == NULL) {
+        ASSERT((spi_waits = xQueueCreate(SPI_WAITERS, sizeof(SemaphoreHandle_t))));
+        for (int i = 0; i < SPI_WAITERS; i++) {
+            SemaphoreHandle_t wake;
+
+            ASSERT((wake = xSemaphoreCreateBinary()));
+            xQueueSend(spi_waits, &wake, 0);
+        }
+    }
 #if USE_SPI1
     if (spi == &SPI1_Dev) {
         spi->spi = SPI1;
-        spi->tx_dma = &dma_streams[2];
-        spi->rx_dma = &dma_streams[1];
+        tx_req = DMA_REQ_SPI1_TX;
+        rx_req = DMA_REQ_SPI1_RX;
     } else
 #endif
 #if USE_SPI2
     if (spi == &SPI2_Dev) {
         spi->spi = SPI2;
-        spi->tx_dma = &dma_streams[4];
-        spi->rx_dma = &dma_streams[3];
+        tx_req = DMA_REQ_SPI2_TX;
+        rx_req = DMA_REQ_SPI2_RX;
     } else
 #endif
 #if USE_SPI3
     if (spi == &SPI3_Dev) {
         spi->spi = SPI3;
-        spi->tx_dma = &dma_streams[8];
-        spi->rx_dma = &dma_streams[7];
+        tx_req = DMA_REQ_SPI3_TX;
+        rx_req = DMA_REQ_SPI3_RX;
     } else
 #endif
     {
         HALT();
     }
-    dma_allocate(spi->tx_dma, IRQ_PRIO_SPI, NULL, NULL);
-    dma_allocate(spi->rx_dma, IRQ_PRIO_SPI, rx_isr, spi);
+    spi->tx_dma = _spi_dma_claim(spi, &spi->tx_claim, tx_req, NULL);
+    spi->rx_dma = _spi_dma_claim(spi, &spi->rx_claim, rx_req, rx_isr);
     spi->tx_dma->ch->CPAR = (uint32_t)&spi->spi->DR;
     spi->rx_dma->ch->CPAR = (uint32_t)&spi->spi->DR;
-    spi->tx_dma_mode = DMA_CCR1_DIR;
-    spi->rx_dma_mode = DMA_CCR1_TCIE;
+    spi->tx_dma_mode = dma_client_pl(&spi->tx_claim) | DMA_CCR1_DIR;
+    spi->rx_dma_mode = dma_client_pl(&spi->rx_claim) | DMA_CCR1_TCIE | DMA_CCR1_TEIE;
     if (cr1 & SPI_CR1_DFF) {
         /* 16 bit mode */
         spi->tx_dma_mode |= DMA_CCR1_PSIZE_0 | DMA_CCR1_MSIZE_0;
@@ -81,50 +126,408 @@ spi_start(spi_t *spi, uint32_t cr1)
     spi->spi->CR1 |= SPI_CR1_SPE;
 }
 
+/* Rate the bus clocks at: PCLK2 for SPI1, PCLK1 for the rest, divided as
+ * CR1 says.
+ */
+uint32_t
+spi_clock(spi_t *spi)
+{
+    static const uint8_t apb_shift[8] = { 0, 0, 0, 0, 1, 2, 3, 4 };
+    uint32_t cfgr = RCC->CFGR;
+    uint32_t pclk;
+
+    if (spi->spi == SPI1)
+        pclk = SystemCoreClock >> apb_shift[(cfgr & RCC_CFGR_PPRE2) >> 11];
+    else
+        pclk = SystemCoreClock >> apb_shift[(cfgr & RCC_CFGR_PPRE1) >> 8];
+    return pclk >> (((spi->spi->CR1 & SPI_CR1_BR) >> 3) + 1);
+}
+
 static uint32_t tx_dummy;
 static uint32_t rx_dummy;
 
-void
-spi_exchange(spi_t *spi, const uint8_t *tx_buf, uint8_t *rx_buf, uint16_t size)
+/* Program both DMA channels for a transaction and start it. Call with the
+ * DMA interrupts masked.
+ */
+static void
+_spi_start(spi_t *spi, const spi_xfer_t *x)
 {
-    DISABLE_IRQ();
     dma_disable(spi->tx_dma);
     dma_disable(spi->rx_dma);
-    ENABLE_IRQ();
-    if (tx_buf != NULL) {
+    if (x->tx_buf != NULL) {
         spi->tx_dma->ch->CCR = spi->tx_dma_mode | DMA_CCR1_MINC;
-        spi->tx_dma->ch->CMAR = (uint32_t)tx_buf;
+        spi->tx_dma->ch->CMAR = (uint32_t)x->tx_buf;
     } else {
         spi->tx_dma->ch->CCR = spi->tx_dma_mode;
         spi->tx_dma->ch->CMAR = (uint32_t)&tx_dummy;
         tx_dummy = 0xFF;
     }
-    if (rx_buf != NULL) {
+    if (x->rx_buf != NULL) {
         spi->rx_dma->ch->CCR = spi->rx_dma_mode | DMA_CCR1_MINC;
-        spi->rx_dma->ch->CMAR = (uint32_t)rx_buf;
+        spi->rx_dma->ch->CMAR = (uint32_t)x->rx_buf;
     } else {
         spi->rx_dma->ch->CCR = spi->rx_dma_mode;
         spi->rx_dma->ch->CMAR = (uint32_t)&rx_dummy;
     }
-    spi->tx_dma->ch->CNDTR = size;
-    spi->rx_dma->ch->CNDTR = size;
-    DISABLE_IRQ();
+    spi->tx_dma->ch->CNDTR = x->size;
+    spi->rx_dma->ch->CNDTR = x->size;
     dma_enable(spi->tx_dma);
     dma_enable(spi->rx_dma);
-    ENABLE_IRQ();
+}
+
+
+/* Select a transaction's device, if the bus does not have it selected
+ * already. */
+static void
+_spi_select(spi_t *spi, const spi_xfer_t *x)
+{
+    if (x->dev != spi->held) {
+        if (spi->held != NULL)
+            spi_deselect(spi->held);
+        spi->held = NULL;
+    }
+    if (x->dev != NULL)
+        spi_select(x->dev);
+}
+
+
+/* Deselect a finished transaction's device, or hold it selected. */
+static void
+_spi_deselect(spi_t *spi, const spi_xfer_t *x, int err)
+{
+    if (x->dev == NULL)
+        return;
+
+    if ((x->flags & SPI_XFER_KEEP_CS) && !err) {
+        spi->held = x->dev;
+    } else {
+        spi_deselect(x->dev);
+        spi->held = NULL;
+    }
+}
+
+
+/* Select a transaction's device and start it. */
+static void
+_spi_run(spi_t *spi, spi_xfer_t *x)
+{
+    _spi_select(spi, x);
+    spi->cur = x;
+    _spi_start(spi, x);
+}
+
+
+/* Start the next list waiting for the bus, if it is free. While a device
+ * is held selected only its own lists may go, in the order queued. Call
+ * with the DMA interrupts masked.
+ */
+static void
+_spi_next(spi_t *spi)
+{
+    spi_xfer_t **pp = &spi->queue_head;
+    spi_xfer_t *prev = NULL;
+
+    if (spi->cur != NULL)
+        return;
+
+    while (*pp != NULL && spi->held != NULL && (*pp)->dev != spi->held) {
+        prev = *pp;
+        pp = &(*pp)->queue_next;
+    }
+    if (*pp == NULL)
+        return;
+
+    spi_xfer_t *x = *pp;
+
+    *pp = x->queue_next;
+    if (spi->queue_tail == x)
+        spi->queue_tail = prev;
+    x->queue_next = NULL;
+    _spi_run(spi, x);
+}
+
+
+/* Tell a transaction's owner it is over: call it back, wake a task in
+ * spi_transact() waiting for it, and let the next spi_exchange_async() go
+ * if it was one of those. The owner may reuse it as soon as it is told,
+ * so it is not touched after that. From the DMA interrupt. */
+static void
+_spi_finish(spi_t *spi, spi_xfer_t *x, int err, BaseType_t *wakeup)
+{
+    SemaphoreHandle_t wake = x->wake;
+
+    x->err = err;
+    x->queued = 0;
+    if (x->done != NULL)
+        x->done(x->param, err, wakeup);
+    if (wake != NULL)
+        xSemaphoreGiveFromISR(wake, wakeup);
+    else if (x == &spi->xfer)
+        xSemaphoreGiveFromISR(spi->sem, wakeup);
+}
+
+
+/* Check a list is fit to run. Returns 0, or -1 with errno set. */
+static int
+_spi_check(const spi_xfer_t *list)
+{
+    if (list == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (const spi_xfer_t *x = list; x != NULL; x = x->next) {
+        if (!x->size) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (x->queued) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* Queue a list, with wake to be given when its last transaction is over. */
+static int
+_spi_submit(spi_t *spi, spi_xfer_t *list, SemaphoreHandle_t wake)
+{
+    UBaseType_t mask;
+    spi_xfer_t *x;
+
+    if (_spi_check(list))
+        return -1;
+
+    for (x = list; ; x = x->next) {
+        x->queued = 1;
+        x->err = 0;
+        x->wake = NULL;
+        if (x->next == NULL)
+            break;
+    }
+    /* only the last one; the list runs in order */
+    x->wake = wake;
+    list->queue_next = NULL;
+
+    mask = portSET_INTERRUPT_MASK_FROM_ISR();
+    if (spi->queue_tail != NULL)
+        spi->queue_tail->queue_next = list;
+    else
+        spi->queue_head = list;
+    spi->queue_tail = list;
+    _spi_next(spi);
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+
+    return 0;
+}
+
+
+/* Queue a list of transactions on the bus and return at once. The list
+ * runs back to back, each transaction started from the DMA interrupt as
+ * the one before it finishes, after any lists already queued. If one
+ * fails, the rest of its list is called back with ECANCELED and the
+ * device is deselected. Lists for different devices can be queued from
+ * different tasks; chip select is managed here, and a device left
+ * selected with SPI_XFER_KEEP_CS keeps the bus until a transaction of its
+ * own deselects it. Call from a task or an ISR at or below
+ * configMAX_SYSCALL_INTERRUPT_PRIORITY. Returns 0, or -1 with errno set to
+ * EINVAL for an empty list or transaction, or EBUSY if one is still queued.
+ */
+int
+spi_submit(spi_t *spi, spi_xfer_t *list)
+{
+    return _spi_submit(spi, list, NULL);
+}
+
+
+/* Clock one transaction through the SPI's registers, an item at a time. */
+static void
+_spi_poll(spi_t *spi, const spi_xfer_t *x)
+{
+    SPI_TypeDef *reg = spi->spi;
+    int wide = reg->CR1 & SPI_CR1_DFF;
+
+    for (uint16_t i = 0; i < x->size; i++) {
+        uint16_t out = 0xFFFF, in;
+
+        if (x->tx_buf != NULL)
+            out = wide ? ((const uint16_t *)x->tx_buf)[i] : x->tx_buf[i];
+        while (!(reg->SR & SPI_SR_TXE))
+            ;
+        reg->DR = out;
+        while (!(reg->SR & SPI_SR_RXNE))
+            ;
+        in = reg->DR;
+        if (x->rx_buf == NULL)
+            continue;
+        if (wide)
+            ((uint16_t *)x->rx_buf)[i] = in;
+        else
+            x->rx_buf[i] = in;
+    }
+}
+
+
+/* Run a list by polling, if all of it is short and the bus is free for it
+ * now. Returns 0 if it has run, or -1 if it must be queued instead. */
+static int
+_spi_poll_list(spi_t *spi, spi_xfer_t *list)
+{
+    BaseType_t wakeup = pdFALSE;
+    UBaseType_t mask;
+    int ok;
+
+    for (spi_xfer_t *x = list; x != NULL; x = x->next)
+        if (x->size > spi_poll_max)
+            return -1;
+
+    /* keep the bus while polling, as a running transaction would */
+    mask = portSET_INTERRUPT_MASK_FROM_ISR();
+    ok = spi->cur == NULL && (spi->held == NULL || spi->held == list->dev);
+    if (ok)
+        spi->cur = list;
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+    if (!ok)
+        return -1;
+
+    spi->spi->CR2 &= ~(SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN);
+    if (spi->spi->SR & SPI_SR_RXNE)
+        (void)spi->spi->DR;
+
+    for (spi_xfer_t *x = list; x != NULL; x = x->next) {
+        _spi_select(spi, x);
+        _spi_poll(spi, x);
+        _spi_deselect(spi, x, 0);
+        x->err = 0;
+        if (x->done != NULL)
+            x->done(x->param, 0, &wakeup);
+    }
+
+    spi->spi->CR2 |= SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN;
+
+    mask = portSET_INTERRUPT_MASK_FROM_ISR();
+    spi->cur = NULL;
+    _spi_next(spi);
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+    if (wakeup)
+        taskYIELD();
+
+    return 0;
+}
+
+
+/* As spi_submit(), but wait for the list to finish. If every transaction
+ * is at most spi_poll_max items and the bus is free, the list is run
+ * there and then by polling instead, and done is called from here.
+ * Returns 0, or -1 with errno set as for spi_submit(), or to EIO if a
+ * transaction failed.
+ */
+int
+spi_transact(spi_t *spi, spi_xfer_t *list)
+{
+    SemaphoreHandle_t wake;
+
+    if (_spi_check(list))
+        return -1;
+
+    if (!_spi_poll_list(spi, list))
+        return 0;
+
+    xQueueReceive(spi_waits, &wake, portMAX_DELAY);
+    if (_spi_submit(spi, list, wake)) {
+        xQueueSend(spi_waits, &wake, 0);
+        return -1;
+    }
+    xSemaphoreTake(wake, portMAX_DELAY);
+    xQueueSend(spi_waits, &wake, 0);
+
+    for (spi_xfer_t *x = list; x != NULL; x = x->next) {
+        if (x->err) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* Exchange size items and wait for it to finish. Chip select is left to
+ * the caller, so this runs whenever no device is held selected. */
+void
+spi_exchange(spi_t *spi, const uint8_t *tx_buf, uint8_t *rx_buf, uint16_t size)
+{
+    spi_xfer_t x = {
+        .tx_buf = tx_buf,
+        .rx_buf = rx_buf,
+        .size   = size,
+    };
+
+    spi_transact(spi, &x);
+}
+
+
+/* Start an exchange and return at once; done is called from the DMA
+ * interrupt when it finishes. The buffers must be left alone until then.
+ * A following exchange on the same bus waits for this one to finish.
+ * Chip select is left to the caller, as for spi_exchange().
+ */
+void
+spi_exchange_async(spi_t *spi, const uint8_t *tx_buf, uint8_t *rx_buf, uint16_t size,
+                   dma_done_t done, void *param)
+{
     xSemaphoreTake(spi->sem, portMAX_DELAY);
+    spi->xfer.dev = NULL;
+    spi->xfer.tx_buf = tx_buf;
+    spi->xfer.rx_buf = rx_buf;
+    spi->xfer.size = size;
+    spi->xfer.flags = 0;
+    spi->xfer.done = done;
+    spi->xfer.param = param;
+    spi->xfer.next = NULL;
+    if (spi_submit(spi, &spi->xfer)) {
+        xSemaphoreGive(spi->sem);
+        if (done != NULL) {
+            BaseType_t wakeup = pdFALSE;
+
+            done(param, errno, &wakeup);
+        }
+    }
 }
 
 
+/* The receive channel has the last item of a transaction, so the bus is
+ * idle: start the next one before calling anyone back. */
 static void
 rx_isr(void *param, uint32_t flags)
 {
     BaseType_t wakeup = 0;
     spi_t *spi = (spi_t *)param;
+    spi_xfer_t *x = spi->cur;
+    int err = (flags & DMA_FLAG_TE) ? EIO : 0;
 
     dma_disable(spi->tx_dma);
     dma_disable(spi->rx_dma);
-    xSemaphoreGiveFromISR(spi->sem, &wakeup);
+    if (x == NULL)
+        return;
+
+    spi_xfer_t *next = err ? NULL : x->next;
+    spi_xfer_t *rest = err ? x->next : NULL;
+
+    _spi_deselect(spi, x, err);
+    spi->cur = NULL;
+    if (next != NULL)
+        _spi_run(spi, next);
+    else
+        _spi_next(spi);
+
+    _spi_finish(spi, x, err, &wakeup);
+    while (rest != NULL) {
+        spi_xfer_t *r = rest;
+
+        rest = rest->next;
+        _spi_finish(spi, r, ECANCELED, &wakeup);
+    }
     portEND_SWITCHING_ISR(wakeup);
 }
 
@@ -19,19 +19,83 @@
 #include <stm32/dma.h>
 
 
+#ifndef SPI_POLL_MAX
+/* transactions of up to this many items are clocked by polling the SPI's
+ * registers from the calling task, which beats setting up the DMA and
+ * waiting for its interrupt; see the spibench command */
+#define SPI_POLL_MAX    16
+#endif
+#ifndef SPI_WAITERS
+/* tasks that may wait in spi_transact() at once, over every bus; more
+ * wait for one of them to finish */
+#define SPI_WAITERS     4
+#endif
+
+/* A device on a bus, and the chip select that picks it */
+typedef struct {
+    const char          *name;
+    GPIO_TypeDef        *cs_pad;
+    uint8_t             cs_pin;
+} spi_dev_t;
+
+/* spi_xfer_t flags */
+#define SPI_XFER_KEEP_CS    0x1     /* leave the device selected afterwards */
+
+/* One transaction: select dev, clock size items out of tx_buf and into
+ * rx_buf, and deselect it again unless SPI_XFER_KEEP_CS is set. A NULL
+ * tx_buf sends 0xFF, a NULL rx_buf discards what arrives and a NULL dev
+ * leaves chip select to the caller. Transactions are linked through next
+ * into a list that spi_submit() runs back to back. done is called from the
+ * DMA interrupt when each one finishes, with the result also left in err,
+ * and the caller must leave it and its buffers alone while queued is set.
+ */
+typedef struct spi_xfer {
+    const spi_dev_t     *dev;
+    const uint8_t       *tx_buf;
+    uint8_t             *rx_buf;
+    uint16_t            size;
+    uint8_t             flags;          /* SPI_XFER_ */
+    volatile uint8_t    queued;
+    int                 err;            /* 0, or the errno it failed with */
+    dma_done_t          done;
+    void                *param;
+    struct spi_xfer     *next;
+
+    /* the list queued after this one, if this starts a list */
+    struct spi_xfer     *queue_next;
+    /* given when this one finishes, for spi_transact() to wait on */
+    SemaphoreHandle_t   wake;
+} spi_xfer_t;
+
 typedef struct {
     SPI_TypeDef         *spi;
     const dma_ch_t      *tx_dma;
     const dma_ch_t      *rx_dma;
+    dma_client_t        tx_claim;
+    dma_client_t        rx_claim;
     uint32_t            tx_dma_mode;
     uint32_t            rx_dma_mode;
 
     GPIO_TypeDef        *cs_pad;
     uint8_t             cs_pin;
 
+    /* lists waiting for the bus, by their first transaction, and the one
+     * running */
+    spi_xfer_t          *queue_head;
+    spi_xfer_t          *queue_tail;
+    spi_xfer_t          *volatile cur;
+    /* device left selected by a SPI_XFER_KEEP_CS transaction; only lists
+     * for it may run until it is deselected */
+    const spi_dev_t     *held;
+
+    /* the transaction spi_exchange_async() runs, and the lock on it; taken
+     * to start one and given back from the DMA interrupt once it is over */
     SemaphoreHandle_t   sem;
+    spi_xfer_t          xfer;
 } spi_t;
 
+extern uint16_t spi_poll_max;
+
 #if USE_SPI1
 extern spi_t SPI1_Dev;
 #endif
@@ -43,7 +107,12 @@ extern spi_t SPI3_Dev;
 #endif
 
 void spi_start(spi_t *spi, uint32_t cr1);
+uint32_t spi_clock(spi_t *spi);
 void spi_exchange(spi_t *spi, const uint8_t *tx_buf, uint8_t *rx_buf, uint16_t size);
+void spi_exchange_async(spi_t *spi, const uint8_t *tx_buf, uint8_t *rx_buf, uint16_t size,
+                        dma_done_t done, void *param);
+int spi_submit(spi_t *spi, spi_xfer_t *list);
+int spi_transact(spi_t *spi, spi_xfer_t *list);
 
 #if USE_SPI1
 void SPI1_IRQHandler(void) __attribute__ ((interrupt));
@@ -55,6 +124,7 @@ void SPI2_IRQHandler(void) __attribute__ ((interrupt));
 void SPI3_IRQHandler(void) __attribute__ ((interrupt));
 #endif
 
+/* Work the chip select of an spi_t's own device, or of an spi_dev_t */
 #define spi_select(spi) { (spi)->cs_pad->BRR = (1 << (spi)->cs_pin); }
 #define spi_deselect(spi) { (spi)->cs_pad->BSRR = (1 << (spi)->cs_pin); }
 
@@ -0,0 +1,960 @@
+/** Benchmarks
+ * \file src/bench.c
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+/// Request private declarations from posixio.h
+#define POSIXIO_PRIVATE
+
+#include <config.h>
+#include <cli/cli.h>
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+#include <posixio/posixio.h>
+#include <stm32/dwt.h>
+#include <stm32/serial.h>
+#include <stm32/dma.h>
+#include <stm32/spi.h>
+#include <misc/fmt.h>
+#include <misc/frame.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "bench.h"
+#include "serbench.h"
+
+/** Most tasks the I/O contention benchmark will start. */
+#define IOBENCH_MAX_TASKS   8
+
+/** Stack size of each I/O contention benchmark task. */
+#define STACK_SIZE_IOBENCH  (configMINIMAL_STACK_SIZE * 2)
+
+
+/** Parameters shared with each I/O contention benchmark task. */
+struct iobench {
+    int                 writes; ///< Number of writes each task makes.
+    SemaphoreHandle_t   done;   ///< Given by each task when it finishes.
+};
+
+/**
+ * Write handler for the benchmark device. It stands in for a slow
+ * peripheral by blocking for one tick per call, which is time other
+ * tasks should be free to spend in their own writes.
+ */
+static ssize_t bench_write(void *fh, const void *ptr, size_t len)
+{
+    vTaskDelay(1);
+    return len;
+}
+
+/** Open handler for the benchmark device; any name will do. */
+static void *bench_open(const char *name, int flags, ...)
+{
+    return (void *)name;
+}
+
+/** A do-nothing device that the I/O benchmarks can open files on. */
+static struct iodev iodev_bench = {
+    .name   = "bench",
+
+    .open   = bench_open,
+    .write  = bench_write,
+
+    .flags  = POSIXDEV_CHARACTER_STREAM
+};
+
+/** A task that opens its own file on the benchmark device and writes to it. */
+static void iobench_task(void *param)
+{
+    struct iobench *ib = (struct iobench *)param;
+    char name[24];
+    int fd;
+
+    snprintf(name, sizeof(name), "/bench/%p", (void *)xTaskGetCurrentTaskHandle());
+    fd = open(name, O_WRONLY);
+    if (fd != -1) {
+        for (int i = 0; i < ib->writes; i++)
+            write(fd, "x", 1);
+        close(fd);
+    }
+
+    xSemaphoreGive(ib->done);
+    vTaskDelete(NULL);
+}
+
+/**
+ * Command that measures how well writes to different descriptors run
+ * side by side. Each task makes a number of one-tick writes to its
+ * own file; if posixio serialized them, the run would take the sum of
+ * every task's time rather than the time of one task.
+ */
+static int cmd_iobench(struct cli *cli, int argc, const char *const *argv)
+{
+    struct iobench ib = { .writes = 50 };
+    int tasks = 4;
+    int c;
+
+    optind = 0;
+    opterr = 0;
+    while ((c = getopt(argc, (char *const *)argv, "t:n:")) != EOF) {
+        switch (c) {
+        case 't':     // number of tasks
+            tasks = atoi(optarg);
+            break;
+
+        case 'n':     // number of writes per task
+            ib.writes = atoi(optarg);
+            break;
+
+        case ':':
+            fprintf(cli->out, "Option \"%s\" requires a parameter." EOL,
+                    argv[optind - 1]);
+            return 1;
+
+        default:
+            fprintf(cli->out, "Unknown option \"%s\"." EOL, argv[optind - 1]);
+            return 1;
+        }
+    }
+
+    if (tasks < 1 || tasks > IOBENCH_MAX_TASKS || ib.writes < 1) {
+        fprintf(cli->out, "Need 1 to %d tasks and at least one write." EOL,
+                IOBENCH_MAX_TASKS);
+        return 1;
+    }
+
+    ib.done = xSemaphoreCreateCounting(tasks, 0);
+    if (ib.done == NULL) {
+        fprintf(cli->out, "Unable to create semaphore." EOL);
+        return 1;
+    }
+
+    TickType_t start = xTaskGetTickCount();
+
+    int started;
+    for (started = 0; started < tasks; started++) {
+        if (xTaskCreate(iobench_task, "iobench",
+                        STACK_SIZE_IOBENCH, &ib,
+                        THREAD_PRIO_CLI, NULL) != pdPASS)
+            break;
+    }
+
+    for (int i = 0; i < started; i++)
+        xSemaphoreTake(ib.done, portMAX_DELAY);
+
+    TickType_t elapsed = xTaskGetTickCount() - start;
+
+    vSemaphoreDelete(ib.done);
+
+    fprintf(cli->out, "%d tasks x %d writes: %lu ticks "
+                      "(serialized would be %lu, parallel %lu)." EOL,
+            started, ib.writes,
+            (unsigned long)elapsed,
+            (unsigned long)started * ib.writes,
+            (unsigned long)ib.writes);
+
+    return 0;
+}
+
+/** Running minimum, maximum and total of a set of cycle counts. */
+struct cycstat {
+    uint32_t    min;    ///< Smallest sample.
+    uint32_t    max;    ///< Largest sample.
+    uint64_t    total;  ///< Sum of all samples.
+};
+
+/** Add a sample to a \ref cycstat. */
+static void cycstat_add(struct cycstat *cs, uint32_t cycles)
+{
+    if (cycles < cs->min) cs->min = cycles;
+    if (cycles > cs->max) cs->max = cycles;
+    cs->total += cycles;
+}
+
+/** Print a \ref cycstat of \c n samples as a row of a table. */
+static void cycstat_print(FILE *out, const char *name, struct cycstat *cs, int n)
+{
+    fprintf(out, "%-8s %10lu %10lu %10lu %8lu" EOL, name,
+            (unsigned long)cs->min,
+            (unsigned long)(cs->total / n),
+            (unsigned long)cs->max,
+            (unsigned long)dwt_cycles_to_us(cs->max));
+}
+
+/**
+ * Command that measures the cost of opening and closing a file. The
+ * benchmark device does no work in either, so this is the overhead of
+ * posixio itself.
+ */
+static int cmd_openbench(struct cli *cli, int argc, const char *const *argv)
+{
+    struct cycstat op = { UINT32_MAX, 0, 0 }, cl = { UINT32_MAX, 0, 0 };
+    int count = 1000;
+    uint32_t t0, t1, t2;
+    int fd;
+
+    if (argc > 1)
+        count = atoi(argv[1]);
+    if (count < 1) {
+        fprintf(cli->out, "Need at least one iteration." EOL);
+        return 1;
+    }
+
+    dwt_start();
+
+    for (int i = 0; i < count; i++) {
+        t0 = dwt_cycles();
+        fd = open("/bench/open", O_RDWR);
+        t1 = dwt_cycles();
+        if (fd == -1) {
+            fprintf(cli->out, "open() failed after %d iterations." EOL, i);
+            return 1;
+        }
+        close(fd);
+        t2 = dwt_cycles();
+
+        cycstat_add(&op, t1 - t0);
+        cycstat_add(&cl, t2 - t1);
+    }
+
+    fprintf(cli->out, "%-8s %10s %10s %10s %8s" EOL,
+            "Op", "Min cyc", "Avg cyc", "Max cyc", "Max us");
+    cycstat_print(cli->out, "open", &op, count);
+    cycstat_print(cli->out, "close", &cl, count);
+
+    return 0;
+}
+
+/**
+ * Command that checks descriptors made by \c dup() and \c dup2() share
+ * the open file they were made from, using an anonymous pipe: data
+ * written through one must come out of the other, status flags set on
+ * one must show on the other and the pipe must only see end of file
+ * once every descriptor for its write end has been closed. An empty write
+ * must succeed.
+ */
+static int cmd_pipecheck(struct cli *cli, int argc, const char *const *argv)
+{
+    static const char msg[] = "dup";
+    char buf[sizeof(msg)];
+    int fds[2], rd = -1, wr = -1;
+    const char *fail = NULL;
+
+    if (pipe(fds) == -1) {
+        fprintf(cli->out, "pipe() failed: %s" EOL, strerror(errno));
+        return 1;
+    }
+
+    // an fd well clear of anything else in use
+    rd = dup2(fds[0], POSIXIO_MAX_OPEN_FILES - 1);
+    wr = dup(fds[1]);
+    if (rd == -1 || wr == -1) {
+        fail = "dup() or dup2()";
+        goto out;
+    }
+
+    if (write(wr, msg, 0) != 0) {
+        fail = "empty write";
+        goto out;
+    }
+
+    if (write(wr, msg, sizeof(msg)) != sizeof(msg) ||
+        read(fds[0], buf, sizeof(buf)) != sizeof(buf) ||
+        memcmp(buf, msg, sizeof(msg))) {
+        fail = "data through the duplicates";
+        goto out;
+    }
+
+    if (fcntl(rd, F_SETFL, O_NONBLOCK) == -1 ||
+        !(fcntl(fds[0], F_GETFL) & O_NONBLOCK)) {
+        fail = "shared status flags";
+        goto out;
+    }
+    if (read(rd, buf, sizeof(buf)) != -1 || errno != EAGAIN) {
+        fail = "non-blocking read of an empty pipe";
+        goto out;
+    }
+
+    // one writer left, so no end of file yet
+    close(fds[1]);
+    fds[1] = -1;
+    if (read(rd, buf, sizeof(buf)) != -1 || errno != EAGAIN) {
+        fail = "end of file with a writer open";
+        goto out;
+    }
+
+    close(wr);
+    wr = -1;
+    if (read(rd, buf, sizeof(buf)) != 0)
+        fail = "end of file once the writers closed";
+
+out:
+    if (fail != NULL)
+        fprintf(cli->out, "FAIL: %s (%s)" EOL, fail, strerror(errno));
+    else
+        fprintf(cli->out, "OK" EOL);
+
+    close(fds[0]);
+    if (fds[1] != -1) close(fds[1]);
+    if (rd != -1) close(rd);
+    if (wr != -1) close(wr);
+
+    return fail != NULL;
+}
+
+/** Find a serial port by number, if it is in use. */
+static serial_t *bench_serial(int port)
+{
+    switch (port) {
+#if USE_SERIAL_USART1
+    case 1: return &Serial1;
+#endif
+#if USE_SERIAL_USART2
+    case 2: return &Serial2;
+#endif
+#if USE_SERIAL_USART3
+    case 3: return &Serial3;
+#endif
+#if USE_SERIAL_UART4
+    case 4: return &Serial4;
+#endif
+#if USE_SERIAL_UART5
+    case 5: return &Serial5;
+#endif
+    default: return NULL;
+    }
+}
+
+/** Whether a baud rate a port reports is within 2% of the one set. */
+static int baud_close(unsigned int baud, unsigned int want)
+{
+    return (uint64_t)(baud > want ? baud - want : want - baud) * 50 <= want;
+}
+
+/**
+ * Check the frame device's \c ioctl() requests on a port: settings in
+ * range must be taken, those out of it refused, and the decoder counts
+ * read. The port is left with the default COBS framing and CRC-16.
+ *
+ * @returns \c NULL if all is well, else what failed.
+ */
+static const char *frame_ioctlcheck(const char *port)
+{
+    char path[32];
+    struct frame_stats stats;
+    const char *fail = NULL;
+    int fd;
+
+    snprintf(path, sizeof(path), "/frame/%s", port);
+    fd = open(path, O_RDWR);
+    if (fd == -1)
+        return "opening the frame device";
+
+    if (ioctl(fd, IOCTL_SETCODEC, FRAME_SLIP) == -1 ||
+        ioctl(fd, IOCTL_SETCHECK, FRAME_CRC32) == -1)
+        fail = "frame codec and check set";
+    else if (ioctl(fd, IOCTL_SETCODEC, FRAME_SLIP + 1) != -1 ||
+             errno != EINVAL ||
+             ioctl(fd, IOCTL_SETCHECK, FRAME_CRC32 + 1) != -1 ||
+             errno != EINVAL)
+        fail = "bad frame codec and check refused";
+
+    memset(&stats, 0xff, sizeof(stats));
+    if (fail == NULL && (ioctl(fd, IOCTL_GETFRAMESTATS, &stats) == -1 ||
+                         stats.frames == 0xffffffff))
+        fail = "IOCTL_GETFRAMESTATS";
+
+    ioctl(fd, IOCTL_SETCODEC, FRAME_COBS);
+    ioctl(fd, IOCTL_SETCHECK, FRAME_CRC16);
+    close(fd);
+
+    return fail;
+}
+
+/**
+ * Command that checks \c ioctl() requests reach a serial port's handler
+ * with their arguments intact: the port is moved to another baud rate
+ * and back, and each rate and read timing set must be read back. The
+ * receive error counts must match the driver's own. The port's frame
+ * device is checked too; see frame_ioctlcheck().
+ */
+static int cmd_ioctlcheck(struct cli *cli, int argc, const char *const *argv)
+{
+    char path[32];
+    unsigned int orig = 0, other, baud = 0;
+    unsigned int vmin, vtime, val;
+    struct serial_errors errs, now;
+    serial_t *serial = NULL;
+    const char *fail = NULL;
+    int fd;
+
+    if (argc == 2)
+        serial = bench_serial(atoi(argv[1]));
+    if (serial == NULL) {
+        fprintf(cli->out, "Usage: ioctlcheck <port>" EOL);
+        return 1;
+    }
+
+    snprintf(path, sizeof(path), "/serial/%s", argv[1]);
+    fd = open(path, O_RDWR);
+    if (fd == -1) {
+        fprintf(cli->out, "Unable to open %s." EOL, path);
+        return 1;
+    }
+
+    if (ioctl(fd, IOCTL_GETBAUD, &orig) == -1 || !orig) {
+        fail = "IOCTL_GETBAUD";
+        goto out;
+    }
+
+    other = baud_close(orig, 115200) ? 57600 : 115200;
+    if (ioctl(fd, IOCTL_SETBAUD, other) == -1 ||
+        ioctl(fd, IOCTL_GETBAUD, &baud) == -1 ||
+        !baud_close(baud, other)) {
+        fail = "baud rate set and read back";
+        goto out;
+    }
+
+    if (ioctl(fd, IOCTL_GETVMIN, &vmin) == -1 ||
+        ioctl(fd, IOCTL_GETVTIME, &vtime) == -1) {
+        fail = "IOCTL_GETVMIN or IOCTL_GETVTIME";
+        goto out;
+    }
+    if (ioctl(fd, IOCTL_SETVMIN, vmin + 7) == -1 ||
+        ioctl(fd, IOCTL_GETVMIN, &val) == -1 || val != vmin + 7 ||
+        ioctl(fd, IOCTL_SETVTIME, vtime + 3) == -1 ||
+        ioctl(fd, IOCTL_GETVTIME, &val) == -1 || val != vtime + 3) {
+        fail = "VMIN and VTIME set and read back";
+        goto out;
+    }
+    ioctl(fd, IOCTL_SETVMIN, vmin);
+    ioctl(fd, IOCTL_SETVTIME, vtime);
+
+    // the counts only grow, so must be no more than the driver's after
+    memset(&errs, 0xff, sizeof(errs));
+    if (ioctl(fd, IOCTL_GETERRORS, &errs) == -1) {
+        fail = "IOCTL_GETERRORS";
+        goto out;
+    }
+    serial_get_errors(serial, &now);
+    if (errs.overrun > now.overrun || errs.noise > now.noise ||
+        errs.framing > now.framing || errs.parity > now.parity ||
+        errs.dropped > now.dropped) {
+        fail = "receive error counts";
+        goto out;
+    }
+
+    fail = frame_ioctlcheck(argv[1]);
+
+out:
+    if (orig && (ioctl(fd, IOCTL_SETBAUD, orig) == -1 ||
+                 ioctl(fd, IOCTL_GETBAUD, &baud) == -1 ||
+                 !baud_close(baud, orig)) && fail == NULL)
+        fail = "baud rate restored";
+    close(fd);
+
+    if (fail != NULL)
+        fprintf(cli->out, "FAIL: %s (%s)" EOL, fail, strerror(errno));
+    else
+        fprintf(cli->out, "OK" EOL);
+
+    return fail != NULL;
+}
+
+/**
+ * Command that compares the cost of formatting a typical telemetry line
+ * with the fmt engine against newlib's \c snprintf().
+ */
+static int cmd_fmtbench(struct cli *cli, int argc, const char *const *argv)
+{
+    struct cycstat fm = { UINT32_MAX, 0, 0 }, nl = { UINT32_MAX, 0, 0 };
+    static const char line[] =
+        "t=%lu ax=%6d ay=%6d az=%6d temp=%.2f flags=%08lx src=%s" EOL;
+    char a[96], b[96];
+    int count = 1000;
+    uint32_t t0, t1, t2;
+
+    if (argc > 1)
+        count = atoi(argv[1]);
+    if (count < 1) {
+        fprintf(cli->out, "Need at least one iteration." EOL);
+        return 1;
+    }
+
+    dwt_start();
+
+    for (int i = 0; i < count; i++) {
+        unsigned long t = xTaskGetTickCount();
+        int ax = i * 7 - 2000, ay = -i, az = i * 31;
+        double temp = 21.5 + i / 100.0;
+
+        t0 = dwt_cycles();
+        fmt_snprintf(a, sizeof(a), line, t, ax, ay, az, temp, 0xa5UL, "imu0");
+        t1 = dwt_cycles();
+        snprintf(b, sizeof(b), line, t, ax, ay, az, temp, 0xa5UL, "imu0");
+        t2 = dwt_cycles();
+
+        cycstat_add(&fm, t1 - t0);
+        cycstat_add(&nl, t2 - t1);
+
+        if (strcmp(a, b)) {
+            fprintf(cli->out, "Output differs:" EOL "  fmt:    %s  newlib: %s", a, b);
+            return 1;
+        }
+    }
+
+    fprintf(cli->out, "%-8s %10s %10s %10s %8s" EOL,
+            "Engine", "Min cyc", "Avg cyc", "Max cyc", "Max us");
+    cycstat_print(cli->out, "fmt", &fm, count);
+    cycstat_print(cli->out, "newlib", &nl, count);
+
+    return 0;
+}
+
+/** Largest transfer the DMA memcpy benchmark tries. */
+#define DMABENCH_MAX_SIZE   4096
+
+/** Called from the DMA interrupt when a benchmark transfer is done. */
+static void dmabench_done(void *param, int err, BaseType_t *wakeup)
+{
+    xSemaphoreGiveFromISR((SemaphoreHandle_t)param, wakeup);
+}
+
+/**
+ * Command that compares copies and fills done by the CPU with those done
+ * by a memory to memory DMA channel, to show where dma_mem_min_size
+ * should sit. For the DMA it reports both the time until the waiting task
+ * hears the transfer is done and the time the CPU spent setting it up,
+ * which is all it pays if it has other work to do meanwhile.
+ */
+static int cmd_dmabench(struct cli *cli, int argc, const char *const *argv)
+{
+    static const uint16_t sizes[] = { 16, 64, 256, 1024, DMABENCH_MAX_SIZE };
+    static const char *const ops[] = { "memcpy", "memcpy+1", "memset" };
+    size_t min_size = dma_mem_min_size;
+    SemaphoreHandle_t sem = NULL;
+    uint8_t *src = NULL, *dst = NULL;
+    int count = 100;
+    int ret = 1;
+
+    if (argc > 1)
+        count = atoi(argv[1]);
+    if (count < 1) {
+        fprintf(cli->out, "Need at least one iteration." EOL);
+        return 1;
+    }
+
+    src = malloc(DMABENCH_MAX_SIZE + 4);
+    dst = malloc(DMABENCH_MAX_SIZE + 4);
+    sem = xSemaphoreCreateBinary();
+    if (src == NULL || dst == NULL || sem == NULL) {
+        fprintf(cli->out, "Out of memory." EOL);
+        goto out;
+    }
+    for (int i = 0; i < DMABENCH_MAX_SIZE + 4; i++)
+        src[i] = (uint8_t)(i * 13 + 7);
+
+    dwt_start();
+    dma_mem_min_size = 0;
+
+    fprintf(cli->out, "%-8s %5s %10s %10s %10s" EOL,
+            "Op", "Size", "CPU cyc", "DMA cyc", "Call cyc");
+
+    for (unsigned int op = 0; op < sizeof(ops) / sizeof(ops[0]); op++) {
+        // memcpy+1 copies from an odd address, so goes a byte at a time
+        const uint8_t *from = src + (op == 1);
+
+        for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            uint16_t size = sizes[s];
+            uint64_t cpu = 0, dma = 0, call = 0;
+            uint32_t t0, t1, t2;
+
+            for (int i = 0; i < count; i++) {
+                t0 = dwt_cycles();
+                if (op == 2)
+                    memset(dst, 0x5a, size);
+                else
+                    memcpy(dst, from, size);
+                t1 = dwt_cycles();
+                cpu += t1 - t0;
+
+                memset(dst, 0, size);
+                t0 = dwt_cycles();
+                if (op == 2)
+                    dma_memset_async(dst, 0xa5, size, dmabench_done, sem);
+                else
+                    dma_memcpy_async(dst, from, size, dmabench_done, sem);
+                t1 = dwt_cycles();
+                xSemaphoreTake(sem, portMAX_DELAY);
+                t2 = dwt_cycles();
+                call += t1 - t0;
+                dma += t2 - t0;
+
+                if (op == 2 ? dst[0] != 0xa5 || dst[size - 1] != 0xa5
+                            : memcmp(dst, from, size)) {
+                    fprintf(cli->out, "DMA %s of %u bytes came out wrong." EOL,
+                            ops[op], size);
+                    goto out;
+                }
+            }
+
+            fprintf(cli->out, "%-8s %5u %10lu %10lu %10lu" EOL, ops[op], size,
+                    (unsigned long)(cpu / count),
+                    (unsigned long)(dma / count),
+                    (unsigned long)(call / count));
+        }
+    }
+
+    fprintf(cli->out, "Transfers under %u bytes are left to the CPU." EOL,
+            (unsigned int)min_size);
+    ret = 0;
+
+out:
+    dma_mem_min_size = min_size;
+    if (sem != NULL)
+        vSemaphoreDelete(sem);
+    free(src);
+    free(dst);
+    return ret;
+}
+
+/** Largest exchange the SPI benchmark tries. */
+#define SPIBENCH_MAX_SIZE   512
+
+/** Find an SPI bus by number, if it is in use. */
+static spi_t *bench_spi(int bus)
+{
+    switch (bus) {
+#if USE_SPI1
+    case 1: return &SPI1_Dev;
+#endif
+#if USE_SPI2
+    case 2: return &SPI2_Dev;
+#endif
+#if USE_SPI3
+    case 3: return &SPI3_Dev;
+#endif
+    default: return NULL;
+    }
+}
+
+/**
+ * Command that times SPI exchanges of several sizes done by polling and
+ * by DMA, to show where spi_poll_max should sit at the bus's clock rate.
+ * No chip select is asserted, so devices on the bus ignore the traffic.
+ */
+static int cmd_spibench(struct cli *cli, int argc, const char *const *argv)
+{
+    static const uint16_t sizes[] = { 1, 2, 4, 8, 16, 32, 64, 128, SPIBENCH_MAX_SIZE };
+    uint16_t poll_max = spi_poll_max;
+    uint16_t crossover = 0;
+    uint8_t *tx = NULL, *rx = NULL;
+    int bus = 0, count = 100;
+    spi_t *spi;
+    int c;
+
+    optind = 0;
+    opterr = 0;
+    while ((c = getopt(argc, (char *const *)argv, "b:n:")) != EOF) {
+        switch (c) {
+        case 'b':     // bus number
+            bus = atoi(optarg);
+            break;
+
+        case 'n':     // exchanges per size
+            count = atoi(optarg);
+            break;
+
+        case ':':
+            fprintf(cli->out, "Option \"%s\" requires a parameter." EOL,
+                    argv[optind - 1]);
+            return 1;
+
+        default:
+            fprintf(cli->out, "Unknown option \"%s\"." EOL, argv[optind - 1]);
+            return 1;
+        }
+    }
+
+    if (!bus) {
+        for (bus = 1; bus <= 3 && bench_spi(bus) == NULL; bus++)
+            ;
+    }
+    spi = bench_spi(bus);
+    if (spi == NULL) {
+        fprintf(cli->out, "No SPI bus to use; enable one in config.h." EOL);
+        return 1;
+    }
+    if (count < 1) {
+        fprintf(cli->out, "Need at least one iteration." EOL);
+        return 1;
+    }
+
+    tx = malloc(SPIBENCH_MAX_SIZE);
+    rx = malloc(SPIBENCH_MAX_SIZE);
+    if (tx == NULL || rx == NULL) {
+        fprintf(cli->out, "Out of memory." EOL);
+        free(tx);
+        free(rx);
+        return 1;
+    }
+    memset(tx, 0xFF, SPIBENCH_MAX_SIZE);
+
+    dwt_start();
+    fprintf(cli->out, "SPI%d at %lu Hz, polling up to %u items" EOL, bus,
+            (unsigned long)spi_clock(spi), poll_max);
+    fprintf(cli->out, "%5s %10s %10s" EOL, "Size", "Poll cyc", "DMA cyc");
+
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint64_t poll = 0, dma = 0;
+        uint32_t t0;
+
+        for (int i = 0; i < count; i++) {
+            spi_poll_max = UINT16_MAX;
+            t0 = dwt_cycles();
+            spi_exchange(spi, tx, rx, sizes[s]);
+            poll += dwt_cycles() - t0;
+
+            spi_poll_max = 0;
+            t0 = dwt_cycles();
+            spi_exchange(spi, tx, rx, sizes[s]);
+            dma += dwt_cycles() - t0;
+        }
+        if (!crossover && dma < poll)
+            crossover = sizes[s];
+
+        fprintf(cli->out, "%5u %10lu %10lu" EOL, sizes[s],
+                (unsigned long)(poll / count), (unsigned long)(dma / count));
+    }
+    spi_poll_max = poll_max;
+
+    if (crossover)
+        fprintf(cli->out, "DMA is quicker from %u items." EOL, crossover);
+    else
+        fprintf(cli->out, "Polling was quicker at every size." EOL);
+
+    free(tx);
+    free(rx);
+    return 0;
+}
+
+/**
+ * Command that measures serial throughput, interrupt load, receive
+ * latency and transmit stalls on a port looped back on itself; see
+ * serbench.c.
+ */
+static int cmd_serbench(struct cli *cli, int argc, const char *const *argv)
+{
+    static const uint16_t default_sizes[] = { 1, 16, 64, 256, 1024 };
+    uint16_t sizes[8];
+    struct serbench_cfg cfg = {
+        .sizes  = default_sizes,
+        .nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]),
+        .bytes  = 16384,
+        .pings  = 16,
+        .paths  = SERBENCH_DMA | SERBENCH_IRQ,
+    };
+    serial_t *serial = NULL;
+    int port = 0;
+    int c;
+
+    optind = 0;
+    opterr = 0;
+    while ((c = getopt(argc, (char *const *)argv, "p:b:n:s:m:")) != EOF) {
+        switch (c) {
+        case 'p':     // port number
+            port = atoi(optarg);
+            break;
+
+        case 'b':     // bytes streamed per size
+            cfg.bytes = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'n':     // round trips per size
+            cfg.pings = atoi(optarg);
+            break;
+
+        case 's': {   // comma separated message sizes
+            const char *p = optarg;
+
+            cfg.sizes = sizes;
+            cfg.nsizes = 0;
+            while (*p && cfg.nsizes < (int)(sizeof(sizes) / sizeof(sizes[0]))) {
+                char *end;
+
+                sizes[cfg.nsizes++] = strtoul(p, &end, 0);
+                p = *end == ',' ? end + 1 : end + strlen(end);
+            }
+            break;
+        }
+
+        case 'm':     // transfer paths
+            if (!strcmp(optarg, "dma"))
+                cfg.paths = SERBENCH_DMA;
+            else if (!strcmp(optarg, "irq"))
+                cfg.paths = SERBENCH_IRQ;
+            else
+                cfg.paths = SERBENCH_DMA | SERBENCH_IRQ;
+            break;
+
+        case ':':
+            fprintf(cli->out, "Option \"%s\" requires a parameter." EOL,
+                    argv[optind - 1]);
+            return 1;
+
+        default:
+            fprintf(cli->out, "Unknown option \"%s\"." EOL, argv[optind - 1]);
+            return 1;
+        }
+    }
+
+    // USART1 carries the console, so by default take the first other port
+    if (!port) {
+        for (port = 2; port <= 5 && bench_serial(port) == NULL; port++)
+            ;
+    } else if (port == 1) {
+        fprintf(cli->out, "USART1 carries the console." EOL);
+        return 1;
+    }
+
+    serial = bench_serial(port);
+    if (serial == NULL) {
+        fprintf(cli->out, "No serial port to use; enable one of ports 2 to 5 "
+                          "in config.h." EOL);
+        return 1;
+    }
+
+    if (cfg.bytes < 1 || cfg.pings < 0) {
+        fprintf(cli->out, "Need at least one byte and no negative pings." EOL);
+        return 1;
+    }
+
+    fprintf(cli->out, "Port %d at %u baud, looped back" EOL, port, serial->baud);
+    return serbench_run(cli->out, serial, &cfg) ? 1 : 0;
+}
+
+/** Register the benchmark device and commands. */
+void bench_init(void)
+{
+    posixio_register_dev(&iodev_bench);
+
+    struct cli_command iobench = {
+        .cmd    = "iobench",
+        .brief  = "Measure concurrent writes to separate descriptors",
+        .help   = "Starts several tasks that each write to their own file " \
+                  "on a device that blocks for one tick per write, and " \
+                  "reports how long they took together." EOL EOL \
+                  "Options:" EOL \
+                  "  -t <tasks>    Number of writer tasks (default 4)." EOL \
+                  "  -n <writes>   Number of writes per task (default 50).",
+        .fn     = cmd_iobench,
+    };
+    cli_addcmd(&iobench);
+
+    struct cli_command openbench = {
+        .cmd    = "openbench",
+        .brief  = "Measure open() and close() latency",
+        .help   = "Opens and closes a file on the benchmark device many " \
+                  "times and reports the cost of each in CPU cycles." EOL EOL \
+                  "Usage: openbench [iterations]",
+        .fn     = cmd_openbench,
+    };
+    cli_addcmd(&openbench);
+
+    struct cli_command pipecheck = {
+        .cmd    = "pipecheck",
+        .brief  = "Check dup() and dup2() of a pipe",
+        .help   = "Makes a pipe, duplicates both ends and checks that data, " \
+                  "status flags and end of file are shared by each end's " \
+                  "descriptors, as they are by open files." EOL EOL \
+                  "Usage: pipecheck",
+        .fn     = cmd_pipecheck,
+    };
+    cli_addcmd(&pipecheck);
+
+    struct cli_command ioctlcheck = {
+        .cmd    = "ioctlcheck",
+        .brief  = "Check serial ioctl() requests",
+        .help   = "Sets a serial port to another baud rate and back through " \
+                  "ioctl() and changes its read minimum and idle time, " \
+                  "checking each setting can be read back, then checks its " \
+                  "receive error counts against the driver's. Then checks " \
+                  "the port's frame device settings, leaving it with COBS " \
+                  "framing and CRC-16. Anything sent on the port meanwhile " \
+                  "is garbled." EOL EOL \
+                  "Usage: ioctlcheck <port>",
+        .fn     = cmd_ioctlcheck,
+    };
+    cli_addcmd(&ioctlcheck);
+
+    struct cli_command fmtbench = {
+        .cmd    = "fmtbench",
+        .brief  = "Compare the fmt printf engine with newlib",
+        .help   = "Formats a telemetry line many times with fmt_snprintf() " \
+                  "and with newlib's snprintf(), checks they agree and " \
+                  "reports the cost of each in CPU cycles." EOL EOL \
+                  "Usage: fmtbench [iterations]",
+        .fn     = cmd_fmtbench,
+    };
+    cli_addcmd(&fmtbench);
+
+    struct cli_command dmabench = {
+        .cmd    = "dmabench",
+        .brief  = "Compare DMA and CPU memcpy and memset",
+        .help   = "Copies and fills buffers of several sizes with the CPU " \
+                  "and with a memory to memory DMA channel, checks the " \
+                  "results and reports the cost of each in CPU cycles. For " \
+                  "the DMA, \"DMA cyc\" is until the waiting task has been " \
+                  "told it is done and \"Call cyc\" is the time spent " \
+                  "starting it." EOL EOL \
+                  "Usage: dmabench [iterations]",
+        .fn     = cmd_dmabench,
+    };
+    cli_addcmd(&dmabench);
+
+    struct cli_command spibench = {
+        .cmd    = "spibench",
+        .brief  = "Compare polled and DMA SPI exchanges",
+        .help   = "Times SPI exchanges of several sizes done by polling the " \
+                  "SPI's registers and done by DMA, in CPU cycles per " \
+                  "call, and reports the size from which DMA is quicker. " \
+                  "No device is selected while it runs." EOL EOL \
+                  "Options:" EOL \
+                  "  -b <bus>      SPI bus to use (default the first enabled)." EOL \
+                  "  -n <count>    Exchanges per size (default 100).",
+        .fn     = cmd_spibench,
+    };
+    cli_addcmd(&spibench);
+
+    struct cli_command serbench = {
+        .cmd    = "serbench",
+        .brief  = "Measure serial throughput and latency",
+        .help   = "Loops a serial port back on itself and streams messages " \
+                  "through it, over DMA and a byte at a time by interrupt, " \
+                  "reporting throughput, interrupts per KB, interrupt to " \
+                  "task latency and time the writer spent stalled. The " \
+                  "port must not be in use for anything else." EOL EOL \
+                  "Options:" EOL \
+                  "  -p <port>     Serial port, 2 to 5 (default the first in use)." EOL \
+                  "  -b <bytes>    Bytes streamed at each size (default 16384)." EOL \
+                  "  -n <pings>    Round trips timed at each size (default 16)." EOL \
+                  "  -s <sizes>    Comma separated message sizes (default 1,16,64,256,1024)." EOL \
+                  "  -m <path>     dma, irq or both (default both).",
+        .fn     = cmd_serbench,
+    };
+    cli_addcmd(&serbench);
+}
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -0,0 +1,17 @@
+/** Benchmarks
+ * \file src/bench.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+void bench_init(void);
+
+#endif /* _BENCH_H */
@@ -16,11 +16,15 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stm32/serial.h>
+#include <stm32f10x_rcc.h>
+#include <misc/fmt.h>
 
 #include "stdio_init.h"
 
 #ifdef DEBUG
 
+static void dbg_write(void *ctx, const char *s, size_t len);
+
 /**
  * Initialize the debug routines.
  * This does a basic setup of USART1.
@@ -36,9 +40,14 @@ void dbg_init(void)
     // PA9 = output
     GPIOA->CRH = 0x000004B0;
 
+    // USART1 is clocked by PCLK2
+    RCC_ClocksTypeDef clocks;
+    RCC_GetClocksFreq(&clocks);
+
     USART_TypeDef *usart = USART1;
     usart->CR1 = USART_CR1_UE;
-    usart->BRR = 72000000 / 9600;
+    usart->BRR = serial_calc_brr(clocks.PCLK2_Frequency, DEFAULT_USART_BAUD,
+                                 NULL, NULL);
     usart->CR3 = 0;
     usart->CR2 = 0;
     usart->CR1 = USART_CR1_UE | USART_CR1_TE | USART_CR1_RE;
@@ -53,8 +62,6 @@ void dbg_init(void)
  */
 void dbg(const char *msg)
 {
-    const char *p = msg;
-
 #if USE_SERIAL_USART1 && 0
     if (stdio_started) {
         serial_write(&Serial1, msg, strlen(msg));
@@ -62,9 +69,18 @@ void dbg(const char *msg)
     }
 #endif
 
-    while (*p) {
+    dbg_write(NULL, msg, strlen(msg));
+}
+
+/**
+ * Output callback for dbgf(), which sends each piece of formatted text
+ * to the debugging console as it is produced.
+ */
+static void dbg_write(void *ctx, const char *s, size_t len)
+{
+    while (len--) {
         // Send byte
-        USART1->DR = ((uint16_t)*(p++)) & 0x00ff;
+        USART1->DR = ((uint16_t)*(s++)) & 0x00ff;
         // Wait for it to have been sent
         while (!(USART1->SR & USART_SR_TXE)) ;
     }
@@ -72,19 +88,19 @@ void dbg(const char *msg)
 
 /**
  * A printf-like method to send messages to the debugging console.
+ * It needs no buffer, so it is safe to call from fault handlers and
+ * from any task.
  *
  * @param fmt Formatting string to use.
  * @param ... Printf-style parameters.
  */
 void dbgf(const char *fmt, ...)
 {
-    static char buf[128];
     va_list ap;
 
     va_start(ap, fmt);
-    vsnprintf(buf, 128, fmt, ap);
+    fmt_vformat(dbg_write, NULL, fmt, ap);
     va_end(ap);
-    dbg(buf);
 }
 
 #else /* !DEBUG */
@@ -13,15 +13,21 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 
 #include "lcd.h"
 
 #include <stm32/dma.h>
 
-/** DMA channel number to use for LCD framebuffer transfers. */
-#define LCD_DMA_CHANNEL 0
-/** Reference to the DMA structure used for the LCD DMA channel. */
-const dma_ch_t *lcd_dma = &dma_streams[LCD_DMA_CHANNEL];
+/** Our claim on a memory to memory DMA channel for framebuffer transfers. */
+static dma_client_t lcd_dma_claim = {
+    .name           = "lcd",
+    .request        = DMA_REQ_MEM,
+    .priority       = DMA_PRIO_LCD,
+    .irq_priority   = 10,
+};
+/** The DMA channel the broker gave us for framebuffer transfers. */
+const dma_ch_t *lcd_dma;
 
 /** The size of the framebuffer, in RGB words (16 bits) */
 #define FRAMEBUFFER_SIZE (LCD_PIXEL_WIDTH * LCD_PIXEL_HEIGHT)
@@ -32,11 +38,8 @@ const dma_ch_t *lcd_dma = &dma_streams[LCD_DMA_CHANNEL];
 uint8_t lcd_framebuffer[FRAMEBUFFER_SIZE * sizeof(uint16_t)] \
     SECTION_FSMC_BANK1_3("lcd_framebuffer") ALIGN(4);
 
-/** The section of the screen most recently refreshed; 0 or 1. */
-static volatile uint16_t lcd_bank;
-
-static void lcd_start_dma(uint32_t start, uint16_t length);
-static void lcd_refresh_interrupt(void *param, uint32_t flags);
+/** The DMA transfers for a refresh, one per half of the screen. */
+static dma_desc_t lcd_desc[2];
 
 /** Initialize the LCD system */
 void lcd_init(void)
@@ -47,7 +50,9 @@ void lcd_init(void)
     STM3210E_LCD_Init();
     LCD_Clear(LCD_COLOR_BLACK);
 
-    dma_allocate(lcd_dma, 10, lcd_refresh_interrupt, NULL);
+    if (dma_claim(&lcd_dma_claim))
+        HALT_WITH_MSG("no DMA channel for the LCD");
+    lcd_dma = lcd_dma_claim.ch;
 }
 
 /** Manually refresh the framebuffer onto the LCD */
@@ -56,58 +61,55 @@ void lcd_refresh(void)
     LCD_Bitblt(lcd_framebuffer);
 }
 
-/**
- * Trigger a DMA action to copy data from the framebuffer
- * to the LCD.
- * @param start The address in memory to start the transfer from
- * @param length The number of words to transfer. For this routine words
- *      are 16-bits long.
- */
-void lcd_start_dma(uint32_t start, uint16_t length)
-{
-    lcd_dma->ch->CMAR = start;
-    lcd_dma->ch->CNDTR = length;
-    dma_enable(lcd_dma);
-}
-
 /**
  * Manually trigger a refresh of the framebuffer to the LCD using
  * DMA transfers. Because of transfer size limitations, the LCD
- * is refreshed in two DMA transfers of half the screen each. This
- * function triggers the first half; the second half is triggered when
- * the first half completes.
+ * is refreshed in two DMA transfers of half the screen each, queued
+ * together so the second starts as soon as the first completes.
  */
 void lcd_refresh_dma(void)
 {
-    lcd_bank = 0;
-
-    dma_disable(lcd_dma);   // just in case
-
-    lcd_dma->ch->CCR =
-        DMA_CCR1_MEM2MEM |
-        DMA_CCR1_MINC |
-        DMA_CCR1_PL_1 |
-        DMA_CCR1_MSIZE_0 |
-        DMA_CCR1_PSIZE_0 |
-        DMA_CCR1_TEIE |
-        DMA_CCR1_TCIE |
-        DMA_CCR1_DIR;
-
-    lcd_dma->ch->CPAR = (uint32_t)LCD_DMA_Prepare();
-
-    lcd_start_dma((uint32_t)lcd_framebuffer, LCD_DMA_SIZE);
+    lcd_refresh_dma_async(NULL, NULL);
 }
 
 /**
- * DMA transfer complete event. If only the first half of the
- * framebuffer was copied, trigger a transfer of the second half.
+ * As \ref lcd_refresh_dma, but calls \c done from the DMA interrupt
+ * once the whole framebuffer has been copied to the LCD. The
+ * framebuffer can then be drawn on again without tearing. A refresh
+ * still in progress is abandoned, and its \c done called with
+ * \c ECANCELED.
+ *
+ * @param done Function to call on completion, or \c NULL.
+ * @param param Passed to \c done.
  */
-static void lcd_refresh_interrupt(void *param, uint32_t flags)
+void lcd_refresh_dma_async(dma_done_t done, void *param)
 {
-    dma_disable(lcd_dma);
-    if (lcd_bank == 0) {
-        lcd_bank = 1;
-        lcd_start_dma((uint32_t)lcd_framebuffer + LCD_DMA_SIZE, LCD_DMA_SIZE);
+    uint32_t lcd_ram;
+
+    dma_flush(&lcd_dma_claim);
+    lcd_ram = (uint32_t)LCD_DMA_Prepare();
+
+    for (int i = 0; i < 2; i++) {
+        lcd_desc[i].ccr =
+            DMA_CCR1_MEM2MEM |
+            DMA_CCR1_MINC |
+            DMA_CCR1_MSIZE_0 |
+            DMA_CCR1_PSIZE_0 |
+            DMA_CCR1_DIR;
+        lcd_desc[i].cpar = lcd_ram;
+        lcd_desc[i].cmar = (uint32_t)lcd_framebuffer
+                           + i * LCD_DMA_SIZE * sizeof(uint16_t);
+        lcd_desc[i].cndtr = LCD_DMA_SIZE;
+    }
+    lcd_desc[0].next = &lcd_desc[1];
+    lcd_desc[1].next = NULL;
+    lcd_desc[1].done = done;
+    lcd_desc[1].param = param;
+
+    if (dma_submit(&lcd_dma_claim, lcd_desc) && done != NULL) {
+        BaseType_t wakeup = pdFALSE;
+
+        done(param, errno, &wakeup);
     }
 }
 
@@ -14,12 +14,14 @@
 
 #include <stdint.h>
 #include <stm3210e_eval_lcd.h>
+#include <stm32/dma.h>
 
 extern uint8_t lcd_framebuffer[];
 
 void lcd_init(void);
 void lcd_refresh(void);
 void lcd_refresh_dma(void);
+void lcd_refresh_dma_async(dma_done_t done, void *param);
 int32_t lcd_parsecolor(char *str);
 
 #endif /* _LCD_H */
@@ -28,6 +28,7 @@
 #include "led.h"
 #include "fonts.h"
 #include "lcd.h"
+#include "bench.h"
 
 
 static void main_task(void *param);
@@ -79,6 +80,9 @@ void NORETURN main_task(void *param)
     font_init();
     lcd_init();
 
+    // Benchmarks
+    bench_init();
+
     // announce life!
     printf("This platform is running!" EOL);
     fflush(stdout);
@@ -99,13 +103,16 @@ static void platform_init(void)
     // Bootstrap the POSIX IO platform
     posixio_start();
 
+    // Register the DMA memory to memory engines
+    dma_mem_init();
+
     // Initialize USARTs
 #if configUSE_QUEUE_SETS
     qs_serial = xQueueCreateSet(16);
     ASSERT(qs_serial != NULL);
 #endif
 #if USE_SERIAL_USART1
-    serial_start(&Serial1, DEFAULT_USART_BAUD
+    serial_start(&Serial1, DEFAULT_USART_BAUD, SERIAL_FLOW_NONE
 #if configUSE_QUEUE_SETS
                  , qs_serial
 #endif
@@ -118,7 +125,7 @@ static void platform_init(void)
 
 #if USE_SERIAL_USART2
     printf("Starting USART 2." EOL);
-    serial_start(&Serial2, DEFAULT_USART_BAUD
+    serial_start(&Serial2, DEFAULT_USART_BAUD, DATA_USART_FLOW
 #if configUSE_QUEUE_SETS
                  , qs_serial
 #endif
@@ -127,7 +134,7 @@ static void platform_init(void)
 
 #if USE_SERIAL_USART3
     printf("Starting USART 3." EOL);
-    serial_start(&Serial3, DEFAULT_USART_BAUD
+    serial_start(&Serial3, DEFAULT_USART_BAUD, DATA_USART_FLOW
 #if configUSE_QUEUE_SETS
                  , qs_serial
 #endif
@@ -136,7 +143,7 @@ static void platform_init(void)
 
 #if USE_SERIAL_UART4
     printf("Starting USART 4." EOL);
-    serial_start(&Serial4, DEFAULT_USART_BAUD
+    serial_start(&Serial4, DEFAULT_USART_BAUD, SERIAL_FLOW_NONE
 #if configUSE_QUEUE_SETS
                  , qs_serial
 #endif
@@ -145,7 +152,7 @@ static void platform_init(void)
 
 #if USE_SERIAL_UART5
     printf("Starting USART 5." EOL);
-    serial_start(&Serial5, DEFAULT_USART_BAUD
+    serial_start(&Serial5, DEFAULT_USART_BAUD, SERIAL_FLOW_NONE
 #if configUSE_QUEUE_SETS
                  , qs_serial
 #endif
@@ -0,0 +1,286 @@
+/** Serial port benchmark
+ *
+ * Measures how well the serial driver moves data, on a port looped back
+ * on itself. For each transfer path and message size it streams a run of
+ * messages from a writer task to a reader, then times a few single
+ * message round trips, and reports:
+ *
+ * - the rate bytes arrived at the reader, against the line rate;
+ * - the USART and DMA interrupts taken per KB moved;
+ * - the time from the interrupt that delivered the last byte of a message
+ *   to the reader having it, on average and at worst;
+ * - the share of the streaming time the writer spent stalled waiting for
+ *   room in the transmit ring;
+ * - bytes that arrived wrong or not at all.
+ *
+ * The loopback is internal, using the USART's half-duplex mode, so no
+ * wiring is needed; the RX pin is ignored while it runs. The same code
+ * runs against a simulated USART on a build machine, see
+ * \c tools/serbench.
+ *
+ * \file src/serbench.c
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#include <config.h>
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+#include <stm32/serial.h>
+#include <stm32/dwt.h>
+#include <string.h>
+
+#include "serbench.h"
+
+/** How long the line may stay quiet before the run is given up on. */
+#define SERBENCH_TIMEOUT_MS 500
+
+/** Stack size of the writer task. */
+#define STACK_SIZE_SERBENCH (configMINIMAL_STACK_SIZE * 2)
+
+/** What the writer task sends. */
+struct serbench_writer {
+    serial_t            *serial;    ///< Port to write to.
+    uint16_t            size;       ///< Bytes in each message.
+    uint32_t            count;      ///< Messages to send.
+    SemaphoreHandle_t   done;       ///< Given when they have all been queued.
+};
+
+/** Results for one path and size. */
+struct serbench_result {
+    uint32_t    bytes;      ///< Bytes streamed to the reader.
+    uint32_t    cycles;     ///< Time they took.
+    uint32_t    irqs;       ///< Interrupts taken meanwhile.
+    uint32_t    stall;      ///< Cycles the writer waited for ring space.
+    uint32_t    lat_min;    ///< Quickest interrupt to reader hand-off.
+    uint32_t    lat_max;    ///< Slowest.
+    uint64_t    lat_total;  ///< Sum of all of them.
+    int         pings;      ///< Round trips timed.
+    uint32_t    errors;     ///< Bytes wrong or missing.
+};
+
+/** Message contents; every message is the start of this. */
+static uint8_t serbench_tx[SERBENCH_MAX_SIZE];
+
+/** Where the reader puts what arrives. */
+static uint8_t serbench_rx[SERBENCH_MAX_SIZE];
+
+/** Queue all the messages, as fast as the transmit ring takes them. */
+static void serbench_writer_task(void *param)
+{
+    struct serbench_writer *w = (struct serbench_writer *)param;
+
+    for (uint32_t i = 0; i < w->count; i++)
+        serial_write(w->serial, (const char *)serbench_tx, w->size);
+
+    xSemaphoreGive(w->done);
+    vTaskDelete(NULL);
+}
+
+/** Loop the port's transmitter back to its receiver, or stop doing so. */
+static void serbench_loopback(serial_t *serial, int on)
+{
+    USART_TypeDef *u = serial->usart;
+
+    serial_drain(serial);
+
+    taskENTER_CRITICAL();
+    u->CR1 &= ~USART_CR1_UE;
+    if (on)
+        u->CR3 |= USART_CR3_HDSEL;
+    else
+        u->CR3 &= ~USART_CR3_HDSEL;
+    u->CR1 |= USART_CR1_UE;
+    taskEXIT_CRITICAL();
+}
+
+/**
+ * Stream messages of one size from a writer task to this one, checking
+ * them as they arrive. Bytes that have not turned up once the line has
+ * been quiet for a while count as errors. Returns nonzero if nothing
+ * arrived at all.
+ */
+static int serbench_stream(serial_t *serial, uint16_t size, uint32_t bytes,
+                           struct serbench_result *res)
+{
+    struct serbench_writer w = {
+        .serial = serial,
+        .size   = size,
+        .count  = (bytes + size - 1) / size,
+    };
+    struct serial_stats before, after;
+    uint32_t total = w.count * size;
+    uint32_t got = 0;
+    uint32_t t0;
+
+    w.done = xSemaphoreCreateBinary();
+    if (w.done == NULL)
+        return -1;
+
+    serial_get_stats(serial, &before);
+    t0 = dwt_cycles();
+
+    if (xTaskCreate(serbench_writer_task, "serbench", STACK_SIZE_SERBENCH,
+                    &w, uxTaskPriorityGet(NULL), NULL) != pdPASS) {
+        vSemaphoreDelete(w.done);
+        return -1;
+    }
+
+    while (got < total) {
+        size_t want = MIN(total - got, sizeof(serbench_rx));
+        size_t n = serial_read(serial, serbench_rx, want, 0,
+                               MS2ST(SERBENCH_TIMEOUT_MS));
+
+        if (!n)
+            break;
+
+        for (size_t i = 0; i < n; i++)
+            if (serbench_rx[i] != serbench_tx[(got + i) % size])
+                res->errors++;
+        got += n;
+    }
+
+    res->cycles = dwt_cycles() - t0;
+    xSemaphoreTake(w.done, portMAX_DELAY);
+    vSemaphoreDelete(w.done);
+    serial_get_stats(serial, &after);
+
+    res->bytes = got;
+    res->errors += total - got;
+    res->irqs = after.irqs - before.irqs;
+    res->stall = after.tx_stall - before.tx_stall;
+
+    return got == 0;
+}
+
+/**
+ * Send single messages and time how long each takes to reach this task
+ * after the interrupt that brought in its last byte. Each message must
+ * fit in the receive ring.
+ */
+static void serbench_ping(serial_t *serial, uint16_t size, int pings,
+                          struct serbench_result *res)
+{
+    struct serial_stats st;
+
+    res->lat_min = UINT32_MAX;
+    for (int i = 0; i < pings; i++) {
+        serial_write(serial, (const char *)serbench_tx, size);
+        size_t n = serial_read(serial, serbench_rx, size, size,
+                               MS2ST(SERBENCH_TIMEOUT_MS));
+        uint32_t now = dwt_cycles();
+
+        if (n < size) {
+            res->errors += size - n;
+            break;
+        }
+
+        serial_get_stats(serial, &st);
+        uint32_t lat = now - st.rx_stamp;
+
+        if (lat < res->lat_min) res->lat_min = lat;
+        if (lat > res->lat_max) res->lat_max = lat;
+        res->lat_total += lat;
+        res->pings++;
+    }
+}
+
+/** Print one row of results. */
+static void serbench_print(FILE *out, const char *path, uint16_t size,
+                           const struct serbench_result *res)
+{
+    uint32_t us = dwt_cycles_to_us(res->cycles);
+    uint32_t rate = us ? (uint32_t)((uint64_t)res->bytes * 1000000 / us) : 0;
+    uint32_t irqs_kb = res->bytes ? (uint32_t)((uint64_t)res->irqs * 1024 / res->bytes) : 0;
+    uint32_t stall = res->cycles ? (uint32_t)((uint64_t)res->stall * 100 / res->cycles) : 0;
+    uint32_t lat = res->pings ? (uint32_t)(res->lat_total / res->pings) : 0;
+
+    fprintf(out, "%-4s %5u %9lu %8lu ", path, size,
+            (unsigned long)rate, (unsigned long)irqs_kb);
+    if (res->pings)
+        fprintf(out, "%8lu %8lu ", (unsigned long)dwt_cycles_to_us(lat),
+                (unsigned long)dwt_cycles_to_us(res->lat_max));
+    else
+        fprintf(out, "%8s %8s ", "-", "-");
+    fprintf(out, "%6lu%% %7lu" EOL, (unsigned long)stall,
+            (unsigned long)res->errors);
+}
+
+/**
+ * Run the serial benchmark on a port. The port is looped back on itself
+ * for the duration, so it must not be in use for anything else, and is
+ * left on the transfer path it started on.
+ *
+ * @param out Where to print the results.
+ * @param serial The port to measure.
+ * @param cfg What to measure.
+ * @returns \c 0 on success, or \c -1 if the run had to be abandoned.
+ */
+int serbench_run(FILE *out, serial_t *serial, const struct serbench_cfg *cfg)
+{
+    static const struct {
+        int         path;
+        const char  *name;
+    } paths[] = {
+        { SERBENCH_DMA, "DMA" },
+        { SERBENCH_IRQ, "IRQ" },
+    };
+    int was_dma = serial->tx_dma != NULL || serial->rx_dma != NULL;
+    int ret = 0;
+
+    for (int i = 0; i < SERBENCH_MAX_SIZE; i++)
+        serbench_tx[i] = (uint8_t)(i * 7 + 1);
+
+    dwt_start();
+    serbench_loopback(serial, 1);
+
+    fprintf(out, "Line rate %u bytes/s" EOL, serial->baud / 10);
+    fprintf(out, "%-4s %5s %9s %8s %8s %8s %7s %7s" EOL,
+            "Path", "Size", "Bytes/s", "IRQs/KB", "Lat us", "Max us",
+            "Stall", "Errors");
+
+    for (unsigned int p = 0; p < sizeof(paths) / sizeof(paths[0]) && !ret; p++) {
+        if (!(cfg->paths & paths[p].path))
+            continue;
+
+        if (serial_set_dma(serial, paths[p].path == SERBENCH_DMA)) {
+            fprintf(out, "%-4s (port has no DMA channels)" EOL, paths[p].name);
+            continue;
+        }
+
+        for (int s = 0; s < cfg->nsizes; s++) {
+            uint16_t size = cfg->sizes[s];
+            struct serbench_result res;
+
+            if (!size || size > SERBENCH_MAX_SIZE)
+                continue;
+
+            memset(&res, 0, sizeof(res));
+            if (serbench_stream(serial, size, cfg->bytes, &res)) {
+                serbench_print(out, paths[p].name, size, &res);
+                fprintf(out, "Nothing arrived for %d ms; run abandoned." EOL,
+                        SERBENCH_TIMEOUT_MS);
+                ret = -1;
+                break;
+            }
+            // a message the receive ring cannot hold would overrun it
+            // before this task got round to reading
+            if (size <= SERIAL_RX_SIZE)
+                serbench_ping(serial, size, cfg->pings, &res);
+            serbench_print(out, paths[p].name, size, &res);
+        }
+    }
+
+    serbench_loopback(serial, 0);
+    serial_set_dma(serial, was_dma);
+
+    return ret;
+}
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -0,0 +1,38 @@
+/** Serial port benchmark
+ * \file src/serbench.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef _SERBENCH_H
+#define _SERBENCH_H
+
+#include <stdio.h>
+#include <stm32/serial.h>
+
+/** Largest message serbench_run() will send. */
+#define SERBENCH_MAX_SIZE   1024
+
+/** Transfer paths serbench_run() can try, for \ref serbench_cfg.paths. */
+#define SERBENCH_DMA        0x1     ///< The port's DMA channels.
+#define SERBENCH_IRQ        0x2     ///< The USART interrupt, a byte at a time.
+
+/** What serbench_run() should measure. */
+struct serbench_cfg {
+    const uint16_t  *sizes;     ///< Message sizes to try, each up to \ref SERBENCH_MAX_SIZE.
+    int             nsizes;     ///< Number of entries in \c sizes.
+    uint32_t        bytes;      ///< Bytes to stream at each size.
+    int             pings;      ///< Round trips to time at each size.
+    int             paths;      ///< Mask of \c SERBENCH_DMA and \c SERBENCH_IRQ.
+};
+
+int serbench_run(FILE *out, serial_t *serial, const struct serbench_cfg *cfg);
+
+#endif /* _SERBENCH_H */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -0,0 +1,49 @@
+/** Kernel stand-in for the serial benchmark host build
+ *
+ * Just enough of the FreeRTOS API for the serial driver and serbench,
+ * on POSIX threads. Critical sections take one lock that the simulated
+ * peripherals also hold while they run an interrupt handler.
+ *
+ * \file tools/serbench/include/FreeRTOS.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef INC_FREERTOS_H
+#define INC_FREERTOS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE         ((BaseType_t)0)
+#define pdTRUE          ((BaseType_t)1)
+#define pdPASS          pdTRUE
+#define pdFAIL          pdFALSE
+#define portMAX_DELAY   ((TickType_t)0xffffffffUL)
+
+#define configTICK_RATE_HZ          1000
+#define configMINIMAL_STACK_SIZE    128
+#define configUSE_QUEUE_SETS        0
+#define MS2ST(ms)                   (((ms) * configTICK_RATE_HZ) / 1000)
+
+#define taskENTER_CRITICAL()        sim_irq_lock()
+#define taskEXIT_CRITICAL()         sim_irq_unlock()
+#define portEND_SWITCHING_ISR(x)    ((void)(x))
+#define portSET_INTERRUPT_MASK_FROM_ISR()       (sim_irq_lock(), 0)
+#define portCLEAR_INTERRUPT_MASK_FROM_ISR(m)    ((void)(m), sim_irq_unlock())
+
+void sim_irq_lock(void);
+void sim_irq_unlock(void);
+
+#endif /* INC_FREERTOS_H */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
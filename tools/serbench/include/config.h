@@ -0,0 +1,62 @@
+/** Configuration for the serial benchmark host build
+ *
+ * Stands in for include/config.h when the serial driver is built on a
+ * build machine against the simulated peripherals in \c sim.c.
+ *
+ * \file tools/serbench/include/config.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define STM32F10X_XL            1
+
+// USART2 has DMA channels and UART5 has none, so between them they
+// cover both of the driver's transfer paths.
+#define USE_SERIAL_USART1       0
+#define USE_SERIAL_USART2       1
+#define USE_SERIAL_USART3       0
+#define USE_SERIAL_UART4        0
+#define USE_SERIAL_UART5        1
+#define USE_SERIAL_RX_DMA       1
+
+#define DEFAULT_USART_BAUD      921600
+#define IRQ_PRIO_USART          12
+#define DMA_PRIO_USART          3
+
+#define EOL "\n"
+
+#define MAX(a, b)  ((a) > (b) ? (a) : (b))
+#define MIN(a, b)  ((a) < (b) ? (a) : (b))
+
+#define HALT_WITH_MSG(msg) { \
+        fprintf(stderr, "HALT for %s at %s line %d.\n", \
+                msg, __FILE__, __LINE__); \
+        abort(); \
+}
+
+#define ASSERT(x) { if (!(x)) { \
+                        fprintf(stderr, "ASSERT failed at %s line %d.\n", \
+                                __FILE__, __LINE__); \
+                        abort(); \
+                    } }
+
+#include <stm32f10x.h>
+#include "sim.h"
+#include <FreeRTOS.h>
+
+#endif /* CONFIG_H */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
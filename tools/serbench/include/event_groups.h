@@ -0,0 +1,22 @@
+/** Kernel stand-in for the serial benchmark host build: event groups
+ * \file tools/serbench/include/event_groups.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef EVENT_GROUPS_H
+#define EVENT_GROUPS_H
+
+#include <FreeRTOS.h>
+
+typedef void *EventGroupHandle_t;
+typedef TickType_t EventBits_t;
+
+#endif /* EVENT_GROUPS_H */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
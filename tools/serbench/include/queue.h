@@ -0,0 +1,22 @@
+/** Kernel stand-in for the serial benchmark host build: queues
+ * \file tools/serbench/include/queue.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <FreeRTOS.h>
+
+typedef void *QueueHandle_t;
+typedef void *QueueSetHandle_t;
+
+#endif /* QUEUE_H */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
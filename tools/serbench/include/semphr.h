@@ -0,0 +1,33 @@
+/** Kernel stand-in for the serial benchmark host build: semaphores
+ * \file tools/serbench/include/semphr.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef SEMAPHORE_H
+#define SEMAPHORE_H
+
+#include <queue.h>
+
+typedef struct sim_sem *SemaphoreHandle_t;
+
+SemaphoreHandle_t sim_sem_create(unsigned int count, unsigned int max);
+BaseType_t sim_sem_take(SemaphoreHandle_t sem, TickType_t timeout);
+BaseType_t sim_sem_give(SemaphoreHandle_t sem);
+void sim_sem_delete(SemaphoreHandle_t sem);
+
+#define xSemaphoreCreateBinary()        sim_sem_create(0, 1)
+#define xSemaphoreCreateMutex()         sim_sem_create(1, 1)
+#define xSemaphoreTake(s, t)            sim_sem_take((s), (t))
+#define xSemaphoreGive(s)               sim_sem_give(s)
+#define xSemaphoreGiveFromISR(s, w)     ((void)(w), sim_sem_give(s))
+#define vSemaphoreDelete(s)             sim_sem_delete(s)
+
+#endif /* SEMAPHORE_H */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -0,0 +1,94 @@
+/** Simulated peripherals for the serial benchmark host build
+ *
+ * Points the peripheral macros from \c stm32f10x.h at plain structures,
+ * which \c sim.c brings to life, and routes the few core functions the
+ * drivers use to it as well.
+ *
+ * \file tools/serbench/include/sim.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef _SIM_H
+#define _SIM_H
+
+extern USART_TypeDef sim_usart_regs[5];
+extern DMA_TypeDef sim_dma_regs[2];
+extern DMA_Channel_TypeDef sim_dma_ch_regs[12];
+extern RCC_TypeDef sim_rcc_regs;
+extern GPIO_TypeDef sim_gpio_regs[4];
+
+#undef USART1
+#undef USART2
+#undef USART3
+#undef UART4
+#undef UART5
+#define USART1          (&sim_usart_regs[0])
+#define USART2          (&sim_usart_regs[1])
+#define USART3          (&sim_usart_regs[2])
+#define UART4           (&sim_usart_regs[3])
+#define UART5           (&sim_usart_regs[4])
+
+#undef DMA1
+#undef DMA2
+#define DMA1            (&sim_dma_regs[0])
+#define DMA2            (&sim_dma_regs[1])
+
+#undef DMA1_Channel1
+#undef DMA1_Channel2
+#undef DMA1_Channel3
+#undef DMA1_Channel4
+#undef DMA1_Channel5
+#undef DMA1_Channel6
+#undef DMA1_Channel7
+#undef DMA2_Channel1
+#undef DMA2_Channel2
+#undef DMA2_Channel3
+#undef DMA2_Channel4
+#undef DMA2_Channel5
+#define DMA1_Channel1   (&sim_dma_ch_regs[0])
+#define DMA1_Channel2   (&sim_dma_ch_regs[1])
+#define DMA1_Channel3   (&sim_dma_ch_regs[2])
+#define DMA1_Channel4   (&sim_dma_ch_regs[3])
+#define DMA1_Channel5   (&sim_dma_ch_regs[4])
+#define DMA1_Channel6   (&sim_dma_ch_regs[5])
+#define DMA1_Channel7   (&sim_dma_ch_regs[6])
+#define DMA2_Channel1   (&sim_dma_ch_regs[7])
+#define DMA2_Channel2   (&sim_dma_ch_regs[8])
+#define DMA2_Channel3   (&sim_dma_ch_regs[9])
+#define DMA2_Channel4   (&sim_dma_ch_regs[10])
+#define DMA2_Channel5   (&sim_dma_ch_regs[11])
+
+#undef RCC
+#define RCC             (&sim_rcc_regs)
+
+#undef GPIOA
+#undef GPIOB
+#undef GPIOC
+#undef GPIOD
+#define GPIOA           (&sim_gpio_regs[0])
+#define GPIOB           (&sim_gpio_regs[1])
+#define GPIOC           (&sim_gpio_regs[2])
+#define GPIOD           (&sim_gpio_regs[3])
+
+// The CMSIS versions of these are inline functions, so these macros
+// take over from here on.
+#define __DMB()                 __sync_synchronize()
+#define NVIC_SetPriority(i, p)  sim_nvic_priority((i), (p))
+#define NVIC_EnableIRQ(i)       sim_nvic_enable((i), 1)
+#define NVIC_DisableIRQ(i)      sim_nvic_enable((i), 0)
+
+void sim_nvic_priority(IRQn_Type irqn, uint32_t priority);
+void sim_nvic_enable(IRQn_Type irqn, int on);
+
+void sim_start(void);
+void sim_stop(void);
+
+#endif /* _SIM_H */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
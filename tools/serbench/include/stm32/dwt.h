@@ -0,0 +1,37 @@
+/** Cycle counter stand-in for the serial benchmark host build
+ *
+ * Counts at SystemCoreClock from the host's monotonic clock, so cycle
+ * counts mean the same as they would on the target.
+ *
+ * \file tools/serbench/include/stm32/dwt.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef _DWT_H
+#define _DWT_H
+
+#include <config.h>
+
+uint32_t sim_cycles(void);
+
+/** Start the cycle counter; it always runs here. */
+static inline void
+dwt_start(void)
+{
+}
+
+/** Read the cycle counter. It wraps every 2^32 cycles. */
+#define dwt_cycles() sim_cycles()
+
+/** Convert a count of CPU cycles to microseconds. */
+#define dwt_cycles_to_us(c) ((c) / (SystemCoreClock / 1000000))
+
+#endif
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -0,0 +1,38 @@
+/** Kernel stand-in for the serial benchmark host build: tasks
+ * \file tools/serbench/include/task.h
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#ifndef INC_TASK_H
+#define INC_TASK_H
+
+#include <FreeRTOS.h>
+#include <sched.h>
+
+#define taskYIELD()     sched_yield()
+
+typedef void (*TaskFunction_t)(void *);
+typedef struct sim_task *TaskHandle_t;
+
+typedef struct {
+    TickType_t  start;  ///< When the wait began, or last checked.
+} TimeOut_t;
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint16_t stack,
+                       void *param, UBaseType_t prio, TaskHandle_t *handle);
+void vTaskDelete(TaskHandle_t task);
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task);
+TickType_t xTaskGetTickCount(void);
+void vTaskDelay(TickType_t ticks);
+void vTaskSetTimeOutState(TimeOut_t *timeout);
+BaseType_t xTaskCheckForTimeOut(TimeOut_t *timeout, TickType_t *remaining);
+
+#endif /* INC_TASK_H */
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
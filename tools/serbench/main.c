@@ -0,0 +1,113 @@
+/** Serial benchmark host build
+ *
+ * Runs serbench against the real serial driver on a simulated USART, so
+ * that changes to the driver can be measured without a board. Port 2
+ * has DMA channels and port 5 does not, as on the target. The numbers
+ * are for the driver's logic, at the host's speed; the interrupt counts
+ * and line rates carry over, the latencies much less so.
+ *
+ * \file tools/serbench/main.c
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#include <config.h>
+#include <stm32/serial.h>
+#include <serbench.h>
+
+#include <string.h>
+#include <unistd.h>
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [-p <port>] [-r <baud>] [-b <bytes>] [-n <pings>]" EOL
+            "          [-s <size>[,<size>...]] [-m dma|irq|both]" EOL, argv0);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint16_t default_sizes[] = { 1, 16, 64, 256, 1024 };
+    uint16_t sizes[8];
+    struct serbench_cfg cfg = {
+        .sizes  = default_sizes,
+        .nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]),
+        .bytes  = 16384,
+        .pings  = 16,
+        .paths  = SERBENCH_DMA | SERBENCH_IRQ,
+    };
+    serial_t *serial = &Serial2;
+    int baud = DEFAULT_USART_BAUD;
+    int ret;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:r:b:n:s:m:")) != EOF) {
+        switch (c) {
+        case 'p':     // port number
+            if (atoi(optarg) == 2)
+                serial = &Serial2;
+            else if (atoi(optarg) == 5)
+                serial = &Serial5;
+            else
+                usage(argv[0]);
+            break;
+
+        case 'r':     // line rate
+            baud = atoi(optarg);
+            break;
+
+        case 'b':     // bytes streamed per size
+            cfg.bytes = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'n':     // round trips per size
+            cfg.pings = atoi(optarg);
+            break;
+
+        case 's': {   // comma separated message sizes
+            const char *p = optarg;
+
+            cfg.sizes = sizes;
+            cfg.nsizes = 0;
+            while (*p && cfg.nsizes < (int)(sizeof(sizes) / sizeof(sizes[0]))) {
+                char *end;
+
+                sizes[cfg.nsizes++] = strtoul(p, &end, 0);
+                p = *end == ',' ? end + 1 : end + strlen(end);
+            }
+            break;
+        }
+
+        case 'm':     // transfer paths
+            if (!strcmp(optarg, "dma"))
+                cfg.paths = SERBENCH_DMA;
+            else if (!strcmp(optarg, "irq"))
+                cfg.paths = SERBENCH_IRQ;
+            else
+                cfg.paths = SERBENCH_DMA | SERBENCH_IRQ;
+            break;
+
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    sim_start();
+    serial_start(serial, baud, SERIAL_FLOW_NONE);
+
+    printf("Port %d at %u baud, looped back" EOL,
+           serial == &Serial2 ? 2 : 5, serial->baud);
+    ret = serbench_run(stdout, serial, &cfg);
+
+    sim_stop();
+
+    return ret ? 1 : 0;
+}
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
@@ -0,0 +1,774 @@
+/** Simulated peripherals and kernel for the serial benchmark host build
+ *
+ * Runs the real serial and DMA drivers on a build machine. The USART and
+ * DMA register blocks are plain structures that a simulation thread
+ * watches and updates in real time, moving one frame per bit-time at the
+ * rate BRR gives, and calling the drivers' interrupt handlers whenever
+ * the hardware would. The thread holds the same lock as the drivers'
+ * critical sections while it does anything, so to the drivers it looks
+ * like the interrupt controller.
+ *
+ * The registers are ordinary memory, so the simulation cannot see the
+ * drivers read them, only what they leave behind. It therefore assumes:
+ *
+ * - DR holds the received byte with bit 8 set, so that a byte the driver
+ *   writes to transmit can be told apart from it;
+ * - an interrupt handler that runs with RXNE set, and leaves RXNEIE on,
+ *   has read DR;
+ * - with receive DMA, a handler that runs with ORE set, or IDLE without
+ *   RXNE, has read DR, which is what the driver does to clear them;
+ * - writing 0 to TC in SR clears it; other SR writes are ignored.
+ *
+ * The DMA controller takes the peripheral and memory addresses as 32-bit
+ * values, as the target does, so the build must keep the drivers' buffers
+ * in the low 4GB; the Makefile links without PIE for that. Only the
+ * half-duplex loopback is modelled on the line, and only 8-bit frames.
+ *
+ * \file tools/serbench/sim.c
+ *
+ * \author Chris Luke <chrisy@flirble.org>
+ * \copyright Copyright (c) Chris Luke <chrisy@flirble.org>
+ *
+ * \copyright This file is distributed under the terms of the MIT License.
+ * See the LICENSE file at the top of this tree, or if it is missing a copy can
+ * be found at http://opensource.org/licenses/MIT
+ */
+
+#include <config.h>
+#include <task.h>
+#include <semphr.h>
+#include <stm32/dwt.h>
+#include <stm32/dma.h>
+#include <stm32f10x_rcc.h>
+
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// The clock the drivers see.
+uint32_t SystemCoreClock = 72000000;
+
+USART_TypeDef sim_usart_regs[5];
+DMA_TypeDef sim_dma_regs[2];
+DMA_Channel_TypeDef sim_dma_ch_regs[12];
+RCC_TypeDef sim_rcc_regs = {
+    .CFGR = RCC_CFGR_PPRE1_DIV2,    // PCLK1 36MHz, PCLK2 72MHz
+};
+GPIO_TypeDef sim_gpio_regs[4];
+
+/* The bus clocks, from SystemCoreClock and the simulated APB prescalers;
+ * the PLL and clock source bits are not simulated. */
+void RCC_GetClocksFreq(RCC_ClocksTypeDef *clocks)
+{
+    static const uint8_t apb_shift[8] = { 0, 0, 0, 0, 1, 2, 3, 4 };
+    uint32_t cfgr = sim_rcc_regs.CFGR;
+
+    clocks->SYSCLK_Frequency = SystemCoreClock;
+    clocks->HCLK_Frequency = SystemCoreClock;
+    clocks->PCLK1_Frequency =
+        SystemCoreClock >> apb_shift[(cfgr & RCC_CFGR_PPRE1) >> 8];
+    clocks->PCLK2_Frequency =
+        SystemCoreClock >> apb_shift[(cfgr & RCC_CFGR_PPRE2) >> 11];
+    clocks->ADCCLK_Frequency = clocks->PCLK2_Frequency / 2;
+}
+
+/// Marks DR as holding received data rather than a byte to send.
+#define SIM_DR_RX       0x100
+
+/// Most rounds of DMA transfers and interrupts before time moves on.
+#define SIM_SETTLE_MAX  64
+
+/// Frames the line may run behind real time before it waits for us.
+#define SIM_SLIP_FRAMES 8
+
+/* Handlers from the drivers; only those of the ports in use are there. */
+void USART1_IRQHandler(void) __attribute__ ((weak));
+void USART2_IRQHandler(void) __attribute__ ((weak));
+void USART3_IRQHandler(void) __attribute__ ((weak));
+void UART4_IRQHandler(void) __attribute__ ((weak));
+void UART5_IRQHandler(void) __attribute__ ((weak));
+void DMA1_Channel1_IRQHandler(void) __attribute__ ((weak));
+void DMA1_Channel2_IRQHandler(void) __attribute__ ((weak));
+void DMA1_Channel3_IRQHandler(void) __attribute__ ((weak));
+void DMA1_Channel4_IRQHandler(void) __attribute__ ((weak));
+void DMA1_Channel5_IRQHandler(void) __attribute__ ((weak));
+void DMA1_Channel6_IRQHandler(void) __attribute__ ((weak));
+void DMA1_Channel7_IRQHandler(void) __attribute__ ((weak));
+void DMA2_Channel1_IRQHandler(void) __attribute__ ((weak));
+void DMA2_Channel2_IRQHandler(void) __attribute__ ((weak));
+void DMA2_Channel3_IRQHandler(void) __attribute__ ((weak));
+void DMA2_Channel4_5_IRQHandler(void) __attribute__ ((weak));
+
+/** The state of a USART that its registers do not show. */
+struct sim_usart {
+    USART_TypeDef   *reg;       ///< Its registers.
+    IRQn_Type       irqn;       ///< Its interrupt.
+    void            (*handler)(void);   ///< Its interrupt handler.
+    int             apb2;       ///< Clocked from PCLK2 rather than PCLK1.
+    uint16_t        sr;         ///< Status flags.
+    uint16_t        sr_shown;   ///< Status flags as last put in SR.
+    int             tdr_full;   ///< A byte is waiting to be sent.
+    uint8_t         tdr;        ///< That byte.
+    int             shifting;   ///< A byte is going out.
+    uint8_t         shift;      ///< That byte.
+    uint64_t        frame_end;  ///< When it will be out.
+    int             rdr_full;   ///< A received byte is waiting.
+    uint8_t         rdr;        ///< That byte.
+    int             rx_active;  ///< Bytes arrived since the line was last idle.
+    int             idle_seen;  ///< A handler has seen IDLE, so a DMA read clears it.
+    uint64_t        rx_last;    ///< When the last byte arrived.
+};
+
+/** The state of a DMA channel that its registers do not show. */
+struct sim_dma_ch {
+    DMA_TypeDef     *dma;       ///< Its controller.
+    int             shift;      ///< Its flags' offset in ISR and IFCR.
+    IRQn_Type       irqn;       ///< Its interrupt.
+    void            (*handler)(void);   ///< Its interrupt handler.
+    uint32_t        base;       ///< CMAR as it was programmed.
+    uint32_t        init;       ///< CNDTR as it was programmed.
+    uint32_t        last;       ///< CNDTR as we last left it.
+};
+
+static struct sim_usart sim_usarts[5] = {
+    { .reg = &sim_usart_regs[0], .irqn = USART1_IRQn, .handler = USART1_IRQHandler, .apb2 = 1 },
+    { .reg = &sim_usart_regs[1], .irqn = USART2_IRQn, .handler = USART2_IRQHandler, .apb2 = 0 },
+    { .reg = &sim_usart_regs[2], .irqn = USART3_IRQn, .handler = USART3_IRQHandler, .apb2 = 0 },
+    { .reg = &sim_usart_regs[3], .irqn = UART4_IRQn, .handler = UART4_IRQHandler, .apb2 = 0 },
+    { .reg = &sim_usart_regs[4], .irqn = UART5_IRQn, .handler = UART5_IRQHandler, .apb2 = 0 },
+};
+
+static struct sim_dma_ch sim_dma_chs[12] = {
+    { .dma = &sim_dma_regs[0], .shift = 0, .irqn = DMA1_Channel1_IRQn, .handler = DMA1_Channel1_IRQHandler },
+    { .dma = &sim_dma_regs[0], .shift = 4, .irqn = DMA1_Channel2_IRQn, .handler = DMA1_Channel2_IRQHandler },
+    { .dma = &sim_dma_regs[0], .shift = 8, .irqn = DMA1_Channel3_IRQn, .handler = DMA1_Channel3_IRQHandler },
+    { .dma = &sim_dma_regs[0], .shift = 12, .irqn = DMA1_Channel4_IRQn, .handler = DMA1_Channel4_IRQHandler },
+    { .dma = &sim_dma_regs[0], .shift = 16, .irqn = DMA1_Channel5_IRQn, .handler = DMA1_Channel5_IRQHandler },
+    { .dma = &sim_dma_regs[0], .shift = 20, .irqn = DMA1_Channel6_IRQn, .handler = DMA1_Channel6_IRQHandler },
+    { .dma = &sim_dma_regs[0], .shift = 24, .irqn = DMA1_Channel7_IRQn, .handler = DMA1_Channel7_IRQHandler },
+    { .dma = &sim_dma_regs[1], .shift = 0, .irqn = DMA2_Channel1_IRQn, .handler = DMA2_Channel1_IRQHandler },
+    { .dma = &sim_dma_regs[1], .shift = 4, .irqn = DMA2_Channel2_IRQn, .handler = DMA2_Channel2_IRQHandler },
+    { .dma = &sim_dma_regs[1], .shift = 8, .irqn = DMA2_Channel3_IRQn, .handler = DMA2_Channel3_IRQHandler },
+    { .dma = &sim_dma_regs[1], .shift = 12, .irqn = DMA2_Channel4_5_IRQn, .handler = DMA2_Channel4_5_IRQHandler },
+    { .dma = &sim_dma_regs[1], .shift = 16, .irqn = DMA2_Channel4_5_IRQn, .handler = DMA2_Channel4_5_IRQHandler },
+};
+
+/** Interrupts the drivers have enabled. */
+static uint8_t sim_nvic[64];
+
+/** Held by critical sections and by the simulation thread. */
+static pthread_mutex_t sim_irq;
+
+/** Wakes the simulation thread when a critical section ends. */
+static pthread_cond_t sim_kick;
+
+static pthread_t sim_thread;
+static volatile int sim_running;
+
+/** Time since the simulation started, in ns. */
+static uint64_t sim_epoch;
+
+
+/** The host's monotonic clock, in ns. */
+static uint64_t sim_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Time since the simulation started, in ns. */
+static uint64_t sim_now(void)
+{
+    return sim_clock() - sim_epoch;
+}
+
+/** Make a condition variable that times out by the monotonic clock. */
+static void sim_cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/** Turn a time since the start into an absolute time for pthreads. */
+static struct timespec sim_abstime(uint64_t t)
+{
+    struct timespec ts;
+    uint64_t abs = sim_epoch + t;
+
+    ts.tv_sec = abs / 1000000000;
+    ts.tv_nsec = abs % 1000000000;
+    return ts;
+}
+
+uint32_t sim_cycles(void)
+{
+    return (uint32_t)(sim_now() * (SystemCoreClock / 1000000) / 1000);
+}
+
+
+/*
+ * Kernel.
+ */
+
+void sim_irq_lock(void)
+{
+    pthread_mutex_lock(&sim_irq);
+}
+
+void sim_irq_unlock(void)
+{
+    pthread_mutex_unlock(&sim_irq);
+    pthread_cond_signal(&sim_kick);
+}
+
+/** A counting semaphore; a mutex is one that starts given. */
+struct sim_sem {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    unsigned int    count;
+    unsigned int    max;
+};
+
+SemaphoreHandle_t sim_sem_create(unsigned int count, unsigned int max)
+{
+    struct sim_sem *sem = calloc(1, sizeof(*sem));
+
+    if (sem != NULL) {
+        pthread_mutex_init(&sem->lock, NULL);
+        sim_cond_init(&sem->cond);
+        sem->count = count;
+        sem->max = max;
+    }
+    return sem;
+}
+
+BaseType_t sim_sem_take(SemaphoreHandle_t sem, TickType_t timeout)
+{
+    struct timespec until = sim_abstime(sim_now() + (uint64_t)timeout * 1000000);
+    BaseType_t ret = pdFALSE;
+
+    pthread_mutex_lock(&sem->lock);
+    while (!sem->count) {
+        if (timeout == portMAX_DELAY)
+            pthread_cond_wait(&sem->cond, &sem->lock);
+        else if (pthread_cond_timedwait(&sem->cond, &sem->lock, &until) == ETIMEDOUT)
+            break;
+    }
+    if (sem->count) {
+        sem->count--;
+        ret = pdTRUE;
+    }
+    pthread_mutex_unlock(&sem->lock);
+
+    return ret;
+}
+
+BaseType_t sim_sem_give(SemaphoreHandle_t sem)
+{
+    BaseType_t ret = pdFALSE;
+
+    pthread_mutex_lock(&sem->lock);
+    if (sem->count < sem->max) {
+        sem->count++;
+        pthread_cond_signal(&sem->cond);
+        ret = pdTRUE;
+    }
+    pthread_mutex_unlock(&sem->lock);
+
+    return ret;
+}
+
+void sim_sem_delete(SemaphoreHandle_t sem)
+{
+    pthread_cond_destroy(&sem->cond);
+    pthread_mutex_destroy(&sem->lock);
+    free(sem);
+}
+
+/** What a new task thread should run. */
+struct sim_task_start {
+    TaskFunction_t  fn;
+    void            *param;
+};
+
+static void *sim_task_main(void *arg)
+{
+    struct sim_task_start task = *(struct sim_task_start *)arg;
+
+    free(arg);
+    task.fn(task.param);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint16_t stack,
+                       void *param, UBaseType_t prio, TaskHandle_t *handle)
+{
+    struct sim_task_start *task = malloc(sizeof(*task));
+    pthread_t thread;
+
+    if (task == NULL)
+        return pdFAIL;
+
+    task->fn = fn;
+    task->param = param;
+    if (pthread_create(&thread, NULL, sim_task_main, task)) {
+        free(task);
+        return pdFAIL;
+    }
+    pthread_detach(thread);
+
+    if (handle != NULL)
+        *handle = NULL;
+    return pdPASS;
+}
+
+/** Only a task deleting itself is supported. */
+void vTaskDelete(TaskHandle_t task)
+{
+    ASSERT(task == NULL);
+    pthread_exit(NULL);
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task)
+{
+    return 0;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(sim_now() / (1000000000 / configTICK_RATE_HZ));
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec ts = { ticks / 1000, (ticks % 1000) * 1000000 };
+
+    nanosleep(&ts, NULL);
+}
+
+void vTaskSetTimeOutState(TimeOut_t *timeout)
+{
+    timeout->start = xTaskGetTickCount();
+}
+
+BaseType_t xTaskCheckForTimeOut(TimeOut_t *timeout, TickType_t *remaining)
+{
+    TickType_t now = xTaskGetTickCount();
+    TickType_t elapsed = now - timeout->start;
+
+    if (*remaining == portMAX_DELAY)
+        return pdFALSE;
+
+    if (elapsed >= *remaining) {
+        *remaining = 0;
+        return pdTRUE;
+    }
+
+    *remaining -= elapsed;
+    timeout->start = now;
+    return pdFALSE;
+}
+
+void sim_nvic_priority(IRQn_Type irqn, uint32_t priority)
+{
+}
+
+void sim_nvic_enable(IRQn_Type irqn, int on)
+{
+    sim_nvic[irqn] = on;
+}
+
+
+/*
+ * DMA controller.
+ */
+
+/** Apply writes to IFCR and notice channels that have been reprogrammed. */
+static void sim_dma_sync(void)
+{
+    for (int i = 0; i < 2; i++) {
+        DMA_TypeDef *dma = &sim_dma_regs[i];
+
+        if (dma->IFCR) {
+            dma->ISR &= ~dma->IFCR;
+            dma->IFCR = 0;
+        }
+    }
+
+    for (int i = 0; i < 12; i++) {
+        DMA_Channel_TypeDef *reg = &sim_dma_ch_regs[i];
+        struct sim_dma_ch *ch = &sim_dma_chs[i];
+
+        if (reg->CMAR != ch->base || reg->CNDTR != ch->last) {
+            ch->base = reg->CMAR;
+            ch->init = ch->last = reg->CNDTR;
+        }
+    }
+}
+
+/** Find the enabled channel serving a USART in a direction, if any. */
+static int sim_dma_find(struct sim_usart *u, int to_periph)
+{
+    uint32_t dr = (uint32_t)(uintptr_t)&u->reg->DR;
+
+    for (int i = 0; i < 12; i++) {
+        DMA_Channel_TypeDef *reg = &sim_dma_ch_regs[i];
+
+        if ((reg->CCR & DMA_CCR1_EN) && reg->CPAR == dr && reg->CNDTR
+                && !(reg->CCR & DMA_CCR1_DIR) == !to_periph)
+            return i;
+    }
+    return -1;
+}
+
+/** Account for one item moved by a channel. */
+static void sim_dma_count(int i)
+{
+    DMA_Channel_TypeDef *reg = &sim_dma_ch_regs[i];
+    struct sim_dma_ch *ch = &sim_dma_chs[i];
+    uint32_t flags = 0;
+
+    reg->CNDTR--;
+    if (reg->CNDTR == ch->init / 2)
+        flags |= DMA_FLAG_HT;
+    if (!reg->CNDTR) {
+        flags |= DMA_FLAG_TC;
+        if (reg->CCR & DMA_CCR1_CIRC)
+            reg->CNDTR = ch->init;
+    }
+    ch->last = reg->CNDTR;
+
+    if (flags)
+        ch->dma->ISR |= (flags | DMA_FLAG_GI) << ch->shift;
+}
+
+/** The byte a channel is pointing at. */
+static uint8_t *sim_dma_ptr(int i)
+{
+    struct sim_dma_ch *ch = &sim_dma_chs[i];
+    uint32_t off = 0;
+
+    if (sim_dma_ch_regs[i].CCR & DMA_CCR1_MINC)
+        off = ch->init - sim_dma_ch_regs[i].CNDTR;
+    return (uint8_t *)(uintptr_t)(ch->base + off);
+}
+
+/** Call the handlers of channels with enabled flags up. */
+static int sim_dma_irqs(void)
+{
+    int did = 0;
+
+    for (int i = 0; i < 12; i++) {
+        struct sim_dma_ch *ch = &sim_dma_chs[i];
+        uint32_t ccr = sim_dma_ch_regs[i].CCR;
+        uint32_t flags = (ch->dma->ISR >> ch->shift) & 0xf;
+        uint32_t ie = 0;
+
+        if (ccr & DMA_CCR1_TCIE) ie |= DMA_FLAG_TC;
+        if (ccr & DMA_CCR1_HTIE) ie |= DMA_FLAG_HT;
+        if (ccr & DMA_CCR1_TEIE) ie |= DMA_FLAG_TE;
+
+        if ((flags & ie) && sim_nvic[ch->irqn] && ch->handler != NULL) {
+            ch->handler();
+            sim_dma_sync();
+            did = 1;
+        }
+    }
+    return did;
+}
+
+
+/*
+ * USARTs.
+ */
+
+/** Time one frame takes at the rate BRR gives, in ns. */
+static uint64_t sim_frame_ns(struct sim_usart *u)
+{
+    uint32_t pclk = SystemCoreClock;
+    uint16_t brr = u->reg->BRR;
+
+    if (!u->apb2 && (sim_rcc_regs.CFGR & RCC_CFGR_PPRE1_2))
+        pclk >>= ((sim_rcc_regs.CFGR & RCC_CFGR_PPRE1) >> 8) - 3;
+    if (!brr)
+        brr = 1;
+
+    // start bit, 8 data bits and a stop bit
+    return (uint64_t)10 * 1000000000 * brr / pclk;
+}
+
+/** Show the drivers the state, and pick up what they have written. */
+static void sim_usart_sync(struct sim_usart *u)
+{
+    USART_TypeDef *reg = u->reg;
+
+    if ((u->sr_shown & USART_SR_TC) && !(reg->SR & USART_SR_TC))
+        u->sr &= ~USART_SR_TC;
+
+    if (!(reg->DR & SIM_DR_RX)) {
+        u->tdr = (uint8_t)reg->DR;
+        u->tdr_full = 1;
+        u->sr &= ~(USART_SR_TXE | USART_SR_TC);
+    }
+
+    reg->SR = u->sr_shown = u->sr;
+    reg->DR = SIM_DR_RX | u->rdr;
+}
+
+/** Take the received byte out of the data register. */
+static void sim_usart_read(struct sim_usart *u)
+{
+    u->rdr_full = 0;
+    u->sr &= ~(USART_SR_RXNE | USART_SR_ORE | USART_SR_NE | USART_SR_FE);
+}
+
+/** Run the interrupt handler, and work out what it must have read. */
+static void sim_usart_isr(struct sim_usart *u)
+{
+    USART_TypeDef *reg = u->reg;
+    uint16_t sr = u->sr;
+
+    u->handler();
+
+    if (!(reg->CR3 & USART_CR3_DMAR)) {
+        if ((sr & USART_SR_RXNE) && (reg->CR1 & USART_CR1_RXNEIE)) {
+            sim_usart_read(u);
+            u->sr &= ~USART_SR_IDLE;
+        }
+    } else if ((sr & USART_SR_ORE) || ((sr & USART_SR_IDLE) && !(sr & USART_SR_RXNE))) {
+        sim_usart_read(u);
+        u->sr &= ~USART_SR_IDLE;
+    } else if (sr & USART_SR_IDLE) {
+        u->idle_seen = 1;
+    }
+
+    sim_usart_sync(u);
+}
+
+/** Would the USART interrupt? */
+static int sim_usart_pending(struct sim_usart *u)
+{
+    uint16_t cr1 = u->reg->CR1;
+    uint16_t cr3 = u->reg->CR3;
+
+    if (!(cr1 & USART_CR1_UE) || !sim_nvic[u->irqn] || u->handler == NULL)
+        return 0;
+
+    return ((cr1 & USART_CR1_RXNEIE) && (u->sr & (USART_SR_RXNE | USART_SR_ORE)))
+           || ((cr1 & USART_CR1_TXEIE) && (u->sr & USART_SR_TXE))
+           || ((cr1 & USART_CR1_TCIE) && (u->sr & USART_SR_TC))
+           || ((cr1 & USART_CR1_IDLEIE) && (u->sr & USART_SR_IDLE))
+           || ((cr3 & USART_CR3_EIE) && (cr3 & USART_CR3_DMAR)
+               && (u->sr & (USART_SR_ORE | USART_SR_NE | USART_SR_FE)));
+}
+
+/**
+ * Do everything that happens without the line moving: DMA requests, a
+ * waiting byte going into the shifter, and interrupts. Returns nonzero if
+ * anything did.
+ */
+static int sim_usart_step(struct sim_usart *u, uint64_t now)
+{
+    USART_TypeDef *reg = u->reg;
+    int did = 0;
+    int i;
+
+    sim_usart_sync(u);
+
+    if ((reg->CR3 & USART_CR3_DMAT) && !u->tdr_full
+            && (i = sim_dma_find(u, 1)) >= 0) {
+        u->tdr = *sim_dma_ptr(i);
+        u->tdr_full = 1;
+        u->sr &= ~(USART_SR_TXE | USART_SR_TC);
+        sim_dma_count(i);
+        did = 1;
+    }
+
+    if (u->tdr_full && !u->shifting && (reg->CR1 & USART_CR1_TE)) {
+        u->shift = u->tdr;
+        u->shifting = 1;
+        u->frame_end = now + sim_frame_ns(u);
+        u->tdr_full = 0;
+        u->sr |= USART_SR_TXE;
+        did = 1;
+    }
+
+    if ((reg->CR3 & USART_CR3_DMAR) && u->rdr_full
+            && (i = sim_dma_find(u, 0)) >= 0) {
+        *sim_dma_ptr(i) = u->rdr;
+        sim_usart_read(u);
+        if (u->idle_seen)
+            u->sr &= ~USART_SR_IDLE;
+        sim_dma_count(i);
+        did = 1;
+    }
+
+    if (sim_usart_pending(u)) {
+        sim_usart_isr(u);
+        did = 1;
+    }
+
+    sim_usart_sync(u);
+    return did;
+}
+
+/** Run everything that is ready to run at a moment in time. */
+static void sim_settle(uint64_t now)
+{
+    sim_dma_sync();
+
+    for (int n = 0; n < SIM_SETTLE_MAX; n++) {
+        int did = 0;
+
+        for (int i = 0; i < 5; i++)
+            if (sim_usart_regs[i].CR1 & USART_CR1_UE)
+                did |= sim_usart_step(&sim_usarts[i], now);
+        did |= sim_dma_irqs();
+
+        if (!did)
+            break;
+    }
+}
+
+/** A frame has gone out; with the loopback on, it arrives too. */
+static void sim_usart_frame(struct sim_usart *u)
+{
+    USART_TypeDef *reg = u->reg;
+
+    u->shifting = 0;
+
+    if ((reg->CR3 & USART_CR3_HDSEL) && (reg->CR1 & USART_CR1_RE)) {
+        if (u->rdr_full) {
+            u->sr |= USART_SR_ORE;
+        } else {
+            u->rdr = u->shift;
+            u->rdr_full = 1;
+            u->sr |= USART_SR_RXNE;
+        }
+        u->rx_active = 1;
+        u->idle_seen = 0;
+        u->rx_last = u->frame_end;
+    }
+
+    if (!u->tdr_full)
+        u->sr |= USART_SR_TC;
+}
+
+/**
+ * Move the line along to now, one frame at a time, and idle it. If this
+ * thread has fallen well behind, the line waits for it rather than
+ * delivering a burst of bytes faster than the drivers could ever see them
+ * on the target.
+ */
+static uint64_t sim_advance(uint64_t now)
+{
+    uint64_t next = now + 1000000;
+
+    for (int i = 0; i < 5; i++) {
+        struct sim_usart *u = &sim_usarts[i];
+        uint64_t frame = sim_frame_ns(u);
+
+        if (u->shifting && u->frame_end + frame * SIM_SLIP_FRAMES < now)
+            u->frame_end = now;
+    }
+
+    for (;;) {
+        struct sim_usart *first = NULL;
+
+        for (int i = 0; i < 5; i++) {
+            struct sim_usart *u = &sim_usarts[i];
+
+            if (u->shifting && u->frame_end <= now
+                    && (first == NULL || u->frame_end < first->frame_end))
+                first = u;
+        }
+        if (first == NULL)
+            break;
+
+        uint64_t t = first->frame_end;
+
+        sim_usart_frame(first);
+        sim_settle(t);
+    }
+
+    for (int i = 0; i < 5; i++) {
+        struct sim_usart *u = &sim_usarts[i];
+
+        if (u->rx_active) {
+            uint64_t idle = u->rx_last + sim_frame_ns(u);
+
+            if (idle <= now) {
+                u->rx_active = 0;
+                u->sr |= USART_SR_IDLE;
+                sim_settle(now);
+            } else if (idle < next) {
+                next = idle;
+            }
+        }
+        if (u->shifting && u->frame_end < next)
+            next = u->frame_end;
+    }
+
+    return next;
+}
+
+static void *sim_main(void *arg)
+{
+    pthread_mutex_lock(&sim_irq);
+    while (sim_running) {
+        uint64_t now = sim_now();
+
+        sim_settle(now);
+        struct timespec until = sim_abstime(sim_advance(now));
+
+        pthread_cond_timedwait(&sim_kick, &sim_irq, &until);
+    }
+    pthread_mutex_unlock(&sim_irq);
+
+    return NULL;
+}
+
+/** Reset the peripherals and start the simulation thread. */
+void sim_start(void)
+{
+    pthread_mutexattr_t attr;
+
+    // the DMA controller only takes 32-bit addresses
+    ASSERT((uintptr_t)sim_usart_regs < UINT32_MAX);
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&sim_irq, &attr);
+    pthread_mutexattr_destroy(&attr);
+    sim_cond_init(&sim_kick);
+
+    sim_epoch = sim_clock();
+
+    for (int i = 0; i < 5; i++) {
+        sim_usarts[i].sr = USART_SR_TXE | USART_SR_TC;
+        sim_usarts[i].reg->DR = SIM_DR_RX;
+        sim_usart_sync(&sim_usarts[i]);
+    }
+
+    sim_running = 1;
+    ASSERT(!pthread_create(&sim_thread, NULL, sim_main, NULL));
+}
+
+/** Stop the simulation thread. */
+void sim_stop(void)
+{
+    sim_irq_lock();
+    sim_running = 0;
+    sim_irq_unlock();
+    pthread_join(sim_thread, NULL);
+}
+
+// vim: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab: